@@ -0,0 +1,269 @@
+#define _GNU_SOURCE // POLLRDHUP
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+#include "admit.h"
+#include "metrics.h"
+
+// Connections being turned away at once; beyond this they are just closed
+#define ADMIT_SHED_MAX 256
+// How long a turned-away client has to send the command the busy reply answers
+#define ADMIT_SHED_WAIT_MS 1000
+// Pause after accept fails for lack of descriptors or memory
+#define ADMIT_ACCEPT_BACKOFF_US 100000
+
+struct pending {
+    int fd;
+    uint64_t since_us;
+};
+
+static int max_sessions = 64;
+static int queue_max = 64;
+static int queue_wait_ms = 10000;
+static int retry_after_ms = 500;
+
+static pid_t *sessions = NULL;      // running sessions, unordered
+static int active = 0;
+static struct pending *queue = NULL; // oldest first
+static int queue_len = 0;
+static struct pending shed[ADMIT_SHED_MAX];
+static int shed_len = 0;
+static struct pollfd *fds = NULL;   // listening socket, queue, then shed
+
+static volatile sig_atomic_t child_exited = 0;
+
+static void on_sigchld(int sig) {
+    (void)sig;
+    child_exited = 1; // poll() returns EINTR and the loop reaps
+}
+
+static int read_setting(const char *name, int fallback) {
+    const char *env = getenv(name);
+    return env != NULL && *env != '\0' ? atoi(env) : fallback;
+}
+
+int admit_init(void) {
+    max_sessions = read_setting("FILESNAP_MAX_SESSIONS", max_sessions);
+    queue_max = read_setting("FILESNAP_SESSION_QUEUE", queue_max);
+    queue_wait_ms = read_setting("FILESNAP_QUEUE_WAIT_MS", queue_wait_ms);
+    retry_after_ms = read_setting("FILESNAP_RETRY_AFTER_MS", retry_after_ms);
+    if (max_sessions < 1) {
+        max_sessions = 1;
+    }
+    if (queue_max < 0) {
+        queue_max = 0;
+    }
+    sessions = calloc(max_sessions, sizeof(pid_t));
+    queue = calloc(queue_max > 0 ? queue_max : 1, sizeof(struct pending));
+    fds = calloc(1 + queue_max + ADMIT_SHED_MAX, sizeof(struct pollfd));
+    if (sessions == NULL || queue == NULL || fds == NULL) {
+        perror("calloc admit");
+        return -1;
+    }
+
+    // No SA_RESTART: an exiting session should wake the loop up
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigchld;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_NOCLDSTOP;
+    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
+        perror("sigaction SIGCHLD");
+        return -1;
+    }
+    return 0;
+}
+
+int admit_queue_wait_ms(void) {
+    return queue_wait_ms;
+}
+
+void admit_busy_message(char *buf, size_t size) {
+    snprintf(buf, size, "Server busy, retry after %d ms\n", retry_after_ms);
+}
+
+// Collect every session that has exited; other children (the cache watcher,
+// the index refresher) are reaped too should they ever exit
+static void reap(void) {
+    child_exited = 0;
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        for (int i = 0; i < active; i++) {
+            if (sessions[i] == pid) {
+                sessions[i] = sessions[--active];
+                break;
+            }
+        }
+    }
+}
+
+static void start_shedding(int fd) {
+    metrics_request_shed();
+    if (shed_len == ADMIT_SHED_MAX) {
+        close(fd);
+        return;
+    }
+    shed[shed_len].fd = fd;
+    shed[shed_len].since_us = metrics_now_us();
+    shed_len++;
+}
+
+// Archive replies start with a size, everything else is text; w24prep replies are text
+static int archive_framing(const char *command) {
+    static const char *archive_commands[] = { "w24fz ", "w24ft ", "w24fdb ", "w24fda ", "w24fc -a ", "w24range " };
+    for (size_t i = 0; i < sizeof(archive_commands) / sizeof(archive_commands[0]); i++) {
+        if (strncmp(command, archive_commands[i], strlen(archive_commands[i])) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Answer the first command of a turned-away connection with the busy reply
+static void answer_busy(int fd) {
+    char command[1024];
+    ssize_t n = recv(fd, command, sizeof(command) - 1, MSG_DONTWAIT);
+    if (n > 0) {
+        command[n] = '\0';
+        char msg[128], reply[160];
+        admit_busy_message(msg, sizeof(msg));
+        int len = snprintf(reply, sizeof(reply), "%s\nEND_OF_RESPONSE\n", msg);
+        if (archive_framing(command)) {
+            const off_t no_archive = 0;
+            send(fd, &no_archive, sizeof(off_t), MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+        send(fd, reply, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    close(fd);
+}
+
+static void drop_queued(int i) {
+    close(queue[i].fd);
+    memmove(&queue[i], &queue[i + 1], (queue_len - i - 1) * sizeof(struct pending));
+    queue_len--;
+}
+
+int admit_next(int server_fd, int (*on_accept)(int client_socket)) {
+    while (1) {
+        reap();
+        uint64_t now = metrics_now_us();
+        // Whoever waited too long for a session gets the busy reply instead
+        while (queue_len > 0 && now - queue[0].since_us >= (uint64_t)queue_wait_ms * 1000) {
+            int fd = queue[0].fd;
+            queue[0].fd = -1;
+            drop_queued(0);
+            start_shedding(fd);
+        }
+        if (queue_len > 0 && active < max_sessions) {
+            int fd = queue[0].fd;
+            queue[0].fd = -1;
+            memmove(&queue[0], &queue[1], (queue_len - 1) * sizeof(struct pending));
+            queue_len--;
+            return fd;
+        }
+
+        int nfds = 0;
+        int timeout_ms = -1;
+        fds[nfds++] = (struct pollfd){ .fd = server_fd, .events = POLLIN };
+        for (int i = 0; i < queue_len; i++) {
+            // Only a client that goes away matters; its command can wait in the socket
+            fds[nfds++] = (struct pollfd){ .fd = queue[i].fd, .events = POLLRDHUP };
+        }
+        for (int i = 0; i < shed_len; i++) {
+            fds[nfds++] = (struct pollfd){ .fd = shed[i].fd, .events = POLLIN };
+        }
+        if (queue_len > 0) {
+            timeout_ms = queue_wait_ms - (int)((now - queue[0].since_us) / 1000);
+        }
+        for (int i = 0; i < shed_len; i++) {
+            int left = ADMIT_SHED_WAIT_MS - (int)((now - shed[i].since_us) / 1000);
+            if (timeout_ms == -1 || left < timeout_ms) {
+                timeout_ms = left;
+            }
+        }
+        if (timeout_ms != -1 && timeout_ms < 1) {
+            timeout_ms = 1;
+        }
+
+        if (poll(fds, nfds, timeout_ms) == -1) {
+            if (errno != EINTR) {
+                perror("poll");
+                usleep(ADMIT_ACCEPT_BACKOFF_US);
+            }
+            continue;
+        }
+
+        // Back to front, so removing an entry leaves the earlier ones in place
+        now = metrics_now_us();
+        for (int i = shed_len - 1; i >= 0; i--) {
+            struct pollfd *p = &fds[1 + queue_len + i];
+            if (p->revents != 0 || now - shed[i].since_us >= ADMIT_SHED_WAIT_MS * 1000) {
+                answer_busy(shed[i].fd);
+                shed[i] = shed[--shed_len];
+            }
+        }
+        for (int i = queue_len - 1; i >= 0; i--) {
+            if (fds[1 + i].revents & (POLLRDHUP | POLLHUP | POLLERR)) {
+                drop_queued(i);
+            }
+        }
+
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd == -1) {
+            // Out of descriptors or memory: leave the connection in the backlog for now
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                perror("accept");
+                usleep(ADMIT_ACCEPT_BACKOFF_US);
+            } else if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED) {
+                perror("accept");
+            }
+            continue;
+        }
+        if (on_accept != NULL && on_accept(fd) == -1) {
+            continue;
+        }
+        if (active < max_sessions && queue_len == 0) {
+            return fd;
+        }
+        if (queue_len < queue_max) {
+            queue[queue_len].fd = fd;
+            queue[queue_len].since_us = now;
+            queue_len++;
+        } else {
+            start_shedding(fd);
+        }
+    }
+}
+
+void admit_started(pid_t pid, int client_socket) {
+    if (pid < 0) {
+        start_shedding(client_socket);
+        return;
+    }
+    if (active < max_sessions) {
+        sessions[active++] = pid;
+    }
+}
+
+void admit_child(void) {
+    signal(SIGCHLD, SIG_DFL);
+    for (int i = 0; i < queue_len; i++) {
+        close(queue[i].fd);
+    }
+    for (int i = 0; i < shed_len; i++) {
+        close(shed[i].fd);
+    }
+    queue_len = 0;
+    shed_len = 0;
+}
@@ -0,0 +1,41 @@
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Admission control for the accept loop. At most a configured number of
+// sessions run at once. Beyond that, accepted connections wait in a bounded
+// queue, oldest first, until a session ends. A connection that finds the queue
+// full or waits too long is turned away with a busy reply in the framing of
+// its first command, sent by the accept loop itself without forking. Ended
+// sessions are reaped as soon as they exit.
+//
+//   FILESNAP_MAX_SESSIONS     sessions running at once (default 64)
+//   FILESNAP_SESSION_QUEUE    connections waiting for a session (default 64)
+//   FILESNAP_QUEUE_WAIT_MS    longest wait for a session or a lane slot (default 10000)
+//   FILESNAP_RETRY_AFTER_MS   retry hint given in busy replies (default 500)
+
+// Read the limits and start reaping sessions; call once in the parent
+int admit_init(void);
+
+// Wait for the next connection to start a session for. on_accept, if given,
+// is called for every accepted connection first; it returns -1 if it has
+// dealt with (and closed) the connection itself.
+int admit_next(int server_fd, int (*on_accept)(int client_socket));
+
+// Record the session forked for a connection, or turn the connection away
+// if the fork failed (pid < 0)
+void admit_started(pid_t pid, int client_socket);
+
+// In a freshly forked session: drop what belongs to the accept loop
+void admit_child(void);
+
+// "Server busy, retry after N ms" with a newline, for handlers that have to
+// turn a command away
+void admit_busy_message(char *buf, size_t size);
+
+// Longest wait for a session or a lane slot, in milliseconds
+int admit_queue_wait_ms(void);
+
+#endif
@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "archive.h"
+#include "metrics.h"
+#include "trace.h"
+
+// tar and gzip yield the CPU to the handlers of cheap commands
+#define ARCHIVE_NICE 10
+
+// A member of an archive with what its place in the "type" order depends on
+struct member {
+    const char *path;
+    const char *extension;  // "" if the name has none
+    size_t directory;       // length of the directory part, last slash included
+    off_t size;
+};
+
+static int order_by_type = 0;
+
+void archive_init(void) {
+    const char *env = getenv("FILESNAP_ARCHIVE_ORDER");
+    order_by_type = env != NULL && strcmp(env, "type") == 0;
+}
+
+const char *archive_order(void) {
+    return order_by_type ? "type" : "find";
+}
+
+long archive_collect(const char *find_cmd, const char *list_path) {
+    uint64_t started = metrics_now_us();
+    FILE *fp = popen(find_cmd, "r");
+    if (fp == NULL) {
+        perror("popen");
+        return -1;
+    }
+    FILE *list = fopen(list_path, "w");
+    if (list == NULL) {
+        perror("fopen list");
+        pclose(fp);
+        return -1;
+    }
+
+    char buf[65536];
+    size_t n;
+    long count = 0;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        // Each path is NUL terminated, so counting NULs counts files
+        for (char *p = buf; (p = memchr(p, '\0', buf + n - p)) != NULL; p++) {
+            count++;
+        }
+        fwrite(buf, 1, n, list);
+    }
+    fclose(list);
+    pclose(fp);
+
+    trace_span(TRACE_FILTER, started);
+    metrics_record_phase(PHASE_FILTER, metrics_now_us() - started);
+    trace_note_files(count);
+    return count;
+}
+
+long archive_load_list(const char *list_path, char **data, char ***paths) {
+    *data = NULL;
+    *paths = NULL;
+    int fd = open(list_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror("open list");
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    char *buf = malloc(st.st_size + 1);
+    size_t have = 0;
+    ssize_t n = 0;
+    while (buf != NULL && have < (size_t)st.st_size && (n = read(fd, buf + have, st.st_size - have)) > 0) {
+        have += n;
+    }
+    close(fd);
+    if (buf == NULL || n == -1) {
+        free(buf);
+        return -1;
+    }
+    buf[have] = '\0'; // An unterminated last path still ends
+
+    long count = 0;
+    for (char *p = buf; p < buf + have; p += strlen(p) + 1) {
+        count++;
+    }
+    char **list = malloc((count + 1) * sizeof(char *));
+    if (list == NULL) {
+        free(buf);
+        return -1;
+    }
+    long i = 0;
+    for (char *p = buf; p < buf + have; p += strlen(p) + 1) {
+        list[i++] = p;
+    }
+    *data = buf;
+    *paths = list;
+    return count;
+}
+
+int archive_save_list(const char *list_path, char *const *paths, size_t count, const unsigned char *keep) {
+    FILE *list = fopen(list_path, "w");
+    if (list == NULL) {
+        perror("fopen list");
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (keep == NULL || keep[i]) {
+            fwrite(paths[i], 1, strlen(paths[i]) + 1, list);
+        }
+    }
+    return fclose(list) == 0 ? 0 : -1;
+}
+
+static int compare_members(const void *a, const void *b) {
+    const struct member *x = a, *y = b;
+    int c = strcmp(x->extension, y->extension);
+    if (c != 0) {
+        return c;
+    }
+    // A directory sorts right before its subdirectories, so a subtree stays together
+    c = memcmp(x->path, y->path, x->directory < y->directory ? x->directory : y->directory);
+    if (c != 0) {
+        return c;
+    }
+    if (x->directory != y->directory) {
+        return x->directory < y->directory ? -1 : 1;
+    }
+    if (x->size != y->size) {
+        return x->size < y->size ? -1 : 1;
+    }
+    return strcmp(x->path, y->path);
+}
+
+// Rewrite the list at list_path in the "type" order. gzip only finds repeats
+// within the last 32 KB, so files of a kind compress better next to each other
+// than scattered through the tree. Each member is stat'ed once, here; one that
+// is gone since the list was made is dropped rather than failing tar. On any
+// other failure the list is left as it was.
+static void order_list(const char *list_path) {
+    char *data, **paths;
+    long count = archive_load_list(list_path, &data, &paths);
+    struct member *members = count > 1 ? malloc(count * sizeof(struct member)) : NULL;
+    if (members == NULL) {
+        free(data);
+        free(paths);
+        return;
+    }
+    long kept = 0;
+    for (long i = 0; i < count; i++) {
+        struct stat st;
+        if (lstat(paths[i], &st) == -1) {
+            continue;
+        }
+        const char *slash = strrchr(paths[i], '/');
+        const char *name = slash != NULL ? slash + 1 : paths[i];
+        const char *dot = strrchr(name, '.');
+        struct member *m = &members[kept++];
+        m->path = paths[i];
+        m->extension = dot != NULL && dot != name ? dot + 1 : "";
+        m->directory = name - paths[i];
+        m->size = st.st_size;
+    }
+    qsort(members, kept, sizeof(struct member), compare_members);
+    for (long i = 0; i < kept; i++) {
+        paths[i] = (char *)members[i].path;
+    }
+    archive_save_list(list_path, paths, kept, NULL);
+    free(members);
+    free(data);
+    free(paths);
+}
+
+int archive_create(const char *list_path, const char *tar_path) {
+    unlink(tar_path);
+    int out = open(tar_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out == -1) {
+        perror("open tar");
+        return -1;
+    }
+    int status = archive_create_fd(list_path, out);
+    close(out);
+    return status;
+}
+
+int archive_create_fd(const char *list_path, int out) {
+    int pipefd[2];
+    if (pipe(pipefd) == -1) {
+        perror("pipe");
+        return -1;
+    }
+
+    if (order_by_type) {
+        uint64_t order_started = metrics_now_us();
+        order_list(list_path);
+        trace_span(TRACE_ORDER, order_started);
+    }
+    uint64_t started = metrics_now_us();
+    pid_t tar_pid = fork();
+    if (tar_pid == 0) {
+        // tar writes the uncompressed stream into the pipe, the file list goes to stderr
+        dup2(pipefd[1], STDOUT_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        close(out);
+        nice(ARCHIVE_NICE);
+        execlp("tar", "tar", "-cvf", "-", "--null", "-T", list_path, (char *)NULL);
+        perror("exec tar");
+        _exit(127);
+    }
+    pid_t gzip_pid = fork();
+    if (gzip_pid == 0) {
+        dup2(pipefd[0], STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        close(out);
+        nice(ARCHIVE_NICE);
+        execlp("gzip", "gzip", "-c", ARCHIVE_GZIP_LEVEL, (char *)NULL);
+        perror("exec gzip");
+        _exit(127);
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    if (tar_pid < 0 || gzip_pid < 0) {
+        perror("fork");
+        if (tar_pid > 0) waitpid(tar_pid, NULL, 0);
+        if (gzip_pid > 0) waitpid(gzip_pid, NULL, 0);
+        return -1;
+    }
+
+    // tar finishing marks the end of reading files; gzip drains the rest
+    int tar_status = 0, gzip_status = 0;
+    waitpid(tar_pid, &tar_status, 0);
+    trace_span(TRACE_ARCHIVE, started);
+    waitpid(gzip_pid, &gzip_status, 0);
+    trace_span(TRACE_COMPRESS, started);
+    metrics_record_phase(PHASE_COMPRESS, metrics_now_us() - started);
+
+    if (!WIFEXITED(gzip_status) || WEXITSTATUS(gzip_status) != 0) {
+        return -1;
+    }
+    // tar exits 1 when a file changed as it was read; anything else means files are missing
+    if (!WIFEXITED(tar_status) || WEXITSTATUS(tar_status) > 1) {
+        return -1;
+    }
+    return WEXITSTATUS(tar_status);
+}
+
+int archive_spool_store(const char *spool_dir, const char *tar_path, char *id, size_t id_size, off_t *size) {
+    static unsigned long sequence = 0;
+    mkdir(spool_dir, 0777);
+    snprintf(id, id_size, "%08lx%06x%04lx", (unsigned long)time(NULL), (unsigned)getpid(), ++sequence);
+
+    char path[1024];
+    archive_spool_path(spool_dir, id, path, sizeof(path));
+    if (rename(tar_path, path) == -1) {
+        perror("rename spool");
+        return -1;
+    }
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        perror("stat spool");
+        return -1;
+    }
+    *size = st.st_size;
+    return 0;
+}
+
+int archive_spool_path(const char *spool_dir, const char *id, char *path, size_t size) {
+    // Ids are plain hex so a client can never name a file outside the spool
+    if (*id == '\0' || strlen(id) > 48) {
+        return -1;
+    }
+    for (const char *p = id; *p != '\0'; p++) {
+        if (!isxdigit((unsigned char)*p)) {
+            return -1;
+        }
+    }
+    snprintf(path, size, "%s/%s.tar.gz", spool_dir, id);
+    return 0;
+}
+
+void archive_spool_sweep(const char *spool_dir, int max_age) {
+    DIR *dir = opendir(spool_dir);
+    if (dir == NULL) {
+        return;
+    }
+    time_t now = time(NULL);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char path[1024];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", spool_dir, entry->d_name);
+        if (stat(path, &st) == 0 && now - st.st_mtime > max_age) {
+            unlink(path);
+        }
+    }
+    closedir(dir);
+}
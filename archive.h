@@ -0,0 +1,57 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Run a find command that prints NUL-terminated paths and save its output
+// to list_path. Returns the number of paths found, or -1 on error.
+long archive_collect(const char *find_cmd, const char *list_path);
+
+// Read back a list saved by archive_collect. *paths points into *data;
+// the caller frees both. Returns the number of paths, or -1 on error.
+long archive_load_list(const char *list_path, char **data, char ***paths);
+
+// Save the paths whose keep flag is set (all of them if keep is NULL) as a
+// list for archive_create. Returns 0, or -1 on error.
+int archive_save_list(const char *list_path, char *const *paths, size_t count, const unsigned char *keep);
+
+// Order of the members in an archive, read from the environment:
+//   FILESNAP_ARCHIVE_ORDER  "find" (default) keeps the order the list was saved
+//                           in; "type" groups files by extension, then by
+//                           directory and size, so similar content falls within
+//                           gzip's 32 KB window together
+// Call once in the parent before forking.
+void archive_init(void);
+
+// Name of the member order in use; part of every result cache key
+const char *archive_order(void);
+
+// Compression applied by archive_create; part of every result cache key
+#define ARCHIVE_GZIP_LEVEL "-6"
+#define ARCHIVE_COMPRESSION "gzip" ARCHIVE_GZIP_LEVEL
+
+// Build a gzip-compressed tar of the paths in list_path. tar and gzip run
+// as separate processes so the archive and compress phases can be timed
+// on their own. tar_path is replaced, not overwritten, since earlier results
+// may still be linked into the cache or spool.
+// Returns 0, 1 if some files changed while tar read them (the archive is
+// still complete), or -1 if the archive cannot be used.
+int archive_create(const char *list_path, const char *tar_path);
+
+// Same, writing the compressed archive to an open file descriptor
+int archive_create_fd(const char *list_path, int out);
+
+// Archives prepared for ranged download live in a spool directory that
+// every node on the host shares, so any of them can serve any segment.
+
+// Move tar_path into the spool under a fresh id. Returns 0 and fills id and size, or -1.
+int archive_spool_store(const char *spool_dir, const char *tar_path, char *id, size_t id_size, off_t *size);
+
+// Path of the spooled archive with the given id; -1 if the id is malformed
+int archive_spool_path(const char *spool_dir, const char *id, char *path, size_t size);
+
+// Remove spooled archives older than max_age seconds
+void archive_spool_sweep(const char *spool_dir, int max_age);
+
+#endif
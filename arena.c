@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+struct arena_block {
+    struct arena_block *next;
+    char *end;
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+void arena_init(struct arena *arena, size_t block_size) {
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->next = NULL;
+    arena->block_size = block_size;
+}
+
+static struct arena_block *new_block(size_t size) {
+    struct arena_block *block = malloc(sizeof(struct arena_block) + size);
+    if (block == NULL) {
+        perror("malloc arena");
+        exit(EXIT_FAILURE);
+    }
+    block->next = NULL;
+    block->end = block->data + size;
+    return block;
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (arena->current != NULL && (size_t)(arena->current->end - arena->next) >= size) {
+        void *p = arena->next;
+        arena->next += size;
+        return p;
+    }
+
+    // Move on to the next kept block if it is big enough, otherwise put a new one in front of it
+    struct arena_block *block = arena->current != NULL ? arena->current->next : arena->first;
+    if (block == NULL || (size_t)(block->end - block->data) < size) {
+        struct arena_block *fresh = new_block(size > arena->block_size ? size : arena->block_size);
+        fresh->next = block;
+        if (arena->current != NULL) {
+            arena->current->next = fresh;
+        } else {
+            arena->first = fresh;
+        }
+        block = fresh;
+    }
+    arena->current = block;
+    arena->next = block->data + size;
+    return block->data;
+}
+
+char *arena_strndup(struct arena *arena, const char *s, size_t length) {
+    char *copy = arena_alloc(arena, length + 1);
+    memcpy(copy, s, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+struct arena_mark arena_mark(struct arena *arena) {
+    struct arena_mark mark = {arena->current, arena->next};
+    return mark;
+}
+
+void arena_release(struct arena *arena, struct arena_mark mark) {
+    arena->current = mark.block;
+    arena->next = mark.next;
+}
+
+void arena_reset(struct arena *arena) {
+    if (arena->first == NULL) {
+        return;
+    }
+    struct arena_block *block = arena->first->next;
+    while (block != NULL) {
+        struct arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->first->next = NULL;
+    arena->current = NULL;
+    arena->next = NULL;
+}
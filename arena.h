@@ -0,0 +1,46 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Bump allocator for the scratch memory of one request: traversal state,
+// path fragments and result lists. Allocation is a pointer increment in the
+// current block; nothing is freed on its own. A walker takes a mark on the
+// way into a directory and releases back to it on the way out, so memory
+// stays bounded by the depth of the walk, and the whole arena is reset in
+// one step when the request is done. Blocks released to a mark are kept and
+// reused; a reset returns all but the first block to the system.
+
+struct arena_block;
+
+struct arena {
+    struct arena_block *first;
+    struct arena_block *current;
+    char *next;                 // first free byte in current
+    size_t block_size;
+};
+
+struct arena_mark {
+    struct arena_block *block;
+    char *next;
+};
+
+// Empty arena; blocks are block_size bytes unless an allocation needs more
+void arena_init(struct arena *arena, size_t block_size);
+
+// size bytes aligned for any type; exits if no memory is left, like the
+// handlers' other allocation failures
+void *arena_alloc(struct arena *arena, size_t size);
+
+// Copy of the first length bytes of s, NUL-terminated
+char *arena_strndup(struct arena *arena, const char *s, size_t length);
+
+struct arena_mark arena_mark(struct arena *arena);
+
+// Free everything allocated since mark
+void arena_release(struct arena *arena, struct arena_mark mark);
+
+// Free everything; keeps the first block for the next request
+void arena_reset(struct arena *arena);
+
+#endif
@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "treegen.h"
+
+void print_usage(const char *prog) {
+    printf("Usage: %s -o <dir> [options]\n", prog);
+    printf("   -o <dir>     Root of the generated tree (required)\n");
+    printf("   -s <seed>    PRNG seed (default 42)\n");
+    printf("   -f <files>   Number of files (default 1000)\n");
+    printf("   -d <depth>   Directory levels below the root (default 3)\n");
+    printf("   -b <fanout>  Subdirectories per directory (default 4)\n");
+    printf("   -m <bytes>   Minimum file size (default 64)\n");
+    printf("   -M <bytes>   Maximum file size, sizes are log-uniform (default 1048576)\n");
+    printf("   -e <list>    Comma separated extensions (default c,h,txt,log,md,bin)\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct treegen_options opts;
+    treegen_defaults(&opts);
+    const char *root = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "o:s:f:d:b:m:M:e:h")) != -1) {
+        switch (opt) {
+            case 'o': root = optarg; break;
+            case 's': opts.seed = strtoull(optarg, NULL, 10); break;
+            case 'f': opts.files = atol(optarg); break;
+            case 'd': opts.depth = atoi(optarg); break;
+            case 'b': opts.fanout = atoi(optarg); break;
+            case 'm': opts.min_size = atol(optarg); break;
+            case 'M': opts.max_size = atol(optarg); break;
+            case 'e': opts.extensions = optarg; break;
+            default:
+                print_usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (root == NULL || opts.files < 0 || opts.depth < 0 || opts.fanout < 1) {
+        print_usage(argv[0]);
+        return 2;
+    }
+
+    struct treegen_result result;
+    if (treegen_build(root, &opts, &result) != 0) {
+        return 1;
+    }
+    printf("root=%s seed=%llu dirs=%ld files=%ld bytes=%lld\n", root,
+           (unsigned long long)opts.seed, result.dirs, result.files, result.bytes);
+    return 0;
+}
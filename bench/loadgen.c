@@ -0,0 +1,402 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "treegen.h"
+
+#define COORDINATOR_PORT 8084
+#define MAX_MIX 32
+#define END_MARKER "\nEND_OF_RESPONSE\n"
+
+struct mix_entry {
+    int weight;
+    char command[256];
+    char name[16];  // first word, used to group results
+};
+
+// One finished request, sent from a session process to the parent
+struct sample {
+    int entry;
+    int ok;
+    uint64_t usec;
+    uint64_t bytes;
+};
+
+static struct mix_entry mix[MAX_MIX];
+static int mix_count = 0;
+static int total_weight = 0;
+
+static const char *host = "127.0.0.1";
+static int port = COORDINATOR_PORT;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void print_usage(const char *prog) {
+    printf("Usage: %s [options]\n", prog);
+    printf("   -H <host>         Server address (default 127.0.0.1)\n");
+    printf("   -p <port>         Coordinator port (default 8084)\n");
+    printf("   -c <sessions>     Concurrent client sessions (default 8)\n");
+    printf("   -n <requests>     Measured requests per session (default 100)\n");
+    printf("   -w <requests>     Warm-up requests per session, not measured (default 5)\n");
+    printf("   -m <w:command>    Add a command to the mix with weight w, e.g. -m \"5:w24fn f000001.c\"\n");
+    printf("   -s <seed>         Seed for picking commands from the mix (default 1)\n");
+    printf("   -j                Also print one JSON object per command\n");
+}
+
+static int add_mix(const char *spec) {
+    if (mix_count >= MAX_MIX) {
+        fprintf(stderr, "Too many mix entries\n");
+        return -1;
+    }
+    const char *colon = strchr(spec, ':');
+    struct mix_entry *e = &mix[mix_count];
+    e->weight = colon ? atoi(spec) : 1;
+    snprintf(e->command, sizeof(e->command), "%s", colon ? colon + 1 : spec);
+    if (e->weight <= 0 || e->command[0] == '\0') {
+        fprintf(stderr, "Invalid mix entry: %s\n", spec);
+        return -1;
+    }
+    size_t len = strcspn(e->command, " ");
+    if (len >= sizeof(e->name)) {
+        len = sizeof(e->name) - 1;
+    }
+    memcpy(e->name, e->command, len);
+    e->name[len] = '\0';
+    total_weight += e->weight;
+    mix_count++;
+    return 0;
+}
+
+// Default mix matches the names produced by gentree with its default options
+static void default_mix(void) {
+    struct treegen_options opts;
+    treegen_defaults(&opts);
+    char name[64], spec[128];
+    treegen_file_name(&opts, 7, name, sizeof(name));
+    snprintf(spec, sizeof(spec), "4:w24fn %s", name);
+    add_mix(spec);
+    add_mix("4:w24fn no-such-file.txt");
+    add_mix("2:dirlist -a");
+    add_mix("1:dirlist -t");
+    add_mix("1:w24fz 1000 20000");
+    add_mix("1:w24ft c h");
+    add_mix("1:w24fdb 2021-01-01");
+    add_mix("1:w24fda 2025-06-01");
+}
+
+static int connect_port(int p) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(p);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) <= 0 ||
+        connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Connect through the coordinator the same way clientw24 does
+static int open_session(void) {
+    int sock = connect_port(port);
+    if (sock < 0) {
+        return -1;
+    }
+    char line[16];
+    size_t n = 0;
+    while (n < sizeof(line) - 1) {
+        if (read(sock, &line[n], 1) != 1) {
+            close(sock);
+            return -1;
+        }
+        if (line[n++] == '\n') {
+            break;
+        }
+    }
+    line[n] = '\0';
+    int next = atoi(line);
+    if (next != 0 && next != port) {
+        close(sock);
+        return connect_port(next);
+    }
+    return sock;
+}
+
+static int read_exact(int sock, void *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(sock, (char *)buf + got, len - got);
+        if (n <= 0) {
+            return -1;
+        }
+        got += n;
+    }
+    return 0;
+}
+
+// Text replies end with the end marker, which may be split across reads
+static long read_until_marker(int sock) {
+    char buf[65536 + sizeof(END_MARKER)];
+    size_t keep = 0, marker_len = strlen(END_MARKER);
+    long total = 0;
+    while (1) {
+        ssize_t n = read(sock, buf + keep, 65536);
+        if (n <= 0) {
+            return -1;
+        }
+        total += n;
+        size_t have = keep + n;
+        buf[have] = '\0';
+        if (memmem(buf, have, END_MARKER, marker_len) != NULL) {
+            return total;
+        }
+        keep = have < marker_len ? have : marker_len - 1;
+        memmove(buf, buf + have - keep, keep);
+    }
+}
+
+static int skip_bytes(int sock, off_t left) {
+    char buf[65536];
+    while (left > 0) {
+        ssize_t n = read(sock, buf, left < (off_t)sizeof(buf) ? left : (off_t)sizeof(buf));
+        if (n <= 0) {
+            return -1;
+        }
+        left -= n;
+    }
+    return 0;
+}
+
+// Archive replies are an off_t size plus the archive and its 8-byte digest, or size 0 and a
+// message ending with the end marker, or size -1 and length-prefixed chunks up to a
+// zero-length one, which the digest follows
+static long read_archive_reply(int sock) {
+    off_t size;
+    if (read_exact(sock, &size, sizeof(size)) == -1) {
+        return -1;
+    }
+    if (size == -1) {
+        long total = 0;
+        off_t chunk;
+        while (read_exact(sock, &chunk, sizeof(chunk)) == 0) {
+            if (chunk == 0) {
+                return skip_bytes(sock, sizeof(uint64_t)) == -1 ? -1 : total;
+            }
+            if (chunk < 0) {
+                return read_until_marker(sock) < 0 ? -1 : 0;
+            }
+            if (skip_bytes(sock, chunk) == -1) {
+                return -1;
+            }
+            total += chunk;
+        }
+        return -1;
+    }
+    if (size <= 0) {
+        return read_until_marker(sock) < 0 ? -1 : 0;
+    }
+    return skip_bytes(sock, size + (off_t)sizeof(uint64_t)) == -1 ? -1 : (long)size;
+}
+
+// Whether a command is answered with an archive, as classifyCommand in the client
+// tells; every other command gets a text reply
+static int archive_reply(const struct mix_entry *e) {
+    return strcmp(e->name, "w24fz") == 0 || strcmp(e->name, "w24ft") == 0 || strcmp(e->name, "w24fdb") == 0 ||
+           strcmp(e->name, "w24fda") == 0 || strncmp(e->command, "w24fc -a ", 9) == 0;
+}
+
+static long run_command(int sock, const struct mix_entry *e) {
+    char line[300];
+    int len = snprintf(line, sizeof(line), "%s\n", e->command);
+    if (send(sock, line, len, 0) != len) {
+        return -1;
+    }
+    if (!archive_reply(e)) {
+        return read_until_marker(sock);
+    }
+    return read_archive_reply(sock);
+}
+
+static int pick(uint64_t *state) {
+    int r = (int)(treegen_next(state) % (uint64_t)total_weight);
+    for (int i = 0; i < mix_count; i++) {
+        if (r < mix[i].weight) {
+            return i;
+        }
+        r -= mix[i].weight;
+    }
+    return mix_count - 1;
+}
+
+static void run_session(int id, int requests, int warmup, uint64_t seed, int out_fd) {
+    int sock = open_session();
+    if (sock < 0) {
+        fprintf(stderr, "session %d: connection failed\n", id);
+        return;
+    }
+    uint64_t state = seed * 1000003 + id;
+    for (int i = 0; i < warmup + requests; i++) {
+        struct sample s;
+        s.entry = pick(&state);
+        uint64_t started = now_us();
+        long bytes = run_command(sock, &mix[s.entry]);
+        s.usec = now_us() - started;
+        s.ok = bytes >= 0;
+        s.bytes = bytes > 0 ? bytes : 0;
+        if (i >= warmup) {
+            write(out_fd, &s, sizeof(s));
+        }
+        if (!s.ok) {
+            // The stream is out of sync after an error, so start a fresh session
+            close(sock);
+            sock = open_session();
+            if (sock < 0) {
+                return;
+            }
+        }
+    }
+    close(sock);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *sorted, long n, double pct) {
+    if (n == 0) {
+        return 0;
+    }
+    long rank = (long)(pct / 100.0 * n);
+    return sorted[rank < n ? rank : n - 1];
+}
+
+int main(int argc, char *argv[]) {
+    int sessions = 8, requests = 100, warmup = 5, json = 0;
+    uint64_t seed = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:c:n:w:m:s:jh")) != -1) {
+        switch (opt) {
+            case 'H': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'c': sessions = atoi(optarg); break;
+            case 'n': requests = atoi(optarg); break;
+            case 'w': warmup = atoi(optarg); break;
+            case 'm': if (add_mix(optarg) == -1) return 2; break;
+            case 's': seed = strtoull(optarg, NULL, 10); break;
+            case 'j': json = 1; break;
+            default:
+                print_usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (sessions < 1 || requests < 1 || warmup < 0) {
+        print_usage(argv[0]);
+        return 2;
+    }
+    if (mix_count == 0) {
+        default_mix();
+    }
+
+    int pipefd[2];
+    if (pipe(pipefd) == -1) {
+        perror("pipe");
+        return 1;
+    }
+
+    // One process per session, like the server's fork-per-connection model
+    uint64_t started = now_us();
+    for (int i = 0; i < sessions; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) {
+            close(pipefd[0]);
+            run_session(i, requests, warmup, seed, pipefd[1]);
+            _exit(0);
+        }
+    }
+    close(pipefd[1]);
+
+    long capacity = (long)sessions * requests;
+    struct sample *samples = malloc(capacity * sizeof(struct sample));
+    long count = 0;
+    struct sample s;
+    while (read_exact(pipefd[0], &s, sizeof(s)) == 0) {
+        if (count < capacity) {
+            samples[count++] = s;
+        }
+    }
+    while (wait(NULL) > 0) {
+    }
+    double elapsed = (now_us() - started) / 1e6;
+
+    // Group by command name so e.g. all w24fn variants are reported together
+    uint64_t *lat = malloc((count > 0 ? count : 1) * sizeof(uint64_t));
+    long long total_bytes = 0;
+    long total_errors = 0;
+    printf("%-8s %8s %7s %10s %10s %10s %10s %12s\n", "command", "count", "errors", "p50_us", "p99_us", "p999_us", "max_us", "bytes");
+    for (int e = 0; e < mix_count; e++) {
+        int seen = 0;
+        for (int k = 0; k < e; k++) {
+            if (strcmp(mix[k].name, mix[e].name) == 0) {
+                seen = 1;
+            }
+        }
+        if (seen) {
+            continue;
+        }
+        long n = 0, errors = 0;
+        long long bytes = 0;
+        for (long i = 0; i < count; i++) {
+            if (strcmp(mix[samples[i].entry].name, mix[e].name) != 0) {
+                continue;
+            }
+            if (!samples[i].ok) {
+                errors++;
+                continue;
+            }
+            lat[n++] = samples[i].usec;
+            bytes += samples[i].bytes;
+        }
+        qsort(lat, n, sizeof(uint64_t), compare_u64);
+        total_bytes += bytes;
+        total_errors += errors;
+        uint64_t p50 = percentile(lat, n, 50), p99 = percentile(lat, n, 99), p999 = percentile(lat, n, 99.9);
+        uint64_t max = n ? lat[n - 1] : 0;
+        printf("%-8s %8ld %7ld %10llu %10llu %10llu %10llu %12lld\n", mix[e].name, n, errors,
+               (unsigned long long)p50, (unsigned long long)p99, (unsigned long long)p999,
+               (unsigned long long)max, bytes);
+        if (json) {
+            printf("{\"command\":\"%s\",\"count\":%ld,\"errors\":%ld,\"p50_us\":%llu,\"p99_us\":%llu,\"p999_us\":%llu,\"max_us\":%llu,\"bytes\":%lld}\n",
+                   mix[e].name, n, errors, (unsigned long long)p50, (unsigned long long)p99,
+                   (unsigned long long)p999, (unsigned long long)max, bytes);
+        }
+    }
+    printf("sessions=%d requests=%ld errors=%ld elapsed=%.3fs throughput=%.1f req/s %.2f MB/s\n",
+           sessions, count, total_errors, elapsed, elapsed > 0 ? count / elapsed : 0.0,
+           elapsed > 0 ? total_bytes / elapsed / 1e6 : 0.0);
+
+    free(lat);
+    free(samples);
+    return total_errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,322 @@
+// Microbenchmarks for the stages behind each server command. The server and
+// client are linked in (built with FILESNAP_BENCH) so the real functions are measured.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "../serverw24.h"
+#include "../clientw24.h"
+#include "../archive.h"
+#include "treegen.h"
+
+#define MAX_ITERATIONS 10000
+// Room for the tree and scratch directories; files in them get BENCH_FILE
+#define BENCH_PATH 1024
+#define BENCH_FILE (BENCH_PATH + 32)
+
+static FILE *results;
+static int warmup = 3;
+static int iterations = 10;
+static const char *only = NULL;
+
+static uint64_t bench_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Run fn warm-up + measured times and emit one JSON line with the distribution
+static void run_bench(const char *name, long long (*fn)(void *), void *arg) {
+    if (only != NULL && strstr(name, only) == NULL) {
+        return;
+    }
+    static uint64_t samples[MAX_ITERATIONS];
+    long long bytes = 0;
+    for (int i = 0; i < warmup; i++) {
+        fn(arg);
+    }
+    for (int i = 0; i < iterations; i++) {
+        uint64_t started = bench_now_us();
+        bytes = fn(arg);
+        samples[i] = bench_now_us() - started;
+    }
+    qsort(samples, iterations, sizeof(uint64_t), compare_u64);
+    double mean = 0, var = 0;
+    for (int i = 0; i < iterations; i++) {
+        mean += samples[i];
+    }
+    mean /= iterations;
+    for (int i = 0; i < iterations; i++) {
+        var += (samples[i] - mean) * (samples[i] - mean);
+    }
+    fprintf(results,
+            "{\"bench\":\"%s\",\"iterations\":%d,\"warmup\":%d,\"min_us\":%llu,\"median_us\":%llu,"
+            "\"mean_us\":%.1f,\"stddev_us\":%.1f,\"max_us\":%llu,\"bytes\":%lld}\n",
+            name, iterations, warmup, (unsigned long long)samples[0],
+            (unsigned long long)samples[iterations / 2], mean, sqrt(var / iterations),
+            (unsigned long long)samples[iterations - 1], bytes);
+    fflush(results);
+}
+
+// Socket pair whose far end is drained by a child, so send() costs what it would on a real connection
+struct sink {
+    int fd;
+    pid_t pid;
+};
+
+static struct sink open_sink(void) {
+    struct sink s = {-1, -1};
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+    s.pid = fork();
+    if (s.pid == 0) {
+        close(sv[0]);
+        char buf[65536];
+        while (read(sv[1], buf, sizeof(buf)) > 0) {
+        }
+        _exit(0);
+    }
+    close(sv[1]);
+    s.fd = sv[0];
+    return s;
+}
+
+static void close_sink(struct sink *s) {
+    close(s->fd);
+    waitpid(s->pid, NULL, 0);
+}
+
+struct walk_arg {
+    const char *root;
+    const char *option;
+    const char *name;
+    int sock;
+};
+
+static long long bench_list_directories(void *p) {
+    struct walk_arg *a = p;
+    list_directories(a->sock, a->root, a->option);
+    return 0;
+}
+
+static long long bench_search(void *p) {
+    struct walk_arg *a = p;
+    return search_file_recursive(a->root, a->name, a->sock);
+}
+
+struct filter_arg {
+    char cmd[2048];
+    char list[BENCH_FILE];
+};
+
+static long long bench_filter(void *p) {
+    struct filter_arg *a = p;
+    return archive_collect(a->cmd, a->list);
+}
+
+struct archive_arg {
+    char list[BENCH_FILE];
+    char tar[BENCH_FILE];
+    char plain[BENCH_FILE];
+    char cmd[4096];
+};
+
+static long long file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (long long)st.st_size : -1;
+}
+
+static long long bench_archive_create(void *p) {
+    struct archive_arg *a = p;
+    archive_create(a->list, a->tar);
+    return file_size(a->tar);
+}
+
+static long long bench_shell(void *p) {
+    struct archive_arg *a = p;
+    if (system(a->cmd) != 0) {
+        fprintf(stderr, "command failed: %s\n", a->cmd);
+    }
+    return 0;
+}
+
+struct transfer_arg {
+    char tar[BENCH_FILE];
+    char out[BENCH_FILE];
+};
+
+// send_tar_file in a child, receive_archive in the parent, over loopback TCP
+static long long bench_transfer(void *p) {
+    struct transfer_arg *a = p;
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listener, 1) == -1 ||
+        getsockname(listener, (struct sockaddr *)&addr, &len) == -1) {
+        perror("loopback listener");
+        exit(EXIT_FAILURE);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        int conn = accept(listener, NULL, NULL);
+        send_tar_file(conn, a->tar);
+        close(conn);
+        _exit(0);
+    }
+    close(listener);
+    static struct connection conn;
+    conn.sock = socket(AF_INET, SOCK_STREAM, 0);
+    conn.start = conn.end = 0;
+    if (connect(conn.sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("connect");
+        exit(EXIT_FAILURE);
+    }
+    receive_archive(&conn, a->out, stdout);
+    close(conn.sock);
+    waitpid(pid, NULL, 0);
+    return file_size(a->out);
+}
+
+void print_bench_usage(const char *prog) {
+    printf("Usage: %s [options]\n", prog);
+    printf("   -d <dir>     Directory for the synthetic tree, scratch files and log (default /tmp/filesnap-bench)\n");
+    printf("   -s <seed>    Tree seed (default 42)\n");
+    printf("   -f <files>   Files in the tree (default 2000)\n");
+    printf("   -w <n>       Warm-up runs per benchmark (default 3)\n");
+    printf("   -i <n>       Measured runs per benchmark (default 10)\n");
+    printf("   -b <name>    Only run benchmarks whose name contains this string\n");
+    printf("   -o <file>    Write JSON results here instead of stdout\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *dir = "/tmp/filesnap-bench";
+    const char *out_path = NULL;
+    struct treegen_options opts;
+    treegen_defaults(&opts);
+    opts.files = 2000;
+    opts.max_size = 256 * 1024;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:s:f:w:i:b:o:h")) != -1) {
+        switch (opt) {
+            case 'd': dir = optarg; break;
+            case 's': opts.seed = strtoull(optarg, NULL, 10); break;
+            case 'f': opts.files = atol(optarg); break;
+            case 'w': warmup = atoi(optarg); break;
+            case 'i': iterations = atoi(optarg); break;
+            case 'b': only = optarg; break;
+            case 'o': out_path = optarg; break;
+            default:
+                print_bench_usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (iterations < 1 || iterations > MAX_ITERATIONS || warmup < 0) {
+        print_bench_usage(argv[0]);
+        return 2;
+    }
+
+    char root[BENCH_PATH], scratch[BENCH_PATH], log_path[BENCH_FILE];
+    snprintf(root, sizeof(root), "%s/tree", dir);
+    snprintf(scratch, sizeof(scratch), "%s/scratch", dir);
+    snprintf(log_path, sizeof(log_path), "%s/microbench.log", dir);
+    char cmd[2 * BENCH_PATH + 16];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s' '%s'", root, scratch);
+    system(cmd);
+    struct treegen_result tree;
+    if (treegen_build(root, &opts, &tree) != 0 || mkdir(scratch, 0755) == -1) {
+        return 1;
+    }
+
+    // The measured functions and tar print progress; keep stdout for results only
+    // and send everything else to a log next to the tree
+    int results_fd = out_path ? open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : dup(STDOUT_FILENO);
+    int log_fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (results_fd == -1 || log_fd == -1) {
+        perror("open results");
+        return 1;
+    }
+    results = fdopen(results_fd, "w");
+    dup2(log_fd, STDOUT_FILENO);
+    dup2(log_fd, STDERR_FILENO);
+    close(log_fd);
+    fprintf(results, "{\"tree\":\"%s\",\"seed\":%llu,\"dirs\":%ld,\"files\":%ld,\"bytes\":%lld}\n",
+            root, (unsigned long long)opts.seed, tree.dirs, tree.files, tree.bytes);
+
+    // Directory traversal
+    struct sink sink = open_sink();
+    char hit[64];
+    treegen_file_name(&opts, opts.files - 1, hit, sizeof(hit));
+    struct walk_arg walk_a = {root, "-a", NULL, sink.fd};
+    struct walk_arg walk_t = {root, "-t", NULL, sink.fd};
+    struct walk_arg search_hit = {root, NULL, hit, sink.fd};
+    struct walk_arg search_miss = {root, NULL, "no-such-file.txt", sink.fd};
+    run_bench("walk_list_directories_a", bench_list_directories, &walk_a);
+    run_bench("walk_list_directories_t", bench_list_directories, &walk_t);
+    run_bench("lookup_search_file_hit", bench_search, &search_hit);
+    run_bench("lookup_search_file_miss", bench_search, &search_miss);
+    close_sink(&sink);
+
+    // Predicate filtering, using the same find expressions as the handlers
+    struct filter_arg size_f, ext_f, date_f;
+    snprintf(size_f.cmd, sizeof(size_f.cmd), "find %s -type d -name \".*\" -prune -o -type f -size +%dc -size -%dc ! -name \".*\" -print0", root, 1000, 20000);
+    snprintf(ext_f.cmd, sizeof(ext_f.cmd), "find %s -type f \\( -name '*.c' -o -name '*.h' \\) -print0", root);
+    snprintf(date_f.cmd, sizeof(date_f.cmd), "find %s -type f -newermt '%s' -print0", root, "2024-01-01");
+    snprintf(size_f.list, sizeof(size_f.list), "%s/size.list", scratch);
+    snprintf(ext_f.list, sizeof(ext_f.list), "%s/ext.list", scratch);
+    snprintf(date_f.list, sizeof(date_f.list), "%s/date.list", scratch);
+    run_bench("filter_size", bench_filter, &size_f);
+    run_bench("filter_extension", bench_filter, &ext_f);
+    run_bench("filter_date", bench_filter, &date_f);
+
+    // Archive production on the extension filter's file list
+    bench_filter(&ext_f);
+    struct archive_arg arch;
+    snprintf(arch.list, sizeof(arch.list), "%s", ext_f.list);
+    snprintf(arch.tar, sizeof(arch.tar), "%s/bench.tar.gz", scratch);
+    snprintf(arch.plain, sizeof(arch.plain), "%s/bench.tar", scratch);
+    // The default "find" order first, while the list is still in find's order;
+    // the "type" order rewrites the list in place
+    run_bench("archive_tar_gzip", bench_archive_create, &arch);
+    setenv("FILESNAP_ARCHIVE_ORDER", "type", 1);
+    archive_init();
+    run_bench("archive_tar_gzip_type_order", bench_archive_create, &arch);
+    unsetenv("FILESNAP_ARCHIVE_ORDER");
+    archive_init();
+    snprintf(arch.cmd, sizeof(arch.cmd), "tar -cf '%s' --null -T '%s' 2>/dev/null", arch.plain, arch.list);
+    run_bench("archive_tar_only", bench_shell, &arch);
+    snprintf(arch.cmd, sizeof(arch.cmd), "gzip -c '%s' > '%s.gz'", arch.plain, arch.plain);
+    run_bench("archive_gzip_only", bench_shell, &arch);
+
+    // Transfer of the archive over loopback
+    struct transfer_arg xfer;
+    snprintf(xfer.tar, sizeof(xfer.tar), "%s", arch.tar);
+    snprintf(xfer.out, sizeof(xfer.out), "%s/received.tar.gz", scratch);
+    if (file_size(xfer.tar) <= 0) {
+        archive_create(arch.list, arch.tar);
+    }
+    run_bench("transfer_send_receive", bench_transfer, &xfer);
+
+    fclose(results);
+    return 0;
+}
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "treegen.h"
+
+#define MAX_EXTENSIONS 32
+#define WRITE_CHUNK 65536
+
+static const char *words[] = {
+    "int", "return", "static", "const", "char", "void", "struct", "if", "else", "while",
+    "for", "buffer", "size", "path", "client", "server", "socket", "archive", "file", "error",
+    "INFO", "WARN", "DEBUG", "request", "session", "bytes", "time", "count", "node", "mirror"
+};
+
+uint64_t treegen_next(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Independent stream for item i so any one item can be derived on its own
+static uint64_t item_seed(uint64_t seed, uint64_t salt, long i) {
+    uint64_t state = seed ^ (salt * 0x9e3779b97f4a7c15ULL) ^ ((uint64_t)i << 17);
+    return treegen_next(&state);
+}
+
+void treegen_defaults(struct treegen_options *opts) {
+    opts->seed = 42;
+    opts->files = 1000;
+    opts->depth = 3;
+    opts->fanout = 4;
+    opts->min_size = 64;
+    opts->max_size = 1 << 20;
+    opts->extensions = "c,h,txt,log,md,bin";
+    opts->mtime_start = 1577836800; // 2020-01-01
+    opts->mtime_end = 1767225600;   // 2026-01-01
+}
+
+static int split_extensions(const char *list, char exts[][16]) {
+    int n = 0;
+    const char *p = list;
+    while (*p != '\0' && n < MAX_EXTENSIONS) {
+        size_t len = strcspn(p, ",");
+        if (len > 0 && len < 16) {
+            memcpy(exts[n], p, len);
+            exts[n][len] = '\0';
+            n++;
+        }
+        p += len;
+        if (*p == ',') {
+            p++;
+        }
+    }
+    if (n == 0) {
+        strcpy(exts[0], "txt");
+        n = 1;
+    }
+    return n;
+}
+
+void treegen_file_name(const struct treegen_options *opts, long index, char *out, size_t size) {
+    char exts[MAX_EXTENSIONS][16];
+    int n = split_extensions(opts->extensions, exts);
+    snprintf(out, size, "f%06ld.%s", index, exts[item_seed(opts->seed, 1, index) % n]);
+}
+
+static int mkdir_p(const char *path) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s", path);
+    for (char *p = tmp + 1; *p != '\0'; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir(tmp, 0755) == -1 && errno != EEXIST) {
+                return -1;
+            }
+            *p = '/';
+        }
+    }
+    if (mkdir(tmp, 0755) == -1 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+// Write size bytes of deterministic content: random for binary types, word soup otherwise
+static long long write_content(int fd, uint64_t state, long size, int binary) {
+    static char chunk[WRITE_CHUNK];
+    long left = size;
+    int nwords = sizeof(words) / sizeof(words[0]);
+    while (left > 0) {
+        long n = left < WRITE_CHUNK ? left : WRITE_CHUNK;
+        long j = 0;
+        if (binary) {
+            while (j < n) {
+                uint64_t r = treegen_next(&state);
+                for (int b = 0; b < 8 && j < n; b++, r >>= 8) {
+                    chunk[j++] = (char)(r & 0xff);
+                }
+            }
+        } else {
+            while (j < n) {
+                uint64_t r = treegen_next(&state);
+                const char *w = words[r % nwords];
+                for (const char *c = w; *c != '\0' && j < n; c++) {
+                    chunk[j++] = *c;
+                }
+                if (j < n) {
+                    chunk[j++] = (r >> 32) % 8 == 0 ? '\n' : ' ';
+                }
+            }
+        }
+        if (write(fd, chunk, n) != n) {
+            return -1;
+        }
+        left -= n;
+    }
+    return size;
+}
+
+int treegen_build(const char *root, const struct treegen_options *opts, struct treegen_result *result) {
+    memset(result, 0, sizeof(*result));
+    if (mkdir_p(root) == -1) {
+        perror("mkdir");
+        return -1;
+    }
+
+    // Breadth-first list of directories: the root plus fanout^k dirs at each level k
+    long ndirs = 1, level = 1;
+    for (int d = 0; d < opts->depth; d++) {
+        level *= opts->fanout;
+        ndirs += level;
+    }
+    char **dirs = calloc(ndirs, sizeof(char *));
+    if (dirs == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    dirs[0] = strdup(root);
+    long made = 1;
+    for (long parent = 0; parent < made && made < ndirs; parent++) {
+        for (int c = 0; c < opts->fanout && made < ndirs; c++) {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/d%02d", dirs[parent], c);
+            dirs[made] = strdup(path);
+            if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+                perror(path);
+            }
+            made++;
+        }
+    }
+    result->dirs = made;
+
+    double log_min = log((double)(opts->min_size > 0 ? opts->min_size : 1));
+    double log_max = log((double)(opts->max_size > opts->min_size ? opts->max_size : opts->min_size + 1));
+    for (long i = 0; i < opts->files; i++) {
+        uint64_t state = item_seed(opts->seed, 2, i);
+        long dir = (long)(treegen_next(&state) % made);
+        double u = (double)(treegen_next(&state) >> 11) / (double)(1ULL << 53);
+        long size = (long)exp(log_min + u * (log_max - log_min));
+        time_t mtime = opts->mtime_start;
+        if (opts->mtime_end > opts->mtime_start) {
+            mtime += (time_t)(treegen_next(&state) % (uint64_t)(opts->mtime_end - opts->mtime_start));
+        }
+
+        char name[64], path[4200];
+        treegen_file_name(opts, i, name, sizeof(name));
+        snprintf(path, sizeof(path), "%s/%s", dirs[dir], name);
+        int binary = strcmp(strrchr(name, '.'), ".bin") == 0;
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            perror(path);
+            continue;
+        }
+        if (write_content(fd, state, size, binary) < 0) {
+            perror("write");
+        }
+        struct timespec times[2] = {{mtime, 0}, {mtime, 0}};
+        futimens(fd, times);
+        close(fd);
+        result->files++;
+        result->bytes += size;
+    }
+
+    for (long d = 0; d < made; d++) {
+        free(dirs[d]);
+    }
+    free(dirs);
+    return 0;
+}
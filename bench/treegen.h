@@ -0,0 +1,39 @@
+#ifndef TREEGEN_H
+#define TREEGEN_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Shape of a synthetic tree. The same options and seed always produce
+// the same directories, names, sizes, contents and mtimes.
+struct treegen_options {
+    uint64_t seed;
+    long files;            // number of regular files
+    int depth;             // directory levels below the root
+    int fanout;            // subdirectories per directory
+    long min_size;         // file sizes are log-uniform in [min_size, max_size]
+    long max_size;
+    const char *extensions; // comma separated, e.g. "c,h,txt,log,md,bin"
+    time_t mtime_start;    // mtimes are spread uniformly over [mtime_start, mtime_end]
+    time_t mtime_end;
+};
+
+struct treegen_result {
+    long dirs;
+    long files;
+    long long bytes;
+};
+
+// Small, fast deterministic PRNG (splitmix64)
+uint64_t treegen_next(uint64_t *state);
+
+// Fill opts with the defaults used by gentree when no flags are given
+void treegen_defaults(struct treegen_options *opts);
+
+// Create the tree under root (which is created if needed). Returns 0 on success.
+int treegen_build(const char *root, const struct treegen_options *opts, struct treegen_result *result);
+
+// Name of the i-th generated file (without directory), e.g. "f000042.c"
+void treegen_file_name(const struct treegen_options *opts, long index, char *out, size_t size);
+
+#endif
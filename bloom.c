@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "bloom.h"
+#include "cache.h"
+#include "shared.h"
+
+// Directories with a summary at once; a power of two
+#define BLOOM_ENTRIES 4096
+// Slots tried for a path before giving up on keeping its summary
+#define BLOOM_PROBES 16
+// Bits set per name
+#define BLOOM_HASHES 4
+// Summaries with more bits set than this rule out too little to keep
+#define BLOOM_FULL (BLOOM_BITS * 7 / 8)
+
+// One summary. Writers hold the slot by making seq odd; a reader's copy taken
+// while seq moved is not used. changed only ever grows and is raised without
+// the lock, by the watcher.
+struct bloom_entry {
+    uint64_t seq;
+    uint64_t key;       // hash of the path; 0 for a free slot
+    uint64_t built;     // generation the summary was built at; 0 for none
+    uint64_t changed;   // newest generation at which something below changed
+    struct bloom filter;
+};
+
+struct bloom_table {
+    uint64_t reset;     // summaries built before this generation are void
+    struct bloom_entry entries[BLOOM_ENTRIES];
+};
+
+static struct bloom_table *table = NULL;
+static char bloom_root[1024];
+static size_t root_length = 0;
+static char bloom_exclude[1024];
+static size_t exclude_length = 0;
+
+int bloom_init(const char *root, const char *exclude) {
+    table = shared_alloc(sizeof(struct bloom_table));
+    if (table == NULL) {
+        return -1;
+    }
+    snprintf(bloom_root, sizeof(bloom_root), "%s", root);
+    root_length = strlen(bloom_root);
+    snprintf(bloom_exclude, sizeof(bloom_exclude), "%s", exclude);
+    exclude_length = strlen(bloom_exclude);
+    return 0;
+}
+
+void bloom_add(struct bloom *filter, const char *name) {
+    uint64_t h = cache_hash(name);
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+    for (uint32_t i = 0; i < BLOOM_HASHES; i++) {
+        uint32_t bit = (h1 + i * h2) % BLOOM_BITS;
+        filter->bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+int bloom_may_contain(const struct bloom *filter, const char *name) {
+    uint64_t h = cache_hash(name);
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+    for (uint32_t i = 0; i < BLOOM_HASHES; i++) {
+        uint32_t bit = (h1 + i * h2) % BLOOM_BITS;
+        if (!(filter->bits[bit / 64] & (1ULL << (bit % 64)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void bloom_merge(struct bloom *into, const struct bloom *from) {
+    for (size_t i = 0; i < BLOOM_BITS / 64; i++) {
+        into->bits[i] |= from->bits[i];
+    }
+}
+
+int bloom_generation(uint64_t *generation) {
+    if (table == NULL) {
+        return -1;
+    }
+    return cache_tree_generation(generation);
+}
+
+// Changes inside the excluded directory are not seen, so neither it, nor
+// anything in it, nor anything above it can have a summary
+static int summarized(const char *path) {
+    size_t length = strlen(path);
+    if (exclude_length == 0) {
+        return 1;
+    }
+    if (length >= exclude_length) {
+        return !(strncmp(path, bloom_exclude, exclude_length) == 0 &&
+                 (path[exclude_length] == '\0' || path[exclude_length] == '/'));
+    }
+    return !(strncmp(bloom_exclude, path, length) == 0 && bloom_exclude[length] == '/');
+}
+
+static uint64_t path_key(const char *path, size_t length) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; i++) {
+        h ^= (unsigned char)path[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h != 0 ? h : 1;
+}
+
+static struct bloom_entry *slot(uint64_t key, int probe) {
+    return &table->entries[(key + probe) & (BLOOM_ENTRIES - 1)];
+}
+
+static void raise_to(uint64_t *field, uint64_t value) {
+    uint64_t seen = __atomic_load_n(field, __ATOMIC_RELAXED);
+    while (seen < value &&
+           !__atomic_compare_exchange_n(field, &seen, value, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+}
+
+// A slot whose summary no longer counts may be given to another path
+static int stale(struct bloom_entry *e) {
+    uint64_t built = __atomic_load_n(&e->built, __ATOMIC_RELAXED);
+    return built == 0 || built < __atomic_load_n(&e->changed, __ATOMIC_RELAXED) ||
+           built < __atomic_load_n(&table->reset, __ATOMIC_RELAXED);
+}
+
+int bloom_lookup(const char *path, struct bloom *filter) {
+    uint64_t now;
+    if (bloom_generation(&now) == -1 || !summarized(path)) {
+        return 0;
+    }
+    uint64_t key = path_key(path, strlen(path));
+    for (int probe = 0; probe < BLOOM_PROBES; probe++) {
+        struct bloom_entry *e = slot(key, probe);
+        if (__atomic_load_n(&e->key, __ATOMIC_RELAXED) != key) {
+            continue;
+        }
+        uint64_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            return 0;
+        }
+        uint64_t built = __atomic_load_n(&e->built, __ATOMIC_RELAXED);
+        memcpy(filter, &e->filter, sizeof(*filter));
+        int same = __atomic_load_n(&e->key, __ATOMIC_RELAXED) == key;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq || !same) {
+            return 0;
+        }
+        return built != 0 && built >= __atomic_load_n(&e->changed, __ATOMIC_ACQUIRE) &&
+               built >= __atomic_load_n(&table->reset, __ATOMIC_ACQUIRE);
+    }
+    return 0;
+}
+
+static int full(const struct bloom *filter) {
+    int set = 0;
+    for (size_t i = 0; i < BLOOM_BITS / 64; i++) {
+        set += __builtin_popcountll(filter->bits[i]);
+    }
+    return set > BLOOM_FULL;
+}
+
+void bloom_store(const char *path, const struct bloom *filter, uint64_t generation) {
+    uint64_t now;
+    if (bloom_generation(&now) == -1 || !summarized(path) || full(filter)) {
+        return;
+    }
+    uint64_t key = path_key(path, strlen(path));
+    for (int probe = 0; probe < BLOOM_PROBES; probe++) {
+        struct bloom_entry *e = slot(key, probe);
+        uint64_t held = __atomic_load_n(&e->key, __ATOMIC_RELAXED);
+        if (held != key && held != 0 && !stale(e)) {
+            continue;
+        }
+        uint64_t seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+        if ((seq & 1) || !__atomic_compare_exchange_n(&e->seq, &seq, seq + 1, 0,
+                                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            continue; // Someone else is writing it
+        }
+        held = e->key;
+        if (held != key && held != 0 && !stale(e)) {
+            __atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (held != key) {
+            // A path new to this slot may have changed before the watcher could
+            // see the key, so it starts out changed as of now
+            __atomic_store_n(&e->key, key, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (cache_tree_generation(&now) == -1) {
+                now = UINT64_MAX;
+            }
+            raise_to(&e->changed, now);
+            e->built = 0;
+        }
+        if (generation >= e->built) {
+            __atomic_store_n(&e->built, generation, __ATOMIC_RELAXED);
+            memcpy(&e->filter, filter, sizeof(*filter));
+        }
+        __atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+        return;
+    }
+}
+
+void bloom_changed(const char *path, uint64_t generation) {
+    if (table == NULL) {
+        return;
+    }
+    // Pairs with the fence in bloom_store: either the watcher sees the new key
+    // here, or the store sees the generation this change was counted in
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    size_t length = strlen(path);
+    while (length >= root_length && length > 0) {
+        uint64_t key = path_key(path, length);
+        for (int probe = 0; probe < BLOOM_PROBES; probe++) {
+            struct bloom_entry *e = slot(key, probe);
+            if (__atomic_load_n(&e->key, __ATOMIC_RELAXED) == key) {
+                raise_to(&e->changed, generation);
+            }
+        }
+        // Up to the parent directory
+        while (length > 0 && path[length - 1] != '/') {
+            length--;
+        }
+        if (length > 0) {
+            length--;
+        }
+    }
+}
+
+void bloom_reset(uint64_t generation) {
+    if (table != NULL) {
+        raise_to(&table->reset, generation);
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdint.h>
+
+// Bloom filter summaries of directory subtrees, so a walk looking for a name
+// can skip every subtree that cannot contain it. Each summary holds the names
+// of all entries below one directory and the tree generation
+// (see cache.h) it was built at. The tree watcher marks a directory and all
+// of its ancestors with the generation of every change inside it, and a
+// summary only counts while no mark on its directory is newer than the
+// summary itself. Summaries are kept in shared memory, keyed by path, and
+// come from the index refresher after every refresh and from walks that went
+// through a whole subtree without finding what they were looking for. Summaries
+// of subtrees so large that almost every bit is set are not kept.
+//
+// The excluded directory is not watched, so summaries are never kept for it,
+// anything inside it, or the directories above it.
+
+#define BLOOM_BITS 8192
+
+struct bloom {
+    uint64_t bits[BLOOM_BITS / 64];
+};
+
+// Set up the shared table for the tree under root; call once in the parent
+// before the watcher and the handlers are forked
+int bloom_init(const char *root, const char *exclude);
+
+void bloom_add(struct bloom *filter, const char *name);
+int bloom_may_contain(const struct bloom *filter, const char *name);
+void bloom_merge(struct bloom *into, const struct bloom *from);
+
+// Generation to build summaries at, taken before the walk; -1 while the tree
+// is not fully watched, in which case summaries must not be used or stored
+int bloom_generation(uint64_t *generation);
+
+// Current summary of the subtree at path; returns 1 and fills filter, or 0
+int bloom_lookup(const char *path, struct bloom *filter);
+
+// Keep the summary of the subtree at path, built from a walk started at generation
+void bloom_store(const char *path, const struct bloom *filter, uint64_t generation);
+
+// Watcher side: something inside the directory at path changed at generation
+void bloom_changed(const char *path, uint64_t generation);
+
+// Watcher side: the watches were rebuilt at generation; every summary before it is void
+void bloom_reset(uint64_t generation);
+
+#endif
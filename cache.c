@@ -0,0 +1,387 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
+#include <sys/inotify.h>
+
+#include "cache.h"
+#include "archive.h"
+#include "bloom.h"
+#include "metrics.h"
+#include "shared.h"
+
+// Anything that can change the result of a query: entries appearing, going
+// away or being renamed, contents, and timestamps (the date queries use mtime)
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | \
+                      IN_DELETE_SELF | IN_MOVE_SELF)
+
+// Directories one batch of events marks for the subtree summaries (see
+// bloom.h); a busier batch voids every summary instead
+#define WATCH_MARKS 256
+
+// Most archives the cache directory holds at once
+#define CACHE_ENTRIES 4096
+
+// One archive in the cache directory. Handlers add, use and evict entries
+// with atomics alone: a slot is taken by setting its key, and it is only
+// complete while used_us is non-zero, which is also what an evictor claims.
+struct cache_entry {
+    uint64_t key;       // 0 for a free slot
+    uint64_t used_us;   // last use, doubling as the LRU order
+    off_t size;
+};
+
+// Shared with the watcher process and every connection handler
+struct cache_state {
+    uint64_t generation;
+    int watching;       // 1 while every directory under the root has a watch
+    int64_t total;      // bytes held by complete entries
+    struct cache_entry entries[CACHE_ENTRIES];
+};
+
+static struct cache_state *state = NULL;
+static char cache_dir_path[1024];
+static off_t cache_max_bytes = 0;   // 0: only the watcher runs, nothing is cached
+// Generations restart at 0 with each run, so each instance salts its keys
+static uint64_t cache_instance = 0;
+
+// Watched directory paths, indexed by watch descriptor
+static char **watch_paths = NULL;
+static int watch_capacity = 0;
+
+static void remember_watch(int wd, const char *path) {
+    if (wd >= watch_capacity) {
+        int capacity = watch_capacity ? watch_capacity : 256;
+        while (capacity <= wd) {
+            capacity *= 2;
+        }
+        char **grown = realloc(watch_paths, capacity * sizeof(char *));
+        if (grown == NULL) {
+            return;
+        }
+        memset(grown + watch_capacity, 0, (capacity - watch_capacity) * sizeof(char *));
+        watch_paths = grown;
+        watch_capacity = capacity;
+    }
+    free(watch_paths[wd]);
+    watch_paths[wd] = strdup(path);
+}
+
+static void forget_watches(void) {
+    for (int i = 0; i < watch_capacity; i++) {
+        free(watch_paths[i]);
+        watch_paths[i] = NULL;
+    }
+}
+
+// Add a watch on path and every directory below it, except exclude.
+// Returns -1 if the watch limit is reached, since the tree is then not covered.
+static int watch_tree(int fd, const char *path, const char *exclude) {
+    if (strcmp(path, exclude) == 0) {
+        return 0;
+    }
+    int wd = inotify_add_watch(fd, path, WATCH_EVENTS | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd == -1) {
+        // A directory that vanished or can't be read can't show up in a query either
+        return errno == ENOSPC || errno == ENOMEM ? -1 : 0;
+    }
+    remember_watch(wd, path);
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return 0;
+    }
+    struct dirent *entry;
+    int result = 0;
+    while (result == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char child[4096];
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        int is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = lstat(child, &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (is_dir) {
+            result = watch_tree(fd, child, exclude);
+        }
+    }
+    closedir(dir);
+    return result;
+}
+
+static void run_watcher(const char *root, const char *exclude) {
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    // A renamed directory keeps its watch under the old path, so any directory
+    // move rebuilds every watch from the root
+    while (1) {
+        int fd = inotify_init1(IN_CLOEXEC);
+        if (fd == -1 || watch_tree(fd, root, exclude) == -1) {
+            fprintf(stderr, "cache: cannot watch every directory under %s, result cache and file index disabled\n", root);
+            __atomic_store_n(&state->watching, 0, __ATOMIC_RELEASE);
+            _exit(1);
+        }
+        bloom_reset(__atomic_add_fetch(&state->generation, 1, __ATOMIC_SEQ_CST));
+        __atomic_store_n(&state->watching, 1, __ATOMIC_RELEASE);
+
+        int rescan = 0;
+        while (!rescan) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0) {
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                rescan = 1;
+                break;
+            }
+            int changed = 0, marks = 0;
+            int marked[WATCH_MARKS];
+            for (char *p = buf; p < buf + n; ) {
+                struct inotify_event *ev = (struct inotify_event *)p;
+                p += sizeof(struct inotify_event) + ev->len;
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    // Events were lost; nothing can be assumed about the tree
+                    changed = rescan = 1;
+                    continue;
+                }
+                if (ev->mask & IN_IGNORED) {
+                    continue;
+                }
+                const char *dir = ev->wd < watch_capacity ? watch_paths[ev->wd] : NULL;
+                if (dir == NULL) {
+                    continue;
+                }
+                char child[4096];
+                snprintf(child, sizeof(child), "%s/%s", dir, ev->len ? ev->name : "");
+                if (ev->len && strcmp(child, exclude) == 0) {
+                    continue;
+                }
+                changed = 1;
+                if (marks < WATCH_MARKS && (marks == 0 || marked[marks - 1] != ev->wd)) {
+                    marked[marks++] = ev->wd;
+                } else if (marks == WATCH_MARKS) {
+                    marks = WATCH_MARKS + 1;
+                }
+                if ((ev->mask & IN_ISDIR) && (ev->mask & IN_MOVED_FROM)) {
+                    rescan = 1;
+                } else if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+                    if (watch_tree(fd, child, exclude) == -1) {
+                        rescan = 1;
+                    }
+                }
+            }
+            if (changed) {
+                uint64_t generation = __atomic_add_fetch(&state->generation, 1, __ATOMIC_SEQ_CST);
+                if (marks > WATCH_MARKS) {
+                    bloom_reset(generation);
+                }
+                for (int i = 0; i < marks && marks <= WATCH_MARKS; i++) {
+                    if (marked[i] < watch_capacity && watch_paths[marked[i]] != NULL) {
+                        bloom_changed(watch_paths[marked[i]], generation);
+                    }
+                }
+            }
+        }
+        // Handlers must not use a generation taken while watches are missing
+        __atomic_store_n(&state->watching, 0, __ATOMIC_RELEASE);
+        close(fd);
+        forget_watches();
+    }
+}
+
+// Entries left by an earlier run were keyed with another instance salt and
+// can never be hit again
+static void cache_clear(void) {
+    DIR *dir = opendir(cache_dir_path);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+        char path[sizeof(cache_dir_path) + NAME_MAX + 2];
+        snprintf(path, sizeof(path), "%s/%s", cache_dir_path, ent->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+}
+
+int cache_init(const char *cache_dir, const char *root, const char *exclude, off_t max_bytes) {
+    state = shared_alloc(sizeof(struct cache_state));
+    if (state == NULL) {
+        return -1;
+    }
+    snprintf(cache_dir_path, sizeof(cache_dir_path), "%s", cache_dir);
+    cache_max_bytes = max_bytes > 0 ? max_bytes : 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    cache_instance = ((uint64_t)getpid() << 40) ^ ((uint64_t)ts.tv_sec << 20) ^ (uint64_t)ts.tv_nsec;
+    if (cache_max_bytes > 0) {
+        mkdir(cache_dir, 0777);
+        cache_clear();
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        run_watcher(root, exclude);
+        _exit(0);
+    }
+    if (pid < 0) {
+        perror("fork cache watcher");
+        state = NULL;
+        return -1;
+    }
+    return cache_max_bytes > 0 ? 0 : -1;
+}
+
+int cache_tree_generation(uint64_t *generation) {
+    if (state == NULL || !__atomic_load_n(&state->watching, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    *generation = __atomic_load_n(&state->generation, __ATOMIC_ACQUIRE);
+    return 0;
+}
+
+uint64_t cache_hash(const char *s) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *s != '\0'; s++) {
+        h ^= (unsigned char)*s;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+int cache_key(const char *query, char *key, size_t size) {
+    uint64_t generation;
+    if (cache_max_bytes == 0 || cache_tree_generation(&generation) == -1) {
+        return -1;
+    }
+    char material[2048];
+    snprintf(material, sizeof(material), "%016llx:%llu|%s|%s|%s", (unsigned long long)cache_instance,
+             (unsigned long long)generation, ARCHIVE_COMPRESSION, archive_order(), query);
+    snprintf(key, size, "%016llx", (unsigned long long)cache_hash(material));
+    return 0;
+}
+
+// Entries are named after their key, so a key fits in one word
+static uint64_t key_value(const char *key) {
+    uint64_t value = strtoull(key, NULL, 16);
+    return value != 0 ? value : 1;
+}
+
+int cache_lookup(const char *key, char *path, size_t size) {
+    if (state == NULL || cache_max_bytes == 0) {
+        return 0;
+    }
+    uint64_t value = key_value(key);
+    for (int i = 0; i < CACHE_ENTRIES; i++) {
+        struct cache_entry *e = &state->entries[i];
+        if (__atomic_load_n(&e->key, __ATOMIC_ACQUIRE) != value) {
+            continue;
+        }
+        // Mark it used, unless an evictor has claimed it in the meantime
+        uint64_t used = __atomic_load_n(&e->used_us, __ATOMIC_ACQUIRE);
+        while (used != 0) {
+            if (__atomic_compare_exchange_n(&e->used_us, &used, metrics_now_us(), 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                snprintf(path, size, "%s/%s.tar.gz", cache_dir_path, key);
+                return 1;
+            }
+        }
+        return 0;
+    }
+    return 0;
+}
+
+// Remove the least recently used entry; returns 0 if there was none to remove
+static int cache_evict_one(void) {
+    for (int attempt = 0; attempt < 8; attempt++) {
+        struct cache_entry *oldest = NULL;
+        uint64_t oldest_used = 0;
+        for (int i = 0; i < CACHE_ENTRIES; i++) {
+            struct cache_entry *e = &state->entries[i];
+            uint64_t used = __atomic_load_n(&e->used_us, __ATOMIC_ACQUIRE);
+            if (used != 0 && __atomic_load_n(&e->key, __ATOMIC_ACQUIRE) != 0 &&
+                (oldest == NULL || used < oldest_used)) {
+                oldest = e;
+                oldest_used = used;
+            }
+        }
+        if (oldest == NULL) {
+            return 0;
+        }
+        // Whoever clears used_us owns the entry; a hit in between makes it recent again
+        if (!__atomic_compare_exchange_n(&oldest->used_us, &oldest_used, 0, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        char path[1200];
+        snprintf(path, sizeof(path), "%s/%016llx.tar.gz", cache_dir_path,
+                 (unsigned long long)__atomic_load_n(&oldest->key, __ATOMIC_ACQUIRE));
+        unlink(path);
+        __atomic_sub_fetch(&state->total, oldest->size, __ATOMIC_RELAXED);
+        __atomic_store_n(&oldest->key, 0, __ATOMIC_RELEASE);
+        return 1;
+    }
+    return 0;
+}
+
+// Take a free slot for key; NULL if the table is full
+static struct cache_entry *cache_claim(uint64_t key) {
+    for (int i = 0; i < CACHE_ENTRIES; i++) {
+        uint64_t free_key = 0;
+        if (__atomic_compare_exchange_n(&state->entries[i].key, &free_key, key, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return &state->entries[i];
+        }
+    }
+    return NULL;
+}
+
+void cache_store(const char *key, const char *tar_path) {
+    if (state == NULL || cache_max_bytes == 0) {
+        return;
+    }
+    char path[1200];
+    snprintf(path, sizeof(path), "%s/%s.tar.gz", cache_dir_path, key);
+    // Another handler may have stored the same key first; either copy will do
+    if (link(tar_path, path) == -1) {
+        if (errno != EEXIST) {
+            perror("link cache");
+        }
+        return;
+    }
+    struct stat st;
+    struct cache_entry *e = cache_claim(key_value(key));
+    if (e == NULL && cache_evict_one()) {
+        e = cache_claim(key_value(key));
+    }
+    if (e == NULL || stat(path, &st) == -1) {
+        unlink(path);
+        if (e != NULL) {
+            __atomic_store_n(&e->key, 0, __ATOMIC_RELEASE);
+        }
+        return;
+    }
+    e->size = st.st_size;
+    __atomic_add_fetch(&state->total, st.st_size, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->used_us, metrics_now_us(), __ATOMIC_RELEASE);
+
+    while (__atomic_load_n(&state->total, __ATOMIC_RELAXED) > cache_max_bytes && cache_evict_one()) {
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Finished archives are kept on disk under a key made of the normalized
+// query, the compression settings and the tree generation. A watcher
+// process advances the generation whenever anything under the watched
+// root changes, so an entry is only ever hit while the tree is as it was
+// when the archive was built. Entries from older generations are never
+// hit again and age out of the LRU size cap.
+
+// Create cache_dir and start the watcher on root, ignoring changes under
+// exclude (the server's own scratch space). The cache directory belongs to
+// one server; its entries are tracked in shared memory (see shared.h) and
+// anything left in it by an earlier run is removed. Call once in the parent
+// before forking. max_bytes 0 disables caching but still runs the watcher, which
+// other users of the tree generation rely on. Returns 0, or -1 if nothing is cached.
+int cache_init(const char *cache_dir, const char *root, const char *exclude, off_t max_bytes);
+
+// Current tree generation; -1 if the tree is not (yet) fully watched
+int cache_tree_generation(uint64_t *generation);
+
+// Key for a normalized query at the current generation. Take it before
+// walking the tree, so a change during the walk makes the entry unreachable.
+// Returns -1 when the cache is off or the tree could not be fully watched.
+int cache_key(const char *query, char *key, size_t size);
+
+// Look up an archive; returns 1 and fills path (marked recently used) on a hit
+int cache_lookup(const char *key, char *path, size_t size);
+
+// 64-bit FNV-1a of a string; keys only need to be well spread, not secret
+uint64_t cache_hash(const char *s);
+
+// Add a finished archive by hard link, so the caller keeps its own file,
+// then evict least recently used entries beyond the size cap
+void cache_store(const char *key, const char *tar_path);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,10 +10,29 @@
 #include <errno.h>
 #include <limits.h>
 #include <ctype.h>
+#include <sys/wait.h>
+#include <signal.h>
 
+#include "digest.h"
+#include "clientw24.h"
 
 #define PORT 8084
-#define CHUNK_SIZE 1024
+
+// Archives smaller than this are fetched as one segment even with -j
+#define PARALLEL_MIN_SIZE (1024 * 1024)
+#define MAX_STREAMS 64
+
+// Archive bodies are spliced socket -> pipe -> file through a pipe this large;
+// without splice they are read into a buffer that grows between these sizes
+#define RECEIVE_PIPE_SIZE (1024 * 1024)
+#define RECEIVE_BUFFER_MIN (64 * 1024)
+#define RECEIVE_BUFFER_MAX (4 * 1024 * 1024)
+
+// Number of connections an archive is downloaded over (-j); 1 keeps the plain reply
+int parallel_streams = 1;
+
+// With -x archives are unpacked into this directory as they arrive instead of being saved
+const char *extract_dir = NULL;
 
 void print_help() {
     printf("COMMANDS\n");
@@ -22,6 +42,16 @@ void print_help() {
     printf("   Description: Lists directories and subdirectories based on the time they were created, oldest first.\n\n");
     printf("w24fn <filename>\n");
     printf("   Description: Searches for a file and returns its details if found.\n\n");
+    printf("w24fs [-g|-r] <pattern>\n");
+    printf("   Description: Lists files whose name contains pattern, or matches it as a glob (-g) or an extended regex (-r).\n\n");
+    printf("w24du <depth> [directory]\n");
+    printf("   Description: Shows the total size, file count and directory count below a directory (relative to home) and below each directory down to depth levels under it.\n\n");
+    printf("w24top [-t] <count>\n");
+    printf("   Description: Lists the count largest files, or with -t the count most recently modified, newest first.\n\n");
+    printf("w24fc [-a] <text>[|<text>...] [w24fz|w24ft|w24fdb|w24fda <arguments>]\n");
+    printf("   Description: Lists the files containing any of the texts, among all files or those the given command would select; -a returns them as a temp.tar.gz archive instead.\n\n");
+    printf("w24sum [w24fz|w24ft|w24fdb|w24fda <arguments>]\n");
+    printf("   Description: Lists the checksum and size of every file, or of those the given command would select, to compare servers without downloading.\n\n");
     printf("w24fz <size1> <size2>\n");
     printf("   Description: Finds files within a size range and packages them into a .tar.gz archive.\n\n");
     printf("w24ft <extension list>\n");
@@ -30,6 +60,8 @@ void print_help() {
     printf("   Description: Returns files created on or before a specified date in a temp.tar.gz archive.\n\n");
     printf("w24fda <date>\n");
     printf("   Description: Returns files created on or after a specified date in a temp.tar.gz archive.\n\n");
+    printf("stats\n");
+    printf("   Description: Shows the server's per-command latency histograms and traffic counters.\n\n");
     printf("quitc\n");
     printf("   Description: Terminates the client process.\n\n");
 }
@@ -65,6 +97,69 @@ int validateCommandWithOneArg(const char *input) {
     }
 }
 
+//Function to validate w24fs command
+int validateW24fs(const char *input) {
+    //Either just a pattern, or -g or -r and a pattern
+    int tokens = countTokens(input);
+    if (tokens == 2 || (tokens == 3 && (strncmp(input, "w24fs -g ", 9) == 0 || strncmp(input, "w24fs -r ", 9) == 0))) {
+        return 1;  // Validation successful
+    } else {
+        printf("Error: Command requires a pattern, optionally after -g or -r\n");
+        return 0;  // Validation failed
+    }
+}
+
+//Function to validate w24du command
+int validateW24du(const char *input) {
+    //A depth, then optionally a directory
+    char depth[32];
+    int tokens = countTokens(input);
+    if ((tokens == 2 || tokens == 3) && sscanf(input, "w24du %31s", depth) == 1 &&
+        strspn(depth, "0123456789") == strlen(depth)) {
+        return 1;  // Validation successful
+    } else {
+        printf("Error: Command requires a depth, optionally followed by a directory\n");
+        return 0;  // Validation failed
+    }
+}
+
+//Function to validate w24top command
+int validateW24top(const char *input) {
+    //A count, optionally after -t
+    char count[32];
+    int tokens = countTokens(input);
+    if ((tokens == 2 && sscanf(input, "w24top %31s", count) == 1) ||
+        (tokens == 3 && sscanf(input, "w24top -t %31s", count) == 1)) {
+        if (strspn(count, "0123456789") == strlen(count) && atol(count) > 0) {
+            return 1;  // Validation successful
+        }
+    }
+    printf("Error: Command requires a positive count, optionally after -t\n");
+    return 0;  // Validation failed
+}
+
+//Function to validate w24fc command
+int validateW24fc(const char *input) {
+    //The texts to look for, after -a if given, then optionally a file selection
+    if (countTokens(input) >= (strncmp(input, "w24fc -a ", 9) == 0 ? 3 : 2)) {
+        return 1;  // Validation successful
+    } else {
+        printf("Error: Command requires the text to search for\n");
+        return 0;  // Validation failed
+    }
+}
+
+//Function to validate w24sum command
+int validateW24sum(const char *input) {
+    //Nothing, or a file selection with its arguments
+    if (countTokens(input) != 2) {
+        return 1;  // Validation successful
+    } else {
+        printf("Error: A file selection needs its arguments\n");
+        return 0;  // Validation failed
+    }
+}
+
 //Function to validate w24ft command
 int validateW24ft(const char *input) {
     //Check if the number of tokens (words) in the input string is between 2 and 4
@@ -145,64 +240,569 @@ int validateDateCommand(const char *input) {
     printf("Error: Invalid command or date format.\n");
     return 0;
 }
+// Read more bytes from the socket into the buffer, compacting it first
+ssize_t fill_buffer(struct connection *conn) {
+    if (conn->start > 0) {
+        memmove(conn->buf, conn->buf + conn->start, conn->end - conn->start);
+        conn->end -= conn->start;
+        conn->start = 0;
+    }
+    ssize_t n = recv(conn->sock, conn->buf + conn->end, sizeof(conn->buf) - conn->end, 0);
+    if (n > 0) {
+        conn->end += n;
+    }
+    return n;
+}
+
+// Read exactly len bytes, taking buffered bytes first
+int read_exact(struct connection *conn, void *dst, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        if (conn->start == conn->end) {
+            ssize_t n = fill_buffer(conn);
+            if (n <= 0) {
+                if (n == 0) {
+                    printf("Connection closed by server.\n");
+                } else {
+                    perror("recv");
+                }
+                return -1;
+            }
+        }
+        size_t take = conn->end - conn->start;
+        if (take > len - got) {
+            take = len - got;
+        }
+        memcpy((char *)dst + got, conn->buf + conn->start, take);
+        conn->start += take;
+        got += take;
+    }
+    return 0;
+}
 
-// Function to receive a file from a socket and save it to disk
-void receive_file(int sock, const char *filename) {
+// Print a text reply to out up to the end marker, which may be split across reads
+int read_text_reply(struct connection *conn, FILE *out) {
+    const char *marker = "\nEND_OF_RESPONSE\n";
+    size_t marker_len = strlen(marker);
+    while (1) {
+        char *data = conn->buf + conn->start;
+        size_t avail = conn->end - conn->start;
+        char *found = memmem(data, avail, marker, marker_len);
+        if (found != NULL) {
+            fwrite(data, 1, found - data, out);
+            conn->start += (found - data) + marker_len;
+            return 0;
+        }
+        // Everything except a possible partial marker at the end can be printed now
+        if (avail >= marker_len) {
+            size_t flush = avail - (marker_len - 1);
+            fwrite(data, 1, flush, out);
+            conn->start += flush;
+        }
+        ssize_t n = fill_buffer(conn);
+        if (n <= 0) {
+            perror("read");
+            return -1;
+        }
+    }
+}
 
-    // Open the file for writing, creating it if it doesn't exist, and truncating it to zero length
-    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (fd == -1) {
-        perror("open");
-        return;
+// Function to reserve size bytes for a file about to be received, so a large
+// archive is laid out contiguously instead of growing one write at a time
+void preallocate(int fd, off_t size) {
+    if (size > 0 && fallocate(fd, 0, 0, size) == -1) {
+        // Not every filesystem supports fallocate; the size still has to be right
+        if (ftruncate(fd, size) == -1) {
+            perror("ftruncate");
+        }
     }
+}
 
-    //Get the file size from socket
-    off_t file_size;
-    recv(sock, &file_size, sizeof(off_t), 0);
-
-    // Initialize remaining bytes to be received
-    off_t remaining = file_size;
-    while (remaining > 0) {
-        char buffer[CHUNK_SIZE];
-        //Recieve data from socket
-        ssize_t bytes_received = recv(sock, buffer, sizeof(buffer), 0);
+// Function to copy whatever is left in a pipe to fd at offset, for when splice into fd fails
+int drain_pipe(int pipe_fd, size_t len, int fd, off_t *offset) {
+    char buf[CHUNK_SIZE * 64];
+    while (len > 0) {
+        ssize_t n = read(pipe_fd, buf, len < sizeof(buf) ? len : sizeof(buf));
+        if (n <= 0) {
+            perror("read pipe");
+            return -1;
+        }
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t written = pwrite(fd, buf + done, n - done, *offset);
+            if (written <= 0) {
+                perror("write");
+                return -1;
+            }
+            done += written;
+            *offset += written;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+// Function to move length bytes of an archive from the connection into fd at offset,
+// adding them to digest. Bytes already buffered are written first. The rest is spliced
+// socket -> pipe -> file, so it never passes through user space on the way in, and each
+// spliced piece is hashed back from the page cache; if splice is unavailable it is read
+// into a buffer that doubles while reads keep filling it. fd must be open for reading too.
+int receive_into(struct connection *conn, int fd, off_t offset, off_t length, struct digest *digest) {
+    while (length > 0 && conn->start < conn->end) {
+        size_t chunk = conn->end - conn->start;
+        if ((off_t)chunk > length) {
+            chunk = length;
+        }
+        ssize_t written = pwrite(fd, conn->buf + conn->start, chunk, offset);
+        if (written <= 0) {
+            perror("write");
+            return -1;
+        }
+        digest_update(digest, conn->buf + conn->start, written);
+        conn->start += written;
+        offset += written;
+        length -= written;
+    }
+
+    int pipefd[2];
+    if (length > 0 && pipe(pipefd) == 0) {
+        int pipe_size = fcntl(pipefd[1], F_SETPIPE_SZ, RECEIVE_PIPE_SIZE);
+        if (pipe_size <= 0) {
+            pipe_size = fcntl(pipefd[1], F_GETPIPE_SZ);
+        }
+        int status = 0, spliced = 0;
+        while (length > 0) {
+            size_t want = length < pipe_size ? (size_t)length : (size_t)pipe_size;
+            ssize_t in = splice(conn->sock, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (in == -1 && errno == EINTR) {
+                continue;
+            }
+            if (in == -1 && !spliced && (errno == EINVAL || errno == ENOSYS)) {
+                break; // Use the buffered path below
+            }
+            if (in <= 0) {
+                if (in == 0) {
+                    printf("Connection closed by server.\n");
+                } else {
+                    perror("splice");
+                }
+                status = -1;
+                break;
+            }
+            spliced = 1;
+            length -= in;
+            off_t landed = offset;
+            while (in > 0) {
+                ssize_t out = splice(pipefd[0], NULL, fd, &offset, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (out == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (out <= 0) {
+                    // The file does not take splice; copy what is in the pipe by hand
+                    status = drain_pipe(pipefd[0], in, fd, &offset);
+                    in = 0;
+                    break;
+                }
+                in -= out;
+            }
+            if (status == 0 && digest_fd(digest, fd, landed, offset - landed, conn->buf, sizeof(conn->buf)) == -1) {
+                perror("read back");
+                status = -1;
+            }
+            if (status == -1) {
+                break;
+            }
+        }
+        close(pipefd[0]);
+        close(pipefd[1]);
+        if (status == -1) {
+            return -1;
+        }
+    }
+
+    size_t capacity = RECEIVE_BUFFER_MIN;
+    char *buf = length > 0 ? malloc(capacity) : NULL;
+    if (length > 0 && buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    while (length > 0) {
+        size_t want = (off_t)capacity < length ? capacity : (size_t)length;
+        ssize_t bytes_received = recv(conn->sock, buf, want, 0);
         if (bytes_received <= 0) {
             if (bytes_received == 0) {
                 printf("Connection closed by server.\n");
             } else {
                 perror("recv");
             }
-            close(fd);
-            return;
+            free(buf);
+            return -1;
+        }
+        digest_update(digest, buf, bytes_received);
+        for (ssize_t done = 0; done < bytes_received; ) {
+            ssize_t written = pwrite(fd, buf + done, bytes_received - done, offset);
+            if (written <= 0) {
+                perror("write");
+                free(buf);
+                return -1;
+            }
+            done += written;
+            offset += written;
         }
+        length -= bytes_received;
+        // A full read means more is waiting; read more at a time
+        if ((size_t)bytes_received == capacity && capacity < RECEIVE_BUFFER_MAX) {
+            char *bigger = realloc(buf, capacity * 2);
+            if (bigger != NULL) {
+                buf = bigger;
+                capacity *= 2;
+            }
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+// Function to read the digest trailer that follows an archive body and compare it
+// with what arrived. The trailer is always consumed, so the connection stays in step.
+int check_trailer(struct connection *conn, const struct digest *digest) {
+    uint64_t sent;
+    if (read_exact(conn, &sent, sizeof(sent)) == -1) {
+        return -1;
+    }
+    uint64_t received = digest_final(digest);
+    if (sent != received) {
+        fprintf(stderr, "Archive corrupted in transit: server sent %016llx, received %016llx\n",
+                (unsigned long long)sent, (unsigned long long)received);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to receive file_size bytes from the server and save them to disk
+int receive_file(struct connection *conn, const char *filename, off_t file_size) {
+
+    // Open the file, creating it if it doesn't exist, and truncating it to zero length
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+    preallocate(fd, file_size);
+
+    struct digest digest;
+    digest_init(&digest);
+    int result = receive_into(conn, fd, 0, file_size, &digest);
+    close(fd);
+    if (result == 0 && check_trailer(conn, &digest) == -1) {
+        unlink(filename); // Don't leave a corrupted archive behind
+        result = -1;
+    }
+    return result;
+}
+
+// Function to pass n bytes waiting in the hold pipe on to pipe_fd and add them to digest.
+// tee duplicates them into pipe_fd without copying; the hold pipe's own copy is then
+// read out through the connection buffer, which is empty at this point, and hashed.
+int forward_held(struct connection *conn, int hold_fd, int pipe_fd, ssize_t n, struct digest *digest) {
+    while (n > 0) {
+        ssize_t teed = tee(hold_fd, pipe_fd, n, 0);
+        if (teed == -1 && errno == EINTR) {
+            continue;
+        }
+        if (teed <= 0) {
+            perror("tee");
+            return -1;
+        }
+        for (ssize_t done = 0; done < teed; ) {
+            size_t want = teed - done < (ssize_t)sizeof(conn->buf) ? (size_t)(teed - done) : sizeof(conn->buf);
+            ssize_t got = read(hold_fd, conn->buf, want);
+            if (got == -1 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                perror("read pipe");
+                return -1;
+            }
+            digest_update(digest, conn->buf, got);
+            done += got;
+        }
+        n -= teed;
+    }
+    return 0;
+}
 
-        //Write the recieved data into file
-        ssize_t bytes_written = write(fd, buffer, bytes_received);
-        if (bytes_written == -1) {
+// Function to feed length bytes of an archive from the connection into a pipe, adding
+// them to digest. The socket is spliced into a hold pipe and teed on from there, so the
+// body reaches pipe_fd without a copy and memory use is bounded by the pipes.
+int receive_to_pipe(struct connection *conn, int pipe_fd, off_t length, struct digest *digest) {
+    while (length > 0 && conn->start < conn->end) {
+        size_t chunk = conn->end - conn->start;
+        if ((off_t)chunk > length) {
+            chunk = length;
+        }
+        ssize_t written = write(pipe_fd, conn->buf + conn->start, chunk);
+        if (written <= 0) {
             perror("write");
-            close(fd);
-            return;
+            return -1;
         }
+        digest_update(digest, conn->buf + conn->start, written);
+        conn->start += written;
+        length -= written;
+    }
 
-        // Update remaining bytes to be received
-        remaining -= bytes_written;
+    int hold[2];
+    int use_splice = length > 0 && pipe(hold) == 0;
+    if (use_splice) {
+        fcntl(hold[1], F_SETPIPE_SZ, RECEIVE_PIPE_SIZE);
     }
+    int held = use_splice, status = 0;
+    while (length > 0) {
+        ssize_t n;
+        if (use_splice) {
+            size_t want = length < RECEIVE_PIPE_SIZE ? (size_t)length : RECEIVE_PIPE_SIZE;
+            n = splice(conn->sock, NULL, hold[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                use_splice = 0;
+                continue;
+            }
+            if (n > 0 && forward_held(conn, hold[0], pipe_fd, n, digest) == -1) {
+                status = -1;
+                break;
+            }
+        } else {
+            // Without splice, go through the connection buffer
+            size_t want = length < (off_t)sizeof(conn->buf) ? (size_t)length : sizeof(conn->buf);
+            n = recv(conn->sock, conn->buf, want, 0);
+            if (n > 0) {
+                digest_update(digest, conn->buf, n);
+            }
+            for (ssize_t done = 0; n > 0 && done < n; ) {
+                ssize_t written = write(pipe_fd, conn->buf + done, n - done);
+                if (written <= 0) {
+                    perror("write");
+                    status = -1;
+                    break;
+                }
+                done += written;
+            }
+            if (status == -1) {
+                break;
+            }
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                printf("Connection closed by server.\n");
+            } else {
+                perror("receive");
+            }
+            status = -1;
+            break;
+        }
+        length -= n;
+    }
+    if (held) {
+        close(hold[0]);
+        close(hold[1]);
+    }
+    return status;
+}
 
-    printf("File received: %s\n", filename);
+// Function to start tar -xz unpacking into dir. Returns the pipe that feeds it, or -1.
+int start_extraction(const char *dir, pid_t *pid) {
+    if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    int pipefd[2];
+    if (pipe(pipefd) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    fcntl(pipefd[1], F_SETPIPE_SZ, RECEIVE_PIPE_SIZE);
 
-    close(fd);
+    *pid = fork();
+    if (*pid == 0) {
+        dup2(pipefd[0], STDIN_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        execlp("tar", "tar", "-xzf", "-", "-C", dir, (char *)NULL);
+        perror("exec tar");
+        _exit(127);
+    }
+    close(pipefd[0]);
+    if (*pid < 0) {
+        perror("fork");
+        close(pipefd[1]);
+        return -1;
+    }
+    return pipefd[1];
 }
 
-void connectAndHandle(int port) {
+// Function to close tar's input and wait for it; 0 if everything was unpacked
+int finish_extraction(const char *dir, int pipe_fd, pid_t pid) {
+    close(pipe_fd);
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Extracting into %s failed\n", dir);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to unpack an archive into dir while it is being received. The body goes
+// straight into tar -xz, so decompression and extraction overlap the download and
+// nothing is written to disk but the extracted files. A digest mismatch is only known
+// once tar has seen the whole body, so it is reported after the files are unpacked.
+int extract_archive(struct connection *conn, const char *dir, off_t file_size) {
+    pid_t pid;
+    int pipe_fd = start_extraction(dir, &pid);
+    if (pipe_fd == -1) {
+        return -1;
+    }
+    struct digest digest;
+    digest_init(&digest);
+    int result = receive_to_pipe(conn, pipe_fd, file_size, &digest);
+    if (result == 0) {
+        result = check_trailer(conn, &digest);
+    }
+    if (finish_extraction(dir, pipe_fd, pid) == -1) {
+        result = -1;
+    }
+    return result;
+}
+
+// Function to receive an archive sent while it is still being built: chunks each
+// prefixed with an off_t length, ending with a zero-length chunk and the digest of
+// every chunk. A negative length means the server gave up; its message follows.
+// Returns as receive_archive.
+int receive_streamed_archive(struct connection *conn, const char *filename, FILE *message_out) {
+    pid_t pid = -1;
+    int out = extract_dir != NULL ? start_extraction(extract_dir, &pid)
+                                  : open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (out == -1) {
+        perror("open");
+        return -1;
+    }
+    off_t offset = 0;
+    int result = 1;
+    struct digest digest;
+    digest_init(&digest);
+    while (1) {
+        off_t length;
+        if (read_exact(conn, &length, sizeof(off_t)) == -1) {
+            result = -1;
+            break;
+        }
+        if (length == 0) {
+            if (check_trailer(conn, &digest) == -1) {
+                result = -1;
+            }
+            break;
+        }
+        if (length < 0) {
+            result = read_text_reply(conn, message_out) == 0 ? 0 : -1;
+            break;
+        }
+        int received = extract_dir != NULL ? receive_to_pipe(conn, out, length, &digest)
+                                           : receive_into(conn, out, offset, length, &digest);
+        if (received == -1) {
+            result = -1;
+            break;
+        }
+        offset += length;
+    }
+    if (extract_dir != NULL) {
+        if (finish_extraction(extract_dir, out, pid) == -1 && result == 1) {
+            result = -1;
+        }
+    } else {
+        close(out);
+        if (result != 1) {
+            unlink(filename); // Don't leave a truncated archive behind
+        }
+    }
+    return result;
+}
+
+int receive_archive(struct connection *conn, const char *filename, FILE *message_out) {
+    off_t file_size;
+    if (read_exact(conn, &file_size, sizeof(off_t)) == -1) {
+        return -1;
+    }
+    if (file_size == -1) {
+        return receive_streamed_archive(conn, filename, message_out);
+    }
+    if (file_size <= 0) {
+        return read_text_reply(conn, message_out) == 0 ? 0 : -1;
+    }
+    if (extract_dir != NULL) {
+        return extract_archive(conn, extract_dir, file_size) == 0 ? 1 : -1;
+    }
+    return receive_file(conn, filename, file_size) == 0 ? 1 : -1;
+}
+
+// Kinds of commands, by how their reply is framed
+#define KIND_INVALID 0
+#define KIND_TEXT 1
+#define KIND_ARCHIVE 2
+#define KIND_QUIT 3
+
+// Function to validate a command line (ending in a newline) and tell how its reply is framed
+int classifyCommand(const char *message) {
+    if (strcmp(message, "quitc\n") == 0) {
+        return KIND_QUIT;
+    }
+    if (strcmp(message, "dirlist -a\n") == 0 || strcmp(message, "dirlist -t\n") == 0 ||
+        strcmp(message, "stats\n") == 0) {
+        return KIND_TEXT;
+    }
+    if (strncmp(message, "w24fn ", 6) == 0) {
+        return validateCommandWithOneArg(message) ? KIND_TEXT : KIND_INVALID;
+    }
+    if (strncmp(message, "w24fs ", 6) == 0) {
+        return validateW24fs(message) ? KIND_TEXT : KIND_INVALID;
+    }
+    if (strncmp(message, "w24du ", 6) == 0) {
+        return validateW24du(message) ? KIND_TEXT : KIND_INVALID;
+    }
+    if (strncmp(message, "w24top ", 7) == 0) {
+        return validateW24top(message) ? KIND_TEXT : KIND_INVALID;
+    }
+    if (strncmp(message, "w24fc ", 6) == 0) {
+        if (!validateW24fc(message)) {
+            return KIND_INVALID;
+        }
+        return strncmp(message, "w24fc -a ", 9) == 0 ? KIND_ARCHIVE : KIND_TEXT;
+    }
+    if (strcmp(message, "w24sum\n") == 0 || strncmp(message, "w24sum ", 7) == 0) {
+        return validateW24sum(message) ? KIND_TEXT : KIND_INVALID;
+    }
+    if (strncmp(message, "w24fz ", 6) == 0) {
+        return validateW24fz(message) ? KIND_ARCHIVE : KIND_INVALID;
+    }
+    if (strncmp(message, "w24ft ", 6) == 0) {
+        return validateW24ft(message) ? KIND_ARCHIVE : KIND_INVALID;
+    }
+    if (strncmp(message, "w24fdb ", 7) == 0 || strncmp(message, "w24fda ", 7) == 0) {
+        return validateCommandWithOneArg(message) ? KIND_ARCHIVE : KIND_INVALID;
+    }
+    return KIND_INVALID;
+}
+
+// Function to connect to a server; the coordinator may redirect us to a mirror.
+// Returns the connected socket, or -1 on failure.
+int connectToServer(int port) {
     int sock = 0, valread;
     struct sockaddr_in serv_addr;
     char buffer[1024] = {0};
-    char message[1024];
 
     // Creating socket file descriptor
     if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         printf("\n Socket creation error \n");
-        return;
+        return -1;
     }
 
     serv_addr.sin_family = AF_INET;
@@ -212,257 +812,543 @@ void connectAndHandle(int port) {
     if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0) {
         printf("\nInvalid address/ Address not supported \n");
         close(sock);
-        return;
+        return -1;
     }
 
     // Connecting to the server
     if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
         printf("\nConnection Failed \n");
         close(sock);
-        return;
+        return -1;
     }
 
     // Special handling for initial coordinator connection
     if (port == PORT) {
         // Read the port number for the next server
         valread = read(sock, buffer, 1024);
+        if (valread <= 0) {
+            close(sock);
+            return -1;
+        }
         int nextPort = atoi(buffer);
-  // Close the initial connection
         if (nextPort != PORT) {
             // If the next port is different, connect to the new server
-            close(sock); 
+            close(sock);
+            return connectToServer(nextPort);
+        }
+    }
+    return sock;
+}
 
-            connectAndHandle(nextPort);
-            return;
+// Function to download length bytes at offset of the spooled archive id into fd.
+// Each segment is written in place at its offset, so segments can arrive in any order,
+// and is checked against its own digest trailer.
+int fetchSegment(struct connection *conn, const char *id, off_t offset, off_t length, int fd) {
+    char request[256];
+    int len = snprintf(request, sizeof(request), "w24range %s %lld %lld\n", id, (long long)offset, (long long)length);
+    if (send(conn->sock, request, len, 0) != len) {
+        perror("send");
+        return -1;
+    }
+    off_t size;
+    if (read_exact(conn, &size, sizeof(off_t)) == -1) {
+        return -1;
+    }
+    if (size != length) {
+        // Size 0 comes with a message saying what went wrong
+        if (size == 0) {
+            read_text_reply(conn, stderr);
         }
+        fprintf(stderr, "Segment at %lld: expected %lld bytes, server has %lld\n",
+                (long long)offset, (long long)length, (long long)size);
+        return -1;
+    }
+    struct digest digest;
+    digest_init(&digest);
+    if (receive_into(conn, fd, offset, length, &digest) == -1) {
+        return -1;
+    }
+    return check_trailer(conn, &digest);
+}
+
+// Function to check the downloaded archive end to end; gzip verifies its CRC and length
+int verifyArchive(const char *filename) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        execlp("gzip", "gzip", "-t", filename, (char *)NULL);
+        perror("exec gzip");
+        _exit(127);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) == -1) {
+        return -1;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// Function to download a spooled archive over parallel_streams connections.
+// Every connection goes through the coordinator, so the segments are spread
+// over the server and its mirrors. Returns 0 once the archive is complete and verified.
+int downloadSegments(const char *id, off_t size, const char *filename) {
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+    preallocate(fd, size);
+
+    int streams = size < PARALLEL_MIN_SIZE ? 1 : parallel_streams;
+    off_t segment = (size + streams - 1) / streams;
+    pid_t pids[MAX_STREAMS];
+    int children = 0, status = 0;
+
+    // Children take segments 1..streams-1, this process takes segment 0 and keeps
+    // its connection to release the archive afterwards
+    for (int i = 1; i < streams; i++) {
+        off_t offset = segment * i;
+        off_t length = offset + segment > size ? size - offset : segment;
+        if (length <= 0) {
+            break;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            struct connection *conn = calloc(1, sizeof(struct connection));
+            if (conn == NULL || (conn->sock = connectToServer(PORT)) < 0) {
+                _exit(1);
+            }
+            int result = fetchSegment(conn, id, offset, length, fd);
+            close(conn->sock);
+            _exit(result == 0 ? 0 : 1);
+        }
+        if (pid < 0) {
+            perror("fork");
+            status = -1;
+            break;
+        }
+        pids[children++] = pid;
+    }
+
+    struct connection *conn = calloc(1, sizeof(struct connection));
+    if (conn == NULL || (conn->sock = connectToServer(PORT)) < 0) {
+        status = -1;
+    } else if (fetchSegment(conn, id, 0, segment < size ? segment : size, fd) == -1) {
+        status = -1;
+    }
+    for (int i = 0; i < children; i++) {
+        int child_status;
+        if (waitpid(pids[i], &child_status, 0) == -1 || !WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0) {
+            status = -1;
+        }
+    }
+    close(fd);
+
+    if (status == 0 && verifyArchive(filename) == -1) {
+        fprintf(stderr, "Archive %s failed verification\n", filename);
+        status = -1;
+    }
+
+    // Release the spooled copy; the server sweeps it later if this does not arrive
+    if (conn != NULL && conn->sock >= 0) {
+        char done[128];
+        int len = snprintf(done, sizeof(done), "w24done %s\n", id);
+        FILE *ignore = fopen("/dev/null", "w");
+        if (ignore != NULL && send(conn->sock, done, len, 0) == len) {
+            read_text_reply(conn, ignore);
+        }
+        if (ignore != NULL) {
+            fclose(ignore);
+        }
+        close(conn->sock);
+    }
+    free(conn);
+    return status;
+}
+
+// Reply to an archive command sent as "w24prep <command>": "ARCHIVE <id> <size>"
+// when the server spooled an archive, otherwise a message saying why there is none.
+// Same return values as receive_archive.
+int receive_prepared_archive(struct connection *conn, const char *filename, FILE *message_out) {
+    char *text = NULL;
+    size_t text_len = 0;
+    FILE *reply = open_memstream(&text, &text_len);
+    if (reply == NULL) {
+        perror("open_memstream");
+        return -1;
+    }
+    int result = read_text_reply(conn, reply);
+    fclose(reply);
+    if (result == -1) {
+        free(text);
+        return -1;
+    }
+
+    char id[64];
+    long long size;
+    if (sscanf(text, "ARCHIVE %63s %lld", id, &size) == 2) {
+        result = downloadSegments(id, size, filename) == 0 ? 1 : -1;
+    } else {
+        fputs(text, message_out);
+        result = 0;
+    }
+    free(text);
+    return result;
+}
+
+void connectAndHandle(int port) {
+    char message[1024];
+    struct connection *conn = calloc(1, sizeof(struct connection));
+    if (conn == NULL) {
+        perror("calloc");
+        return;
+    }
+    conn->sock = connectToServer(port);
+    if (conn->sock < 0) {
+        free(conn);
+        return;
     }
 
-  int command_sent = 0;
     // Begin user input loop for command execution
-memset(buffer, 0, sizeof(buffer));
     while(1) {
         printf("clientw24$ ");
-        fgets(message, sizeof(message), stdin); // Getting user input
+        if (fgets(message, sizeof(message), stdin) == NULL) { // Getting user input
+            break;
+        }
 
-     
         // Check for quit command
         if (strcmp(message, "quitc\n") == 0) {
             printf("Exiting connection...\n");
             break;
         }
 
-        else if (strcmp(message, "dirlist -a\n") == 0) {
+        else if (strcmp(message, "dirlist -a\n") == 0 || strcmp(message, "dirlist -t\n") == 0) {
             printf("Requesting directory list from server...\n");
             // Sending the command to the server
-            send(sock, message, strlen(message), 0);
+            send(conn->sock, message, strlen(message), 0);
 
             // Read directory list from the server
             printf("Directory list received from server:\n");
-             int end_received = 0;
-    while (!end_received) {
-        valread = read(sock, buffer, 1023); // Read data into buffer, leaving space for null terminator
-        if (valread > 0) {
-            buffer[valread] = '\0'; // Null-terminate the received data
-            // Check if the end marker is in the buffer
-            if (strstr(buffer, "\nEND_OF_RESPONSE\n") != NULL) {
-                *strstr(buffer, "\nEND_OF_RESPONSE\n") = '\0'; // Cut off the marker at its start
-                end_received = 1; // Set flag to exit the loop
-            }
-            printf("%s", buffer); // Print the received data
-        } else if (valread <= 0) {
-            perror("read");
-            break; // Break from the loop in case of read error or disconnection
+            read_text_reply(conn, stdout);
         }
-        memset(buffer, 0, sizeof(buffer)); // Clear the buffer for the next read
-    }      
+        else if (strcmp(message, "stats\n") == 0) {
+            printf("Requesting statistics from server...\n");
+            send(conn->sock, message, strlen(message), 0);
+            read_text_reply(conn, stdout);
         }
-        else if (strcmp(message, "dirlist -t\n") == 0) {
-            printf("Requesting directory list from server...\n");
-            // Sending the command to the server
-            send(sock, message, strlen(message), 0);
+        else if (strncmp(message, "w24fn ", 6) == 0) {
+            if (validateCommandWithOneArg(message)) {
+                printf("Requesting file information from server...\n");
+                // Sending the command to the server
+                send(conn->sock, message, strlen(message), 0);
 
-            // Read directory list from the server
-            printf("Directory list received from server:\n");
-            int end_received = 0;
-    while (!end_received) {
-        valread = read(sock, buffer, 1023); // Read data into buffer, leaving space for null terminator
-        if (valread > 0) {
-            buffer[valread] = '\0'; // Null-terminate the received data
-            // Check if the end marker is in the buffer
-            if (strstr(buffer, "\nEND_OF_RESPONSE\n") != NULL) {
-                *strstr(buffer, "\nEND_OF_RESPONSE\n") = '\0'; // Cut off the marker at its start
-                end_received = 1; // Set flag to exit the loop
-            }
-            printf("%s", buffer); // Print the received data
-        } else if (valread <= 0) {
-            perror("read");
-            break; // Break from the loop in case of read error or disconnection
+                // Read file information from the server
+                printf("File information received from server:\n");
+                read_text_reply(conn, stdout);
+            }
         }
-        memset(buffer, 0, sizeof(buffer)); // Clear the buffer for the next read
-    }
+        else if (strncmp(message, "w24fs ", 6) == 0) {
+            if (validateW24fs(message)) {
+                printf("Searching the file index...\n");
+                send(conn->sock, message, strlen(message), 0);
+                read_text_reply(conn, stdout);
+            }
         }
-        else if (strncmp(message, "w24fn ", 6) == 0) {
-        
-        if (!validateCommandWithOneArg(message)) {
-        
-    }
-        else {
-            printf("Requesting file information from server...\n");
-            // Sending the command to the server
-            send(sock, message, strlen(message), 0);
-            command_sent = 1; // Set flag to indicate command has been sent
-
-            // Read file information from the server
-            printf("File information received from server:\n");
-            int end_received = 0;
-    while (!end_received) {
-        valread = read(sock, buffer, 1023); // Read data into buffer, leaving space for null terminator
-        if (valread > 0) {
-            buffer[valread] = '\0'; // Null-terminate the received data
-            // Check if the end marker is in the buffer
-            if (strstr(buffer, "\nEND_OF_RESPONSE\n") != NULL) {
-                *strstr(buffer, "\nEND_OF_RESPONSE\n") = '\0'; // Cut off the marker at its start
-                end_received = 1; // Set flag to exit the loop
-            }
-            printf("%s", buffer); // Print the received data
-        } else if (valread <= 0) {
-            perror("read");
-            break; // Break from the loop in case of read error or disconnection
+        else if (strncmp(message, "w24du ", 6) == 0) {
+            if (validateW24du(message)) {
+                printf("Requesting directory sizes from server...\n");
+                send(conn->sock, message, strlen(message), 0);
+                read_text_reply(conn, stdout);
+            }
         }
-        memset(buffer, 0, sizeof(buffer)); // Clear the buffer for the next read
-    }
-    
-   }
-    
+        else if (strncmp(message, "w24top ", 7) == 0) {
+            if (validateW24top(message)) {
+                printf("Requesting the top files from server...\n");
+                send(conn->sock, message, strlen(message), 0);
+                read_text_reply(conn, stdout);
             }
-        else if (strncmp(message, "w24fz ", 6) == 0) {
-         if (!validateW24fz(message)) {
-    }
-    else
-    {
-    printf("Requesting files within size range from server...\n");
-    send(sock, message, strlen(message), 0); // Send the w24fz command
-    receive_file(sock, "temp.tar.gz"); // Expect to receive tar.gz or a "no file found" indication
-    }
-}
+        }
+        else if (strncmp(message, "w24fc ", 6) == 0 && strncmp(message, "w24fc -a ", 9) != 0) {
+            if (validateW24fc(message)) {
+                printf("Searching file contents...\n");
+                send(conn->sock, message, strlen(message), 0);
+                read_text_reply(conn, stdout);
+            }
+        }
+        else if (strcmp(message, "w24sum\n") == 0 || strncmp(message, "w24sum ", 7) == 0) {
+            if (validateW24sum(message)) {
+                printf("Checksumming files on server...\n");
+                send(conn->sock, message, strlen(message), 0);
+                read_text_reply(conn, stdout);
+            }
+        }
+        else if (strncmp(message, "w24fc -a ", 9) == 0 ||
+                 strncmp(message, "w24fz ", 6) == 0 || strncmp(message, "w24ft ", 6) == 0 ||
+                 strncmp(message, "w24fdb ", 7) == 0 || strncmp(message, "w24fda ", 7) == 0) {
+            if (classifyCommand(message) == KIND_ARCHIVE) {
+                printf("Requesting files from server...\n");
+                int result;
+                if (parallel_streams > 1) {
+                    // Have the archive spooled, then fetch it in segments over several connections
+                    char prepared[1100];
+                    snprintf(prepared, sizeof(prepared), "w24prep %s", message);
+                    send(conn->sock, prepared, strlen(prepared), 0);
+                    result = receive_prepared_archive(conn, "temp.tar.gz", stdout);
+                } else {
+                    send(conn->sock, message, strlen(message), 0);
+                    result = receive_archive(conn, "temp.tar.gz", stdout);
+                }
 
-else if (strncmp(message, "w24ft ", 6) == 0) {
+                // Either the archive arrives, or a message saying why there is none
+                if (result == 1 && extract_dir != NULL) {
+                    printf("Files extracted into: %s\n", extract_dir);
+                } else if (result == 1) {
+                    printf("File received: %s\n", "temp.tar.gz");
+                } else if (result == -1) {
+                    // The rest of the body may still be in the socket, where it would be
+                    // read as the reply to the next command
+                    printf("The archive could not be received, closing the connection\n");
+                    break;
+                }
+            }
+        }
+        else
+        {
+            printf("You have entered an invalid command . Please refer below:");
+            print_help();
+        }
 
-if (!validateW24ft(message)) {
-       
+        printf("\n");
     }
-        else 
-{
-    printf("Requesting files of specified types from server...\n");
-    send(sock, message, strlen(message), 0); // Send the w24ft command
 
-    // Directly read the response
-    char response[CHUNK_SIZE] = {0};
-    int bytes_read = recv(sock, response, sizeof(response), 0);
+    // Close the connection
+    close(conn->sock);
+    free(conn);
+}
+
+// One command of a batch and where its result goes
+struct batch_command {
+    char line[1024];      // command text including the trailing newline
+    char output[1024];    // archive file name for archive commands
+    int kind;
+};
 
-    if (bytes_read <= 0) {
-        // Error handling
-        perror("Error receiving response from server");
-        continue;
+// Function to add a batch command; "command > file" names the archive explicitly
+int addBatchCommand(struct batch_command **cmds, int *count, int *capacity, const char *text, const char *pattern) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        *cmds = realloc(*cmds, *capacity * sizeof(struct batch_command));
+        if (*cmds == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
     }
+    struct batch_command *cmd = &(*cmds)[*count];
+    char command[1024];
+    snprintf(command, sizeof(command), "%s", text);
+    command[strcspn(command, "\n")] = '\0';
 
-    // Attempt to interpret the response as a file size (assuming error messages won't be 8 bytes exactly)
-    off_t file_size;
-    memcpy(&file_size, response, sizeof(file_size));
-    
-    if (file_size > 0 && file_size != (off_t)-1) { // Check for a valid, non-error file size
-        // Assume it's a file size and proceed to receive the file
-        receive_file(sock, "temp.tar.gz");
-    } else {
-        // Assume it's an error message and print it
-        printf("%s\n", response);
+    char *redirect = strchr(command, '>');
+    cmd->output[0] = '\0';
+    if (redirect != NULL) {
+        *redirect = '\0';
+        char *name = redirect + 1;
+        while (isspace((unsigned char)*name)) name++;
+        snprintf(cmd->output, sizeof(cmd->output), "%s", name);
+    }
+    // Trim trailing spaces left in front of the redirect
+    size_t len = strlen(command);
+    while (len > 0 && isspace((unsigned char)command[len - 1])) {
+        command[--len] = '\0';
     }
+    if (cmd->output[0] == '\0') {
+        snprintf(cmd->output, sizeof(cmd->output), pattern, *count + 1);
     }
+    snprintf(cmd->line, sizeof(cmd->line), "%s\n", command);
+    cmd->kind = classifyCommand(cmd->line);
+    (*count)++;
+    return cmd->kind;
 }
-else if (strncmp(message, "w24fdb ", 7) == 0) {
 
-if (!validateCommandWithOneArg(message)) {
-       
+// Function to run commands pipelined over one connection. Up to depth commands
+// are in flight at once; replies are read strictly in order.
+// Exit status: 0 all commands succeeded, 1 some archive command returned no archive,
+// 2 an invalid command or a transfer error, 3 no connection.
+int runBatch(struct batch_command *cmds, int count, int depth) {
+    int status = 0;
+    for (int i = 0; i < count; i++) {
+        if (cmds[i].kind == KIND_INVALID) {
+            fprintf(stderr, "[%d] invalid command: %s", i + 1, cmds[i].line);
+            status = 2;
+        }
     }
-        else 
-        {
-    printf("Requesting files of specified types from server...\n");
-    send(sock, message, strlen(message), 0); 
 
-    // Directly read the response
-    char response[CHUNK_SIZE] = {0};
-    int bytes_read = recv(sock, response, sizeof(response), 0);
+    struct connection *conn = calloc(1, sizeof(struct connection));
+    if (conn == NULL) {
+        perror("calloc");
+        return 3;
+    }
+    conn->sock = connectToServer(PORT);
+    if (conn->sock < 0) {
+        free(conn);
+        return 3;
+    }
 
-    if (bytes_read <= 0) {
+    int sent = 0, in_flight = 0;
+    for (int done = 0; done < count; done++) {
+        // Top up the pipeline, coalescing the new commands into one send
+        char out[CHUNK_SIZE * 16];
+        size_t out_len = 0;
+        while (sent < count && in_flight < depth) {
+            struct batch_command *cmd = &cmds[sent];
+            if (cmd->kind == KIND_QUIT) {
+                break;
+            }
+            // With -j archive commands are prepared and then fetched in segments
+            const char *prefix = cmd->kind == KIND_ARCHIVE && parallel_streams > 1 ? "w24prep " : "";
+            size_t prefix_len = strlen(prefix);
+            size_t len = strlen(cmd->line);
+            if (out_len + prefix_len + len > sizeof(out)) {
+                break;
+            }
+            if (cmd->kind != KIND_INVALID) {
+                memcpy(out + out_len, prefix, prefix_len);
+                out_len += prefix_len;
+                memcpy(out + out_len, cmd->line, len);
+                out_len += len;
+                in_flight++;
+            }
+            sent++;
+        }
+        if (out_len > 0 && send(conn->sock, out, out_len, 0) != (ssize_t)out_len) {
+            perror("send");
+            status = 2;
+            break;
+        }
 
-        perror("Error receiving response from server");
-        continue;
+        struct batch_command *cmd = &cmds[done];
+        if (cmd->kind == KIND_QUIT) {
+            break;
+        }
+        if (cmd->kind == KIND_INVALID) {
+            continue;
+        }
+        in_flight--;
+        if (cmd->kind == KIND_TEXT) {
+            if (read_text_reply(conn, stdout) == -1) {
+                status = 2;
+                break;
+            }
+            fflush(stdout);
+            continue;
+        }
+        int result = parallel_streams > 1 ? receive_prepared_archive(conn, cmd->output, stderr)
+                                          : receive_archive(conn, cmd->output, stderr);
+        if (result == 1) {
+            fprintf(stderr, "[%d] %.*s -> %s\n", done + 1, (int)strcspn(cmd->line, "\n"), cmd->line,
+                    extract_dir != NULL ? extract_dir : cmd->output);
+        } else if (result == 0) {
+            fprintf(stderr, "\n[%d] %.*s: no archive\n", done + 1, (int)strcspn(cmd->line, "\n"), cmd->line);
+            if (status == 0) {
+                status = 1;
+            }
+        } else {
+            status = 2;
+            break;
+        }
     }
 
-    // Attempt to interpret the response as a file size (assuming error messages won't be 8 bytes exactly)
-    off_t file_size;
-    memcpy(&file_size, response, sizeof(file_size));
-    
-    if (file_size > 0 && file_size != (off_t)-1) { // Check for a valid, non-error file size
-        // Assume it's a file size and proceed to receive the file
-        receive_file(sock, "temp.tar.gz");
-    } else {
-        // Assume it's an error message and print it
-        printf("%s\n", response);
-    }
-    }
+    close(conn->sock);
+    free(conn);
+    return status;
 }
-else if (strncmp(message, "w24fda ", 7) == 0) {
-if (!validateCommandWithOneArg(message)) {
-        
-    }
-        else {
-    printf("Requesting files of specified types from server...\n");
-    send(sock, message, strlen(message), 0); // Send the w24ft command
 
-    // Directly read the response
-    char response[CHUNK_SIZE] = {0};
-    int bytes_read = recv(sock, response, sizeof(response), 0);
-
-    if (bytes_read <= 0) {
-        // Error handling
-        perror("Error receiving response from server");
-        continue;
-    }
+void print_usage(const char *prog) {
+    printf("Usage: %s [-j streams | -x dir]    interactive session\n", prog);
+    printf("       %s [-b file] [-c command]... [-O pattern] [-d depth] [-j streams | -x dir]\n", prog);
+    printf("   -b <file>      Run the commands in file, one per line (\"-\" reads stdin)\n");
+    printf("   -c <command>   Run this command; may be repeated and combined with -b\n");
+    printf("   -O <pattern>   Archive file name pattern, %%d is the command number (default result-%%d.tar.gz)\n");
+    printf("   -d <depth>     Commands kept in flight on the connection (default 16)\n");
+    printf("   -j <streams>   Download each archive over this many connections (default 1, max %d)\n", MAX_STREAMS);
+    printf("   -x <dir>       Unpack each archive into dir while it downloads instead of saving it\n");
+    printf("A command may end with \"> file\" to name its archive. Blank lines and lines starting with # are ignored.\n");
+}
 
-    // Attempt to interpret the response as a file size (assuming error messages won't be 8 bytes exactly)
-    off_t file_size;
-    memcpy(&file_size, response, sizeof(file_size));
-    
-    if (file_size > 0 && file_size != (off_t)-1) { // Check for a valid, non-error file size
-        // Assume it's a file size and proceed to receive the file
-        receive_file(sock, "temp.tar.gz");
-    } else {
-        // Assume it's an error message and print it
-        printf("%s\n", response);
+#ifdef FILESNAP_BENCH
+#define main clientw24_main
+#endif
+int main(int argc, char *argv[]) {
+    // Batch mode: gather commands from -b files and -c arguments in order
+    const char *pattern = "result-%d.tar.gz";
+    int depth = 16, batch = 0, session_options = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-O") == 0 && i + 1 < argc) {
+            pattern = argv[++i];
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            depth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            parallel_streams = atoi(argv[++i]);
+            session_options++;
+        } else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc) {
+            extract_dir = argv[++i];
+            session_options++;
+        } else if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "-c") == 0) {
+            batch = 1;
+        }
     }
-    
+    // Segments arrive out of order, so a parallel download cannot be unpacked as it streams
+    if (depth < 1 || parallel_streams < 1 || parallel_streams > MAX_STREAMS ||
+        (parallel_streams > 1 && extract_dir != NULL)) {
+        print_usage(argv[0]);
+        return 64;
     }
-}
-else
-{
-printf("You have entered an invalid command . Please refer below:");
-print_help();
-}
 
-        printf("\n");
+    // A failed tar -x must show up as an error, not kill the client with SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
 
-        memset(buffer, 0, sizeof(buffer));
+    if (!batch && argc == 1 + 2 * session_options) {
+        // Initially connect to the coordinator server
+        connectAndHandle(PORT);
+        return 0;
     }
 
-    // Close the connection
-    close(sock);
-}
+    struct batch_command *cmds = NULL;
+    int count = 0, capacity = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            addBatchCommand(&cmds, &count, &capacity, argv[++i], pattern);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            const char *path = argv[++i];
+            FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+            if (fp == NULL) {
+                perror(path);
+                return 64;
+            }
+            char line[1024];
+            while (fgets(line, sizeof(line), fp) != NULL) {
+                char *p = line;
+                while (isspace((unsigned char)*p)) p++;
+                if (*p == '\0' || *p == '#') {
+                    continue;
+                }
+                addBatchCommand(&cmds, &count, &capacity, p, pattern);
+            }
+            if (fp != stdin) {
+                fclose(fp);
+            }
+        } else if ((strcmp(argv[i], "-O") == 0 || strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "-j") == 0 ||
+                    strcmp(argv[i], "-x") == 0) && i + 1 < argc) {
+            i++;
+        } else {
+            print_usage(argv[0]);
+            return 64;
+        }
+    }
+    if (count == 0) {
+        print_usage(argv[0]);
+        return 64;
+    }
 
-int main() {
-    // Initially connect to the coordinator server
-    connectAndHandle(PORT);
-    return 0;
+    int status = runBatch(cmds, count, depth);
+    free(cmds);
+    return status;
 }
-
-
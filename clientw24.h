@@ -0,0 +1,27 @@
+#ifndef CLIENTW24_H
+#define CLIENTW24_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Reply handling of the client that other programs link against; the
+// microbenchmark receives archives with it. Built with FILESNAP_BENCH, the
+// client's main is renamed so such a program can bring its own.
+
+#define CHUNK_SIZE 1024
+
+// Buffered reader over the server socket. Replies can arrive back to back when
+// commands are pipelined, so nothing may be read past the end of the current reply.
+struct connection {
+    int sock;
+    size_t start;
+    size_t end;
+    char buf[CHUNK_SIZE * 64];
+};
+
+// Reply to an archive command: the archive size, then either the archive and its
+// digest, (size 0) a message ending with the end marker, or (size -1) a chunked stream.
+// Returns 1 if an archive was saved, 0 if the server sent a message, -1 on error.
+int receive_archive(struct connection *conn, const char *filename, FILE *message_out);
+
+#endif
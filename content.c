@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "content.h"
+#include "digest.h"
+
+// Most threads one search starts
+#define CONTENT_MAX_THREADS 16
+// Bytes read from a file at once
+#define CONTENT_BUFFER (1024 * 1024)
+// A NUL byte this early in a file makes it binary
+#define CONTENT_BINARY_PROBE 8192
+
+struct pattern {
+    const unsigned char *text;
+    size_t length;
+};
+
+// One pass over a list of files, shared by its threads. visit handles file i
+// with a buffer of CONTENT_BUFFER + longest bytes and returns 1 to count it.
+struct search {
+    char *const *paths;
+    size_t count;
+    int (*visit)(struct search *s, size_t i, unsigned char *buffer);
+    struct pattern patterns[CONTENT_MAX_PATTERNS];
+    int pattern_count;
+    size_t longest;
+    unsigned char *matched;
+    uint64_t *digests;
+    off_t *sizes;
+    size_t next;                // next file to take
+    long found;
+};
+
+static int content_threads = 1;
+
+void content_init(void) {
+    const char *env = getenv("FILESNAP_SEARCH_THREADS");
+    long threads = env != NULL && *env != '\0' ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) {
+        threads = 1;
+    }
+    content_threads = threads > CONTENT_MAX_THREADS ? CONTENT_MAX_THREADS : (int)threads;
+}
+
+// Whether any pattern occurs in data
+static int scan(const struct search *s, const unsigned char *data, size_t length) {
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i first[CONTENT_MAX_PATTERNS], last[CONTENT_MAX_PATTERNS];
+    for (int p = 0; p < s->pattern_count; p++) {
+        first[p] = _mm_set1_epi8((char)s->patterns[p].text[0]);
+        last[p] = _mm_set1_epi8((char)s->patterns[p].text[s->patterns[p].length - 1]);
+    }
+    // A block is 16 candidate starts; each pattern's last byte is compared
+    // from a second load, so both loads must stay inside data
+    for (; i + 16 + s->longest - 1 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        for (int p = 0; p < s->pattern_count; p++) {
+            const struct pattern *pat = &s->patterns[p];
+            __m128i end = _mm_loadu_si128((const __m128i *)(data + i + pat->length - 1));
+            unsigned mask = (unsigned)_mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(block, first[p]), _mm_cmpeq_epi8(end, last[p])));
+            while (mask != 0) {
+                int bit = __builtin_ctz(mask);
+                if (pat->length <= 2 || memcmp(data + i + bit + 1, pat->text + 1, pat->length - 2) == 0) {
+                    return 1;
+                }
+                mask &= mask - 1;
+            }
+        }
+    }
+#endif
+    // The tail the blocks could not cover
+    for (int p = 0; p < s->pattern_count; p++) {
+        if (memmem(data + i, length - i, s->patterns[p].text, s->patterns[p].length) != NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Whether the file at path is text and contains a pattern. buffer holds
+// CONTENT_BUFFER bytes after the longest pattern's worth carried over from
+// the previous read, so a match across two reads is still seen.
+static int search_file(const struct search *s, const char *path, unsigned char *buffer) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return 0;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    size_t kept = 0;
+    int first = 1, hit = 0;
+    while (!hit) {
+        ssize_t n = read(fd, buffer + kept, CONTENT_BUFFER);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        if (first && memchr(buffer, '\0', n < CONTENT_BINARY_PROBE ? (size_t)n : CONTENT_BINARY_PROBE) != NULL) {
+            break;
+        }
+        first = 0;
+        size_t have = kept + (size_t)n;
+        hit = scan(s, buffer, have);
+        kept = have < s->longest - 1 ? have : s->longest - 1;
+        memmove(buffer, buffer + have - kept, kept);
+    }
+    close(fd);
+    return hit;
+}
+
+static int visit_search(struct search *s, size_t i, unsigned char *buffer) {
+    s->matched[i] = (unsigned char)search_file(s, s->paths[i], buffer);
+    return s->matched[i];
+}
+
+// Hash file i whole; a file that cannot be read keeps size -1
+static int visit_checksum(struct search *s, size_t i, unsigned char *buffer) {
+    int fd = open(s->paths[i], O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return 0;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    struct digest digest;
+    digest_init(&digest);
+    off_t size = 0;
+    ssize_t n;
+    while ((n = read(fd, buffer, CONTENT_BUFFER)) != 0) {
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            close(fd);
+            return 0;
+        }
+        digest_update(&digest, buffer, n);
+        size += n;
+    }
+    close(fd);
+    s->digests[i] = digest_final(&digest);
+    s->sizes[i] = size;
+    return 1;
+}
+
+static void *worker(void *arg) {
+    struct search *s = arg;
+    unsigned char *buffer = malloc(CONTENT_BUFFER + s->longest);
+    if (buffer == NULL) {
+        return NULL; // The other threads take its share
+    }
+    size_t i;
+    while ((i = __atomic_fetch_add(&s->next, 1, __ATOMIC_RELAXED)) < s->count) {
+        if (s->visit(s, i, buffer)) {
+            __atomic_fetch_add(&s->found, 1, __ATOMIC_RELAXED);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Visit every file on up to content_threads threads, this one included
+static long run(struct search *s) {
+    pthread_t threads[CONTENT_MAX_THREADS];
+    int started = 0;
+    size_t wanted = s->count < (size_t)content_threads ? s->count : (size_t)content_threads;
+    while ((size_t)started + 1 < wanted && pthread_create(&threads[started], NULL, worker, s) == 0) {
+        started++;
+    }
+    worker(s);
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    // Files nobody could take (every buffer failed) are not counted
+    return s->found;
+}
+
+long content_search(char *const *paths, size_t count, const char *const *patterns, int pattern_count,
+                    unsigned char *matched) {
+    if (pattern_count < 1 || pattern_count > CONTENT_MAX_PATTERNS) {
+        return -1;
+    }
+    struct search s;
+    memset(&s, 0, sizeof(s));
+    s.paths = paths;
+    s.count = count;
+    s.visit = visit_search;
+    s.matched = matched;
+    s.pattern_count = pattern_count;
+    for (int p = 0; p < pattern_count; p++) {
+        s.patterns[p].text = (const unsigned char *)patterns[p];
+        s.patterns[p].length = strlen(patterns[p]);
+        if (s.patterns[p].length == 0 || s.patterns[p].length > CONTENT_BUFFER) {
+            return -1;
+        }
+        if (s.patterns[p].length > s.longest) {
+            s.longest = s.patterns[p].length;
+        }
+    }
+    memset(matched, 0, count);
+    return run(&s);
+}
+
+long content_checksum(char *const *paths, size_t count, uint64_t *digests, off_t *sizes) {
+    struct search s;
+    memset(&s, 0, sizeof(s));
+    s.paths = paths;
+    s.count = count;
+    s.visit = visit_checksum;
+    s.digests = digests;
+    s.sizes = sizes;
+    for (size_t i = 0; i < count; i++) {
+        sizes[i] = -1;
+    }
+    return run(&s);
+}
@@ -0,0 +1,38 @@
+#ifndef CONTENT_H
+#define CONTENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Read the contents of many files at once: searching them for literal
+// strings, for commands that select files by what is in them, and hashing
+// them, so servers can be compared without moving the files. A pool of
+// threads in the handling process takes files off a shared counter and
+// reads each one through a large buffer. Every pattern is looked for in the same pass: 16 bytes at
+// a time are compared against each pattern's first and last byte with SSE2,
+// and only positions where both agree are checked in full. A file stops
+// being read at its first match. Files with a NUL byte in their first 8 KB
+// are taken to be binary and never match.
+//
+// Threads are read from the environment:
+//   FILESNAP_SEARCH_THREADS  threads per search or checksum (default the number of CPUs, at most 16)
+
+// Patterns one search can look for at once
+#define CONTENT_MAX_PATTERNS 8
+
+// Read the thread count; call once in the parent before forking
+void content_init(void);
+
+// Set matched[i] to 1 for each of the count files in paths that contains
+// any of the patterns (none may be empty), 0 otherwise. Returns the number
+// of matching files, or -1 if the patterns are not usable.
+long content_search(char *const *paths, size_t count, const char *const *patterns, int pattern_count,
+                    unsigned char *matched);
+
+// Set digests[i] to the XXH64 (see digest.h) of each of the count files in
+// paths and sizes[i] to the bytes hashed, or sizes[i] to -1 if the file could
+// not be read. Returns the number of files hashed.
+long content_checksum(char *const *paths, size_t count, uint64_t *digests, off_t *sizes);
+
+#endif
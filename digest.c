@@ -0,0 +1,139 @@
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "digest.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// Little-endian loads, whatever the alignment
+static uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    return rotl(acc, 31) * PRIME1;
+}
+
+static uint64_t merge(uint64_t h, uint64_t acc) {
+    h ^= round64(0, acc);
+    return h * PRIME1 + PRIME4;
+}
+
+// One 32-byte stripe into the four lanes
+static void stripe(uint64_t *acc, const unsigned char *p) {
+    acc[0] = round64(acc[0], read64(p));
+    acc[1] = round64(acc[1], read64(p + 8));
+    acc[2] = round64(acc[2], read64(p + 16));
+    acc[3] = round64(acc[3], read64(p + 24));
+}
+
+void digest_init(struct digest *d) {
+    memset(d, 0, sizeof(*d));
+    d->acc[0] = PRIME1 + PRIME2;
+    d->acc[1] = PRIME2;
+    d->acc[2] = 0;
+    d->acc[3] = -PRIME1;
+}
+
+void digest_update(struct digest *d, const void *data, size_t length) {
+    const unsigned char *p = data;
+    d->total += length;
+    if (d->pending_length + length < sizeof(d->pending)) {
+        memcpy(d->pending + d->pending_length, p, length);
+        d->pending_length += length;
+        return;
+    }
+    if (d->pending_length > 0) {
+        size_t fill = sizeof(d->pending) - d->pending_length;
+        memcpy(d->pending + d->pending_length, p, fill);
+        stripe(d->acc, d->pending);
+        p += fill;
+        length -= fill;
+        d->pending_length = 0;
+    }
+    // The lanes are independent, so the four multiplies of a stripe overlap
+    uint64_t acc[4] = {d->acc[0], d->acc[1], d->acc[2], d->acc[3]};
+    for (; length >= 32; p += 32, length -= 32) {
+        stripe(acc, p);
+    }
+    memcpy(d->acc, acc, sizeof(acc));
+    memcpy(d->pending, p, length);
+    d->pending_length = length;
+}
+
+uint64_t digest_final(const struct digest *d) {
+    uint64_t h;
+    if (d->total >= 32) {
+        h = rotl(d->acc[0], 1) + rotl(d->acc[1], 7) + rotl(d->acc[2], 12) + rotl(d->acc[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = merge(h, d->acc[i]);
+        }
+    } else {
+        h = PRIME5;
+    }
+    h += d->total;
+
+    const unsigned char *p = d->pending;
+    size_t left = d->pending_length;
+    for (; left >= 8; p += 8, left -= 8) {
+        h ^= round64(0, read64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+    }
+    if (left >= 4) {
+        h ^= (uint64_t)read32(p) * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+        left -= 4;
+    }
+    for (; left > 0; p++, left--) {
+        h ^= *p * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+int digest_fd(struct digest *d, int fd, off_t offset, off_t length, void *buffer, size_t size) {
+    while (length > 0) {
+        ssize_t n = pread(fd, buffer, length < (off_t)size ? (size_t)length : size, offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        digest_update(d, buffer, n);
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Streaming XXH64, for checking that archives arrive as they were sent and
+// for comparing files between servers. It is not a cryptographic hash: it
+// catches corruption, not tampering. Bytes can be fed in pieces of any size
+// and give the same digest as in one piece.
+
+// Bytes hashed at once when a digest is fed from a file
+#define DIGEST_BLOCK (64 * 1024)
+
+struct digest {
+    uint64_t total;         // bytes fed so far
+    uint64_t acc[4];
+    unsigned char pending[32];
+    size_t pending_length;
+};
+
+void digest_init(struct digest *d);
+void digest_update(struct digest *d, const void *data, size_t length);
+uint64_t digest_final(const struct digest *d);
+
+// Feed length bytes of fd from offset, read through buffer; returns 0, or -1 on a short read
+int digest_fd(struct digest *d, int fd, off_t offset, off_t length, void *buffer, size_t size);
+
+#endif
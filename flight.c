@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/sendfile.h>
+
+#include "flight.h"
+#include "archive.h"
+#include "cache.h"
+#include "metrics.h"
+#include "trace.h"
+#include "lane.h"
+#include "shape.h"
+#include "digest.h"
+
+// Followers check the flight file this often while the leader is still writing
+#define FLIGHT_POLL_US 2000
+// Largest chunk sent in one piece
+#define FLIGHT_CHUNK_MAX (1024 * 1024)
+
+enum flight_role flight_join(const char *flight_dir, const char *query, struct flight *f) {
+    mkdir(flight_dir, 0777);
+    snprintf(f->path, sizeof(f->path), "%s/%016llx.tar.gz", flight_dir, (unsigned long long)cache_hash(query));
+
+    for (int attempt = 0; attempt < 3; attempt++) {
+        // Lock a private file and only then publish it, so no follower can
+        // ever see a flight file whose leader does not hold the lock yet
+        char tmp[1300];
+        snprintf(tmp, sizeof(tmp), "%s.%d.tmp", f->path, (int)getpid());
+        int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd == -1) {
+            perror("open flight");
+            return FLIGHT_NONE;
+        }
+        flock(fd, LOCK_EX);
+        int published = link(tmp, f->path);
+        int link_errno = errno;
+        unlink(tmp);
+        if (published == 0) {
+            f->fd = fd;
+            return FLIGHT_LEADER;
+        }
+        close(fd);
+        if (link_errno != EEXIST) {
+            return FLIGHT_NONE;
+        }
+
+        int rfd = open(f->path, O_RDONLY);
+        if (rfd == -1) {
+            continue; // That flight just landed; try to lead a new one
+        }
+        // A free lock on an unfinished file means its leader died; clear it away
+        struct stat st, current;
+        if (flock(rfd, LOCK_SH | LOCK_NB) == 0) {
+            fstat(rfd, &st);
+            flock(rfd, LOCK_UN);
+            if (!(st.st_mode & S_IRGRP)) {
+                if (stat(f->path, &current) == 0 && current.st_ino == st.st_ino) {
+                    unlink(f->path);
+                }
+                close(rfd);
+                continue;
+            }
+        }
+        f->fd = rfd;
+        return FLIGHT_FOLLOWER;
+    }
+    return FLIGHT_NONE;
+}
+
+// Send up to length bytes of fd from *offset as one chunk, and add them to digest
+static int send_chunk(int client_socket, int fd, off_t *offset, off_t length, struct digest *digest) {
+    length = shape_chunk(length > FLIGHT_CHUNK_MAX ? FLIGHT_CHUNK_MAX : length);
+    if (metrics_send(client_socket, &length, sizeof(off_t), 0) != sizeof(off_t)) {
+        return -1;
+    }
+    off_t start = *offset, end = start + length;
+    while (*offset < end) {
+        ssize_t n = sendfile(client_socket, fd, offset, end - *offset);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            perror("sendfile");
+            return -1;
+        }
+        metrics_add_bytes_out(n);
+        shape_sent(n);
+    }
+    unsigned char block[DIGEST_BLOCK];
+    return digest_fd(digest, fd, start, length, block, sizeof(block));
+}
+
+int flight_follow(int client_socket, struct flight *f) {
+    uint64_t started = metrics_now_us();
+    off_t sent = 0;
+    int streaming = 0, result;
+    struct digest digest;
+    digest_init(&digest);
+    while (1) {
+        // Check the lock before the size, so a finished flight is seen at its final size
+        int finished = flock(f->fd, LOCK_SH | LOCK_NB) == 0;
+        struct stat st;
+        if (fstat(f->fd, &st) == -1) {
+            perror("fstat flight");
+            finished = 1;
+            st.st_mode = 0;
+        }
+        if (finished && !(st.st_mode & S_IRGRP)) {
+            if (!streaming) {
+                return 0;
+            }
+            const off_t aborted = -1;
+            const char *msg = "Failed to create tar file.\n\nEND_OF_RESPONSE\n";
+            metrics_send(client_socket, &aborted, sizeof(off_t), 0);
+            metrics_send(client_socket, msg, strlen(msg), 0);
+            result = -1;
+            break;
+        }
+        if (st.st_size > sent || finished) {
+            if (!streaming) {
+                const off_t streamed = FLIGHT_STREAMED;
+                metrics_send(client_socket, &streamed, sizeof(off_t), 0);
+                streaming = 1;
+                shape_bulk_begin(client_socket);
+            }
+            if (st.st_size > sent) {
+                if (send_chunk(client_socket, f->fd, &sent, st.st_size - sent, &digest) == -1) {
+                    result = -1;
+                    break;
+                }
+                continue;
+            }
+            const off_t last = 0;
+            uint64_t trailer = digest_final(&digest);
+            metrics_send(client_socket, &last, sizeof(off_t), 0);
+            metrics_send(client_socket, &trailer, sizeof(trailer), 0);
+            result = 1;
+            break;
+        }
+        usleep(FLIGHT_POLL_US);
+    }
+    if (streaming) {
+        shape_bulk_end(client_socket);
+    }
+    metrics_record_phase(PHASE_SEND, metrics_now_us() - started);
+    trace_span(TRACE_SEND, started);
+    return result;
+}
+
+int flight_lead(int client_socket, struct flight *f, const char *list_path, const char *key) {
+    // Open the reading side first: the builder unlinks the flight file when it is done
+    int rfd = open(f->path, O_RDONLY);
+    if (rfd == -1) {
+        perror("open flight");
+        flight_abandon(f);
+        return 0;
+    }
+    pid_t builder = fork();
+    if (builder == 0) {
+        close(rfd);
+        close(client_socket);
+        lane_adopt(); // The archive slot is free again once the build is, not the send
+        int status = archive_create_fd(list_path, f->fd);
+        if (status != -1) {
+            fchmod(f->fd, 0644); // Marks the build as complete for the followers
+            if (key[0] != '\0') {
+                cache_store(key, f->path);
+            }
+        }
+        unlink(f->path);
+        lane_leave();
+        _exit(status == -1 ? 1 : 0);
+    }
+    if (builder < 0) {
+        perror("fork builder");
+        close(rfd);
+        flight_abandon(f);
+        return 0;
+    }
+
+    // The builder holds the lock now; this process is just the first follower
+    close(f->fd);
+    f->fd = rfd;
+    int result = flight_follow(client_socket, f);
+    close(rfd);
+    f->fd = -1;
+    waitpid(builder, NULL, 0);
+    return result;
+}
+
+void flight_abandon(struct flight *f) {
+    // Unpublish before releasing the lock, so nobody new joins a failed flight
+    unlink(f->path);
+    close(f->fd);
+    f->fd = -1;
+}
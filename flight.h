@@ -0,0 +1,51 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <sys/types.h>
+
+// Single-flight archive production. Identical queries that arrive while
+// one is being built share it: the first request leads and builds the
+// archive into a flight file, the rest follow that file as it grows and
+// stream it to their clients. A follower that joins late starts from the
+// beginning of the file, so it catches up on the prefix already written.
+//
+// The leader holds an exclusive flock on the flight file while it is being
+// built. Once the lock is free the file is final; its group-read bit marks
+// a build that succeeded.
+
+// Archive replies whose size is not known up front start with this size and
+// continue with off_t-prefixed chunks, ending with a zero-length chunk and the
+// XXH64 digest (see digest.h) of everything sent. A negative chunk length aborts
+// the stream; a message and the end marker follow.
+#define FLIGHT_STREAMED ((off_t)-1)
+
+enum flight_role {
+    FLIGHT_NONE,        // not coalesced; build and send as usual
+    FLIGHT_LEADER,
+    FLIGHT_FOLLOWER
+};
+
+struct flight {
+    int fd;             // lock-holding fd for the leader, read fd for a follower
+    char path[1200];
+};
+
+// Join the flight for a normalized query in flight_dir
+enum flight_role flight_join(const char *flight_dir, const char *query, struct flight *f);
+
+// Stream the flight file to the client until the leader is done. Returns 1 if the
+// archive was sent, -1 if the stream had to be aborted, or 0 if the leader failed
+// before anything was sent, in which case the caller should build the archive itself.
+// The caller closes f->fd afterwards.
+int flight_follow(int client_socket, struct flight *f);
+
+// As leader, build the archive of the paths in list_path into the flight file
+// in a child process and stream it to the client while it is written.
+// On success the archive is also added to the result cache under key (if not empty).
+// Returns as flight_follow; 0 here means nothing was sent to the client.
+int flight_lead(int client_socket, struct flight *f, const char *list_path, const char *key);
+
+// As leader, give up without an archive; followers fall back to building their own
+void flight_abandon(struct flight *f);
+
+#endif
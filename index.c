@@ -0,0 +1,1160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+
+#include "index.h"
+#include "cache.h"
+#include "bloom.h"
+#include "top.h"
+#include "metrics.h"
+#include "shared.h"
+#include "log.h"
+
+// How often the refresher checks the tree generation while idle
+#define INDEX_POLL_US 100000
+// Deepest directory nesting a lookup will turn back into a path
+#define INDEX_MAX_DEPTH 512
+// Most trigrams of a pattern a search intersects; the rest are only checked by matching
+#define INDEX_MAX_TRIGRAMS 32
+
+// Shared with the refresher process and every connection handler
+// Each snapshot is published under the tree generation it matches, after it
+// has been renamed into place, so a file mapped after reading the generation
+// is at least that snapshot. Generations start at 1; 0 means none yet.
+struct index_state {
+    uint64_t generation;
+};
+
+static struct index_state *state = NULL;
+static char index_path[1024];
+static char index_root[1024];
+static char index_exclude[1024];
+
+// A snapshot as mapped into this process
+struct index_map {
+    void *base;
+    size_t length;
+    dev_t dev;
+    ino_t ino;
+    const struct index_header *header;
+    const struct index_entry *entries;
+    const struct index_name *names;
+    const char *strings;
+    const uint32_t *interned;
+    const struct index_trigram *trigrams;
+    const uint32_t *postings;
+    const struct index_rollup *rollups;
+    uint32_t count;
+    uint32_t interned_count;
+    uint32_t trigram_count;
+    uint32_t posting_count;
+    uint32_t rollup_count;
+    uint64_t generation;    // the snapshot's published generation
+};
+
+// Kept mapped by the parent, so handlers inherit it over fork and normally
+// have nothing to open or map themselves
+static struct index_map current;
+
+static uint32_t name_hash(const char *name) {
+    return (uint32_t)cache_hash(name);
+}
+
+static void unmap_snapshot(struct index_map *m) {
+    if (m->base != NULL) {
+        munmap(m->base, m->length);
+    }
+    memset(m, 0, sizeof(*m));
+}
+
+// Map a snapshot and check that it is complete, of this version, and of this root
+static int map_snapshot(const char *path, const char *root, struct index_map *m) {
+    memset(m, 0, sizeof(*m));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct index_header)) {
+        close(fd);
+        return -1;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    m->base = base;
+    m->length = st.st_size;
+    m->dev = st.st_dev;
+    m->ino = st.st_ino;
+
+    const struct index_header *h = base;
+    uint64_t count = h->entry_count;
+    if (h->magic != INDEX_MAGIC || h->version != INDEX_VERSION || h->entry_size != sizeof(struct index_entry) ||
+        count == 0 || count > UINT32_MAX ||
+        h->entries_offset + count * sizeof(struct index_entry) > m->length ||
+        h->names_offset + count * sizeof(struct index_name) > m->length ||
+        h->strings_size == 0 || h->strings_offset + h->strings_size > m->length ||
+        h->interned_count > UINT32_MAX || h->interned_offset + h->interned_count * sizeof(uint32_t) > m->length ||
+        h->trigram_count >= UINT32_MAX ||
+        h->trigrams_offset + (h->trigram_count + 1) * sizeof(struct index_trigram) > m->length ||
+        h->posting_count > UINT32_MAX || h->postings_offset + h->posting_count * sizeof(uint32_t) > m->length ||
+        h->rollup_count > count || h->rollups_offset + h->rollup_count * sizeof(struct index_rollup) > m->length) {
+        unmap_snapshot(m);
+        return -1;
+    }
+    m->header = h;
+    m->entries = (const struct index_entry *)((const char *)base + h->entries_offset);
+    m->names = (const struct index_name *)((const char *)base + h->names_offset);
+    m->strings = (const char *)base + h->strings_offset;
+    m->count = (uint32_t)count;
+    m->interned = (const uint32_t *)((const char *)base + h->interned_offset);
+    m->trigrams = (const struct index_trigram *)((const char *)base + h->trigrams_offset);
+    m->postings = (const uint32_t *)((const char *)base + h->postings_offset);
+    m->rollups = (const struct index_rollup *)((const char *)base + h->rollups_offset);
+    m->interned_count = (uint32_t)h->interned_count;
+    m->trigram_count = (uint32_t)h->trigram_count;
+    m->posting_count = (uint32_t)h->posting_count;
+    m->rollup_count = (uint32_t)h->rollup_count;
+    if (m->strings[h->strings_size - 1] != '\0' || m->entries[0].name >= h->strings_size ||
+        strcmp(m->strings + m->entries[0].name, root) != 0) {
+        unmap_snapshot(m);
+        return -1;
+    }
+    return 0;
+}
+
+static const char *entry_name(const struct index_map *m, uint32_t i) {
+    uint32_t offset = m->entries[i].name;
+    return offset < m->header->strings_size ? m->strings + offset : "";
+}
+
+// First position in the name table with this hash
+static uint32_t first_with_hash(const struct index_map *m, uint32_t hash) {
+    uint32_t lo = 0, hi = m->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (m->names[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Directory called name directly inside parent, or UINT32_MAX
+static uint32_t find_child_dir(const struct index_map *m, uint32_t parent, const char *name) {
+    uint32_t hash = name_hash(name);
+    for (uint32_t i = first_with_hash(m, hash); i < m->count && m->names[i].hash == hash; i++) {
+        uint32_t e = m->names[i].entry;
+        if (e < m->count && m->entries[e].parent == parent && S_ISDIR(m->entries[e].mode) &&
+            strcmp(entry_name(m, e), name) == 0) {
+            return e;
+        }
+    }
+    return UINT32_MAX;
+}
+
+// The snapshot being built
+struct builder {
+    struct index_entry *entries;
+    uint32_t count, capacity;
+    char *strings;
+    size_t strings_size, strings_capacity;
+    const struct index_map *old;    // previous snapshot, or NULL
+    dev_t exclude_dev;              // the excluded directory, if exclude_ino is not 0
+    ino_t exclude_ino;
+    long relisted;                  // directories that had to be read again
+    int failed;
+};
+
+static uint32_t add_string(struct builder *b, const char *s) {
+    size_t length = strlen(s) + 1;
+    if (b->strings_size + length > b->strings_capacity) {
+        size_t capacity = b->strings_capacity ? b->strings_capacity : 64 * 1024;
+        while (b->strings_size + length > capacity) {
+            capacity *= 2;
+        }
+        // Pool offsets are 32 bits wide
+        char *grown = capacity <= UINT32_MAX ? realloc(b->strings, capacity) : NULL;
+        if (grown == NULL) {
+            b->failed = 1;
+            return 0;
+        }
+        b->strings = grown;
+        b->strings_capacity = capacity;
+    }
+    uint32_t offset = (uint32_t)b->strings_size;
+    memcpy(b->strings + offset, s, length);
+    b->strings_size += length;
+    return offset;
+}
+
+// Append an entry with only its place in the tree filled in
+static uint32_t append_entry(struct builder *b, uint32_t parent, const char *name) {
+    if (b->count == b->capacity) {
+        uint32_t capacity = b->capacity ? b->capacity * 2 : 4096;
+        struct index_entry *grown = realloc(b->entries, capacity * sizeof(struct index_entry));
+        if (grown == NULL) {
+            b->failed = 1;
+            return 0;
+        }
+        b->entries = grown;
+        b->capacity = capacity;
+    }
+    uint32_t i = b->count++;
+    b->entries[i].parent = parent;
+    b->entries[i].name = add_string(b, name);
+    b->entries[i].end = i + 1;
+    return i;
+}
+
+static uint32_t add_entry(struct builder *b, uint32_t parent, const char *name, const struct stat *st) {
+    uint32_t i = append_entry(b, parent, name);
+    if (b->failed) {
+        return 0;
+    }
+    struct index_entry *e = &b->entries[i];
+    e->mode = st->st_mode;
+    e->size = st->st_size;
+    e->mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    e->ctime_ns = (int64_t)st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec;
+    return i;
+}
+
+static void scan_dir(struct builder *b, int parent, const char *name, uint32_t self, uint32_t old_self);
+
+// Open the directory called name inside the directory at fd; names are
+// resolved one at a time, so a deep tree costs no more per entry than a flat one
+static int open_child_dir(int fd, const char *name) {
+    return openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+static int excluded(const struct builder *b, const struct stat *st) {
+    return b->exclude_ino != 0 && st->st_ino == b->exclude_ino && st->st_dev == b->exclude_dev;
+}
+
+// Reuse the old listing of an unchanged directory. Only the names are reused:
+// writing to a file changes its size and mtime but not its directory's, so
+// every entry is still stat'ed (in *fd, opened on the first one). Returns -1
+// if the tree no longer matches the old listing after all.
+static int copy_listing(struct builder *b, int parent, const char *dir_name, int *fd,
+                        uint32_t self, uint32_t old_self) {
+    const struct index_map *old = b->old;
+    uint32_t end = old->entries[old_self].end;
+    if (end > old->count) {
+        return -1;
+    }
+    uint32_t next;
+    for (uint32_t c = old_self + 1; c < end && !b->failed; c = next) {
+        const struct index_entry *child = &old->entries[c];
+        const char *name = entry_name(old, c);
+        int is_dir = S_ISDIR(child->mode);
+        if (is_dir && child->end <= c) {
+            return -1;
+        }
+        next = is_dir ? child->end : c + 1;
+        if (*fd == -1 && (*fd = open_child_dir(parent, dir_name)) == -1) {
+            return -1;
+        }
+        struct stat st;
+        if (fstatat(*fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1 || (S_ISDIR(st.st_mode) != 0) != is_dir) {
+            return -1;
+        }
+        uint32_t i = add_entry(b, self, name, &st);
+        if (b->failed) {
+            return -1;
+        }
+        if (is_dir) {
+            scan_dir(b, *fd, name, i, c);
+            b->entries[i].end = b->count;
+        }
+    }
+    return 0;
+}
+
+// Add everything below the directory entry self (already added), called name
+// inside the directory open at parent. old_self is the same directory in the
+// previous snapshot, or UINT32_MAX.
+static void scan_dir(struct builder *b, int parent, const char *name, uint32_t self, uint32_t old_self) {
+    int fd = -1;
+    if (old_self != UINT32_MAX) {
+        const struct index_entry *was = &b->old->entries[old_self];
+        const struct index_entry *is = &b->entries[self];
+        if (was->mtime_ns == is->mtime_ns && was->ctime_ns == is->ctime_ns) {
+            uint32_t count = b->count;
+            size_t strings_size = b->strings_size;
+            int copied = copy_listing(b, parent, name, &fd, self, old_self);
+            if (copied == 0) {
+                if (fd != -1) {
+                    close(fd);
+                }
+                return;
+            }
+            b->count = count;
+            b->strings_size = strings_size;
+        }
+    }
+
+    b->relisted++;
+    if (fd == -1 && (fd = open_child_dir(parent, name)) == -1) {
+        return;
+    }
+    DIR *dir = fdopendir(fd);
+    if (dir == NULL) {
+        close(fd);
+        return;
+    }
+    struct dirent *entry;
+    while (!b->failed && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        struct stat st;
+        if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 || excluded(b, &st)) {
+            continue;
+        }
+        uint32_t i = add_entry(b, self, entry->d_name, &st);
+        if (S_ISDIR(st.st_mode) && !b->failed) {
+            uint32_t old_child = old_self != UINT32_MAX ? find_child_dir(b->old, old_self, entry->d_name) : UINT32_MAX;
+            scan_dir(b, fd, entry->d_name, i, old_child);
+            b->entries[i].end = b->count;
+        }
+    }
+    closedir(dir);
+}
+
+static int compare_names(const void *a, const void *b) {
+    const struct index_name *x = a, *y = b;
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return x->entry < y->entry ? -1 : x->entry > y->entry;
+}
+
+static uint32_t trigram_at(const char *s) {
+    return (uint32_t)(unsigned char)s[0] << 16 | (uint32_t)(unsigned char)s[1] << 8 | (unsigned char)s[2];
+}
+
+// The trigram part of a snapshot being written
+struct trigram_table {
+    uint32_t *interned;
+    uint32_t interned_count;
+    struct index_trigram *trigrams;     // trigram_count of them and the end marker
+    uint32_t trigram_count;
+    uint32_t *postings;
+    uint32_t posting_count;
+};
+
+static void free_trigrams(struct trigram_table *t) {
+    free(t->interned);
+    free(t->trigrams);
+    free(t->postings);
+}
+
+// Most refreshes only see files change, not names come and go; then the
+// previous snapshot's trigram lists still hold and are copied
+static int reuse_trigrams(const struct index_map *old, const char *strings, struct trigram_table *t) {
+    if (old == NULL || old->interned_count != t->interned_count) {
+        return -1;
+    }
+    for (uint32_t id = 0; id < t->interned_count; id++) {
+        if (old->interned[id] >= old->header->strings_size ||
+            strcmp(old->strings + old->interned[id], strings + t->interned[id]) != 0) {
+            return -1;
+        }
+    }
+    t->trigrams = malloc(((size_t)old->trigram_count + 1) * sizeof(struct index_trigram));
+    t->postings = malloc(((size_t)old->posting_count + 1) * sizeof(uint32_t));
+    if (t->trigrams == NULL || t->postings == NULL) {
+        free(t->trigrams);
+        free(t->postings);
+        t->trigrams = NULL;
+        t->postings = NULL;
+        return -1;
+    }
+    memcpy(t->trigrams, old->trigrams, ((size_t)old->trigram_count + 1) * sizeof(struct index_trigram));
+    memcpy(t->postings, old->postings, (size_t)old->posting_count * sizeof(uint32_t));
+    t->trigram_count = old->trigram_count;
+    t->posting_count = old->posting_count;
+    return 0;
+}
+
+// Intern the file names (names is sorted by hash, so equal names are close
+// together) and list, for every trigram, the interned names that contain it
+static int build_trigrams(const struct builder *b, const struct index_name *names, struct trigram_table *t) {
+    memset(t, 0, sizeof(*t));
+    t->interned = malloc((size_t)b->count * sizeof(uint32_t));
+    if (t->interned == NULL) {
+        return -1;
+    }
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < b->count; ) {
+        uint32_t hash = names[i].hash, group = t->interned_count;
+        for (; i < b->count && names[i].hash == hash; i++) {
+            uint32_t e = names[i].entry;
+            if (e == 0 || S_ISDIR(b->entries[e].mode)) {
+                continue;
+            }
+            const char *name = b->strings + b->entries[e].name;
+            uint32_t k = group;
+            while (k < t->interned_count && strcmp(b->strings + t->interned[k], name) != 0) {
+                k++;
+            }
+            if (k == t->interned_count) {
+                t->interned[t->interned_count++] = b->entries[e].name;
+                size_t length = strlen(name);
+                total += length > 2 ? length - 2 : 0;
+            }
+        }
+    }
+    if (total > UINT32_MAX) {
+        return -1;
+    }
+    if (reuse_trigrams(b->old, b->strings, t) == 0) {
+        return 0;
+    }
+
+    // Every (trigram, name) pair in name order; two stable 12-bit counting
+    // passes order them by trigram and keep the names ascending, so a name
+    // with the same trigram twice has it next to itself
+    uint32_t *keys = malloc((total + 1) * sizeof(uint32_t)), *ids = malloc((total + 1) * sizeof(uint32_t));
+    uint32_t *sorted_keys = malloc((total + 1) * sizeof(uint32_t));
+    t->postings = malloc((total + 1) * sizeof(uint32_t));
+    uint32_t *counts = malloc(4097 * sizeof(uint32_t));
+    if (keys == NULL || ids == NULL || sorted_keys == NULL || t->postings == NULL || counts == NULL) {
+        free(keys);
+        free(ids);
+        free(sorted_keys);
+        free(counts);
+        return -1;
+    }
+    uint32_t n = 0;
+    for (uint32_t id = 0; id < t->interned_count; id++) {
+        const char *name = b->strings + t->interned[id];
+        for (size_t i = 0; name[i] != '\0' && name[i + 1] != '\0' && name[i + 2] != '\0'; i++) {
+            keys[n] = trigram_at(name + i);
+            ids[n++] = id;
+        }
+    }
+    uint32_t *from_keys = keys, *from_ids = ids, *to_keys = sorted_keys, *to_ids = t->postings;
+    for (int shift = 0; shift < 24; shift += 12) {
+        memset(counts, 0, 4097 * sizeof(uint32_t));
+        for (uint32_t i = 0; i < n; i++) {
+            counts[(from_keys[i] >> shift & 4095) + 1]++;
+        }
+        for (int d = 0; d < 4096; d++) {
+            counts[d + 1] += counts[d];
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t at = counts[from_keys[i] >> shift & 4095]++;
+            to_keys[at] = from_keys[i];
+            to_ids[at] = from_ids[i];
+        }
+        uint32_t *swap = from_keys;
+        from_keys = to_keys;
+        to_keys = swap;
+        swap = from_ids;
+        from_ids = to_ids;
+        to_ids = swap;
+    }
+    // After an even number of passes the pairs are back in keys and ids
+    free(t->postings);
+    free(sorted_keys);
+    free(counts);
+    t->postings = ids;
+
+    uint32_t distinct = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        distinct += i == 0 || keys[i] != keys[i - 1];
+    }
+    t->trigrams = malloc(((size_t)distinct + 1) * sizeof(struct index_trigram));
+    if (t->trigrams == NULL) {
+        free(keys);
+        return -1;
+    }
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (i == 0 || keys[i] != keys[i - 1]) {
+            t->trigrams[t->trigram_count].trigram = keys[i];
+            t->trigrams[t->trigram_count++].start = kept;
+        } else if (ids[i] == ids[i - 1]) {
+            continue;
+        }
+        ids[kept++] = ids[i];
+    }
+    t->trigrams[t->trigram_count].trigram = UINT32_MAX;
+    t->trigrams[t->trigram_count].start = kept;
+    t->posting_count = kept;
+    free(keys);
+    return 0;
+}
+
+// Add up every directory's subtree. Entries come in depth-first order, so going
+// backwards finishes each directory before it is added to its parent. Returns
+// the rollups, one per directory in entry order, or NULL.
+static struct index_rollup *build_rollups(const struct builder *b, uint32_t *count) {
+    uint32_t *slot = malloc((size_t)b->count * sizeof(uint32_t));
+    uint32_t dirs = 0;
+    for (uint32_t i = 0; slot != NULL && i < b->count; i++) {
+        slot[i] = S_ISDIR(b->entries[i].mode) ? dirs++ : UINT32_MAX;
+    }
+    struct index_rollup *rollups = slot != NULL ? calloc(dirs ? dirs : 1, sizeof(struct index_rollup)) : NULL;
+    if (rollups == NULL) {
+        free(slot);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < b->count; i++) {
+        if (slot[i] != UINT32_MAX) {
+            rollups[slot[i]].entry = i;
+        }
+    }
+    for (uint32_t i = b->count - 1; i > 0; i--) {
+        struct index_rollup *parent = &rollups[slot[b->entries[i].parent]];
+        if (slot[i] != UINT32_MAX) {
+            const struct index_rollup *own = &rollups[slot[i]];
+            parent->dirs += 1 + own->dirs;
+            parent->files += own->files;
+            parent->bytes += own->bytes;
+        } else {
+            parent->files++;
+            parent->bytes += b->entries[i].size;
+        }
+    }
+    free(slot);
+    *count = dirs;
+    return rollups;
+}
+
+// Write the built snapshot next to path and rename it into place
+static int write_snapshot(struct builder *b, const char *path) {
+    struct index_name *names = malloc((size_t)b->count * sizeof(struct index_name));
+    if (names == NULL) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < b->count; i++) {
+        names[i].hash = name_hash(b->strings + b->entries[i].name);
+        names[i].entry = i;
+    }
+    qsort(names, b->count, sizeof(struct index_name), compare_names);
+    struct trigram_table t;
+    if (build_trigrams(b, names, &t) == -1) {
+        free_trigrams(&t);
+        free(names);
+        return -1;
+    }
+    uint32_t rollup_count;
+    struct index_rollup *rollups = build_rollups(b, &rollup_count);
+    if (rollups == NULL) {
+        free_trigrams(&t);
+        free(names);
+        return -1;
+    }
+
+    struct index_header h = {0};
+    h.magic = INDEX_MAGIC;
+    h.version = INDEX_VERSION;
+    h.entry_size = sizeof(struct index_entry);
+    h.entry_count = b->count;
+    h.entries_offset = sizeof(struct index_header);
+    h.names_offset = h.entries_offset + (uint64_t)b->count * sizeof(struct index_entry);
+    h.strings_offset = h.names_offset + (uint64_t)b->count * sizeof(struct index_name);
+    h.strings_size = b->strings_size;
+    h.built_at = time(NULL);
+    // The pool is padded so the arrays after it stay aligned
+    size_t padding = (8 - b->strings_size % 8) % 8;
+    h.interned_offset = h.strings_offset + h.strings_size + padding;
+    h.interned_count = t.interned_count;
+    size_t gap = t.interned_count % 2 * sizeof(uint32_t);
+    h.trigrams_offset = h.interned_offset + (uint64_t)t.interned_count * sizeof(uint32_t) + gap;
+    h.trigram_count = t.trigram_count;
+    h.postings_offset = h.trigrams_offset + ((uint64_t)t.trigram_count + 1) * sizeof(struct index_trigram);
+    h.posting_count = t.posting_count;
+    size_t tail = t.posting_count % 2 * sizeof(uint32_t);
+    h.rollups_offset = h.postings_offset + (uint64_t)t.posting_count * sizeof(uint32_t) + tail;
+    h.rollup_count = rollup_count;
+    static const char zeros[8];
+
+    char tmp[1100];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) {
+        perror("fopen index");
+        free(rollups);
+        free_trigrams(&t);
+        free(names);
+        return -1;
+    }
+    int ok = fwrite(&h, sizeof(h), 1, out) == 1 &&
+             fwrite(b->entries, sizeof(struct index_entry), b->count, out) == b->count &&
+             fwrite(names, sizeof(struct index_name), b->count, out) == b->count &&
+             fwrite(b->strings, 1, b->strings_size, out) == b->strings_size &&
+             fwrite(zeros, 1, padding, out) == padding &&
+             fwrite(t.interned, sizeof(uint32_t), t.interned_count, out) == t.interned_count &&
+             fwrite(zeros, 1, gap, out) == gap &&
+             fwrite(t.trigrams, sizeof(struct index_trigram), t.trigram_count + 1, out) == t.trigram_count + 1 &&
+             fwrite(t.postings, sizeof(uint32_t), t.posting_count, out) == t.posting_count &&
+             fwrite(zeros, 1, tail, out) == tail &&
+             fwrite(rollups, sizeof(struct index_rollup), rollup_count, out) == rollup_count;
+    ok = fclose(out) == 0 && ok;
+    free(rollups);
+    free_trigrams(&t);
+    free(names);
+    if (!ok || rename(tmp, path) == -1) {
+        perror("write index");
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Summarize every directory's subtree (see bloom.h) from the built snapshot,
+// so walks the index cannot answer can skip subtrees as of generation
+static void store_summaries(const struct builder *b, uint64_t generation) {
+    // Filters for directories only; slot maps an entry to its directory's filter
+    uint32_t *slot = malloc((size_t)b->count * sizeof(uint32_t));
+    uint32_t dirs = 0;
+    for (uint32_t i = 0; slot != NULL && i < b->count; i++) {
+        slot[i] = S_ISDIR(b->entries[i].mode) ? dirs++ : UINT32_MAX;
+    }
+    struct bloom *filters = slot != NULL ? calloc(dirs, sizeof(struct bloom)) : NULL;
+    uint32_t *lengths = filters != NULL ? malloc((size_t)b->count * sizeof(uint32_t)) : NULL;
+    if (lengths == NULL) {
+        free(filters);
+        free(slot);
+        return;
+    }
+    // Entries come in depth-first order, so going backwards finishes every
+    // directory's filter before it is merged into its parent's
+    for (uint32_t i = b->count - 1; i > 0; i--) {
+        struct bloom *parent = &filters[slot[b->entries[i].parent]];
+        bloom_add(parent, b->strings + b->entries[i].name);
+        if (slot[i] != UINT32_MAX) {
+            bloom_merge(parent, &filters[slot[i]]);
+        }
+    }
+    // Forwards, every directory's path is its parent's plus its name
+    char path[4096];
+    for (uint32_t i = 0; i < b->count; i++) {
+        if (slot[i] == UINT32_MAX) {
+            continue;
+        }
+        const char *name = b->strings + b->entries[i].name;
+        size_t length = strlen(name);
+        if (i == 0) {
+            lengths[i] = length < sizeof(path) ? (uint32_t)length : UINT32_MAX;
+            if (lengths[i] != UINT32_MAX) {
+                memcpy(path, name, length + 1);
+            }
+        } else {
+            uint32_t at = lengths[b->entries[i].parent];
+            lengths[i] = at != UINT32_MAX && at + 1 + length < sizeof(path) ? at + 1 + (uint32_t)length : UINT32_MAX;
+            if (lengths[i] != UINT32_MAX) {
+                path[at] = '/';
+                memcpy(path + at + 1, name, length + 1);
+            }
+        }
+        if (lengths[i] != UINT32_MAX) {
+            bloom_store(path, &filters[slot[i]], generation);
+        }
+    }
+    free(lengths);
+    free(filters);
+    free(slot);
+}
+
+// Bring the snapshot at path up to date with the tree, as of generation
+static int index_refresh(const char *path, const char *root, const char *exclude, uint64_t generation,
+                         long *entries, long *relisted) {
+    struct index_map old;
+    int have_old = map_snapshot(path, root, &old) == 0;
+
+    struct builder b = {0};
+    b.old = have_old ? &old : NULL;
+    int result = -1;
+    struct stat st;
+    // The excluded directory is recognized by identity, so no entry needs a path
+    if (lstat(exclude, &st) == 0) {
+        b.exclude_dev = st.st_dev;
+        b.exclude_ino = st.st_ino;
+    }
+    if (lstat(root, &st) == 0 && S_ISDIR(st.st_mode)) {
+        add_entry(&b, 0, root, &st);
+        if (!b.failed) {
+            scan_dir(&b, AT_FDCWD, root, 0, have_old ? 0 : UINT32_MAX);
+            b.entries[0].end = b.count;
+        }
+        if (!b.failed) {
+            result = write_snapshot(&b, path);
+        }
+        if (result == 0) {
+            store_summaries(&b, generation);
+        }
+    }
+    *entries = b.count;
+    *relisted = b.relisted;
+    free(b.entries);
+    free(b.strings);
+    if (have_old) {
+        unmap_snapshot(&old);
+    }
+    return result;
+}
+
+static void run_refresher(void) {
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    int first = 1;
+    uint64_t indexed = 0;
+    useconds_t pause = INDEX_POLL_US;
+    while (1) {
+        uint64_t generation;
+        if (cache_tree_generation(&generation) == -1 || (!first && generation == indexed)) {
+            usleep(pause);
+            continue;
+        }
+        uint64_t started = metrics_now_us();
+        long entries, relisted;
+        if (index_refresh(index_path, index_root, index_exclude, generation, &entries, &relisted) == -1) {
+            sleep(1);
+            continue;
+        }
+        uint64_t took = metrics_now_us() - started;
+        if (first) {
+            log_info("Index ready: %ld entries, %ld directories listed, %llu ms",
+                     entries, relisted, (unsigned long long)(took / 1000));
+            first = 0;
+        }
+        indexed = generation;
+        __atomic_store_n(&state->generation, generation, __ATOMIC_RELEASE);
+        // On a busy tree, don't spend more than about a third of the time refreshing
+        pause = took * 2 > INDEX_POLL_US ? took * 2 : INDEX_POLL_US;
+    }
+}
+
+int index_init(const char *path, const char *root, const char *exclude) {
+    state = shared_alloc(sizeof(struct index_state));
+    if (state == NULL) {
+        return -1;
+    }
+    snprintf(index_path, sizeof(index_path), "%s", path);
+    snprintf(index_root, sizeof(index_root), "%s", root);
+    snprintf(index_exclude, sizeof(index_exclude), "%s", exclude);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        run_refresher();
+        _exit(0);
+    }
+    if (pid < 0) {
+        perror("fork index refresher");
+        state = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Map the latest published snapshot, unless this process already has it.
+// Returns its generation, or 0 if there is none.
+static uint64_t index_map_latest(void) {
+    uint64_t published = state != NULL ? __atomic_load_n(&state->generation, __ATOMIC_ACQUIRE) : 0;
+    if (published == 0) {
+        return 0;
+    }
+    if (current.base != NULL && current.generation == published) {
+        return published;
+    }
+    unmap_snapshot(&current);
+    if (map_snapshot(index_path, index_root, &current) == -1) {
+        return 0;
+    }
+    // The file may already be a newer snapshot; that is never older than the tree
+    current.generation = published;
+    return published;
+}
+
+void index_prefetch(void) {
+    index_map_latest();
+}
+
+// Returns -1 unless the mapped snapshot is current with the tree
+static int index_current(void) {
+    uint64_t generation;
+    uint64_t published = index_map_latest();
+    if (published == 0 || cache_tree_generation(&generation) == -1 || published != generation) {
+        return -1;
+    }
+    return 0;
+}
+
+// Rebuild the path of entry i; -1 if it does not fit
+static int entry_path(const struct index_map *m, uint32_t i, char *path, size_t size) {
+    uint32_t chain[INDEX_MAX_DEPTH];
+    int depth = 0;
+    while (i != 0) {
+        if (depth == INDEX_MAX_DEPTH || i >= m->count) {
+            return -1;
+        }
+        chain[depth++] = i;
+        i = m->entries[i].parent;
+    }
+    size_t length = snprintf(path, size, "%s", entry_name(m, 0));
+    while (depth > 0 && length < size) {
+        length += snprintf(path + length, size - length, "/%s", entry_name(m, chain[--depth]));
+    }
+    return length < size ? 0 : -1;
+}
+
+int index_lookup_file(const char *name, char *path, size_t size) {
+    if (index_current() == -1) {
+        return -1;
+    }
+    // Equal hashes are ordered by entry, so the first match is the first in walk order
+    uint32_t hash = name_hash(name);
+    for (uint32_t i = first_with_hash(&current, hash); i < current.count && current.names[i].hash == hash; i++) {
+        uint32_t e = current.names[i].entry;
+        if (e != 0 && e < current.count && !S_ISDIR(current.entries[e].mode) &&
+            strcmp(entry_name(&current, e), name) == 0) {
+            return entry_path(&current, e, path, size) == 0 ? 1 : -1;
+        }
+    }
+    return 0;
+}
+
+// Add the trigrams of a run of literal bytes that every match contains
+static void add_run(const char *run, size_t length, uint32_t *grams, int *count) {
+    for (size_t i = 0; i + 3 <= length && *count < INDEX_MAX_TRIGRAMS; i++) {
+        grams[(*count)++] = trigram_at(run + i);
+    }
+}
+
+// Trigrams a name has to contain to match pattern. Only literal runs that
+// every match must contain count: anything optional, repeated, grouped or
+// bracketed ends a run, and a regex with alternatives outside any group
+// gives none at all.
+static int pattern_trigrams(enum index_pattern kind, const char *pattern, uint32_t *grams) {
+    int count = 0;
+    if (kind == INDEX_SUBSTRING) {
+        add_run(pattern, strlen(pattern), grams, &count);
+        return count;
+    }
+    char run[256];
+    size_t length = 0;
+    int depth = 0;
+    for (const char *c = pattern; *c != '\0'; c++) {
+        int literal = -1;
+        if (*c == '\\' && c[1] != '\0') {
+            c++;
+            // Escaped letters and digits are classes and anchors in GNU regexes
+            if (kind == INDEX_GLOB || !isalnum((unsigned char)*c)) {
+                literal = (unsigned char)*c;
+            }
+        } else if (*c == '[') {
+            const char *end = c + 1;
+            if (*end == '!' || *end == '^') {
+                end++;
+            }
+            if (*end == ']') {
+                end++;
+            }
+            while (*end != '\0' && *end != ']') {
+                end++;
+            }
+            c = *end != '\0' ? end : end - 1;
+        } else if (kind == INDEX_GLOB) {
+            if (*c != '*' && *c != '?') {
+                literal = (unsigned char)*c;
+            }
+        } else if (*c == '*' || *c == '?' || *c == '{') {
+            // The byte before may be missing from a match
+            if (length > 0) {
+                length--;
+            }
+            // A repetition count is not text: skip it through its closing brace
+            if (*c == '{') {
+                while (*c != '}' && c[1] != '\0') {
+                    c++;
+                }
+            }
+        } else if (*c == '|' && depth == 0) {
+            return 0; // Another branch may match without any of it
+        } else if (*c == '(') {
+            depth++;
+        } else if (*c == ')') {
+            depth -= depth > 0;
+        } else if (strchr(".^$+", *c) == NULL) {
+            literal = (unsigned char)*c;
+        }
+        if (literal != -1 && depth == 0 && length < sizeof(run)) {
+            run[length++] = (char)literal;
+            continue;
+        }
+        add_run(run, length, grams, &count);
+        length = 0;
+    }
+    add_run(run, length, grams, &count);
+    return count;
+}
+
+// Posting list of a trigram; 0 if no name has it
+static uint32_t postings_of(const struct index_map *m, uint32_t gram, const uint32_t **list) {
+    uint32_t lo = 0, hi = m->trigram_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (m->trigrams[mid].trigram < gram) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == m->trigram_count || m->trigrams[lo].trigram != gram) {
+        return 0;
+    }
+    uint32_t start = m->trigrams[lo].start, end = m->trigrams[lo + 1].start;
+    if (start > end || end > m->posting_count) {
+        return 0;
+    }
+    *list = m->postings + start;
+    return end - start;
+}
+
+// Whether id is in the ascending list, looking from *at on; ids are asked for in ascending order
+static int list_has(const uint32_t *list, uint32_t length, uint32_t *at, uint32_t id) {
+    uint32_t lo = *at, hi = length;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (list[mid] < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *at = lo;
+    return lo < length && list[lo] == id;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+long index_search(enum index_pattern kind, const char *pattern, long limit, index_match_fn match, void *arg) {
+    if (index_map_latest() == 0) {
+        return -1;
+    }
+    regex_t re;
+    if (kind == INDEX_REGEX && regcomp(&re, pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+        return -2;
+    }
+    const struct index_map *m = &current;
+
+    // The shortest posting list drives; every other one only has to be probed
+    uint32_t grams[INDEX_MAX_TRIGRAMS];
+    const uint32_t *lists[INDEX_MAX_TRIGRAMS];
+    uint32_t lengths[INDEX_MAX_TRIGRAMS], at[INDEX_MAX_TRIGRAMS];
+    int count = pattern_trigrams(kind, pattern, grams), shortest = -1, none = 0;
+    for (int g = 0; g < count; g++) {
+        lengths[g] = postings_of(m, grams[g], &lists[g]);
+        at[g] = 0;
+        none |= lengths[g] == 0;
+        if (shortest == -1 || lengths[g] < lengths[shortest]) {
+            shortest = g;
+        }
+    }
+
+    uint32_t *found = NULL;
+    size_t matches = 0, capacity = 0;
+    uint32_t candidates = none ? 0 : shortest == -1 ? m->interned_count : lengths[shortest];
+    for (uint32_t c = 0; c < candidates; c++) {
+        uint32_t id = shortest == -1 ? c : lists[shortest][c];
+        int all = id < m->interned_count && m->interned[id] < m->header->strings_size;
+        for (int g = 0; g < count && all; g++) {
+            all = g == shortest || list_has(lists[g], lengths[g], &at[g], id);
+        }
+        if (!all) {
+            continue;
+        }
+        const char *name = m->strings + m->interned[id];
+        int hit = kind == INDEX_SUBSTRING ? strstr(name, pattern) != NULL
+                : kind == INDEX_GLOB      ? fnmatch(pattern, name, 0) == 0
+                                          : regexec(&re, name, 0, NULL, 0) == 0;
+        if (!hit) {
+            continue;
+        }
+        // Every file with this name
+        uint32_t hash = name_hash(name);
+        for (uint32_t i = first_with_hash(m, hash); i < m->count && m->names[i].hash == hash; i++) {
+            uint32_t e = m->names[i].entry;
+            if (e == 0 || e >= m->count || S_ISDIR(m->entries[e].mode) || strcmp(entry_name(m, e), name) != 0) {
+                continue;
+            }
+            if (matches == capacity) {
+                size_t more = capacity ? capacity * 2 : 256;
+                uint32_t *grown = realloc(found, more * sizeof(uint32_t));
+                if (grown == NULL) {
+                    break;
+                }
+                found = grown;
+                capacity = more;
+            }
+            found[matches++] = e;
+        }
+    }
+    if (kind == INDEX_REGEX) {
+        regfree(&re);
+    }
+
+    qsort(found, matches, sizeof(uint32_t), compare_entries);
+    char path[4096];
+    for (size_t i = 0; i < matches && (long)i < limit; i++) {
+        if (entry_path(m, found[i], path, sizeof(path)) == 0) {
+            match(path, &m->entries[found[i]], arg);
+        }
+    }
+    free(found);
+    return (long)matches;
+}
+
+// Rollup of directory entry e, or NULL
+static const struct index_rollup *rollup_of(const struct index_map *m, uint32_t e) {
+    uint32_t lo = 0, hi = m->rollup_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (m->rollups[mid].entry < e) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < m->rollup_count && m->rollups[lo].entry == e ? &m->rollups[lo] : NULL;
+}
+
+long index_usage(const char *path, int depth, index_usage_fn report, void *arg) {
+    if (index_current() == -1) {
+        return -1;
+    }
+    const struct index_map *m = &current;
+
+    // Down to the directory asked about, one name at a time
+    uint32_t top = 0;
+    char name[256];
+    for (const char *p = path; *p != '\0' && top != UINT32_MAX; ) {
+        size_t length = strcspn(p, "/");
+        if (length >= sizeof(name)) {
+            return 0;
+        }
+        if (length > 0) {
+            memcpy(name, p, length);
+            name[length] = '\0';
+            top = find_child_dir(m, top, name);
+        }
+        p += length + (p[length] == '/');
+    }
+    if (top == UINT32_MAX || top >= m->count) {
+        return 0;
+    }
+    if (depth > INDEX_MAX_DEPTH - 1) {
+        depth = INDEX_MAX_DEPTH - 1;
+    }
+
+    // Directories still open in the walk and the length of each one's path in
+    // relative; each is reported once its range ends. Those at the deepest
+    // level shown are reported at once and not entered.
+    uint32_t open[INDEX_MAX_DEPTH];
+    size_t lengths[INDEX_MAX_DEPTH];
+    char relative[4096] = "";
+    int open_count = 0;
+    long reported = 0;
+    const struct index_rollup *r;
+    uint32_t end = m->entries[top].end <= m->count ? m->entries[top].end : m->count;
+    if (depth == 0) {
+        if ((r = rollup_of(m, top)) != NULL) {
+            report("", 0, r, arg);
+            reported++;
+        }
+        return reported;
+    }
+    open[open_count] = top;
+    lengths[open_count++] = 0;
+    for (uint32_t j = top + 1; j <= end; ) {
+        // Close every directory whose range ends here
+        while (open_count > 0 && (j == end || m->entries[open[open_count - 1]].end <= j)) {
+            open_count--;
+            relative[lengths[open_count]] = '\0';
+            if ((r = rollup_of(m, open[open_count])) != NULL) {
+                report(relative, open_count, r, arg);
+                reported++;
+            }
+        }
+        if (j == end) {
+            break;
+        }
+        if (!S_ISDIR(m->entries[j].mode)) {
+            j++;
+            continue;
+        }
+        size_t at = lengths[open_count - 1];
+        relative[at] = '\0';
+        const char *child = entry_name(m, j);
+        if (at + 1 + strlen(child) >= sizeof(relative)) {
+            j = m->entries[j].end > j ? m->entries[j].end : j + 1;
+            continue;
+        }
+        snprintf(relative + at, sizeof(relative) - at, "%s%s", at > 0 ? "/" : "", child);
+        if (open_count == depth) {
+            if ((r = rollup_of(m, j)) != NULL) {
+                report(relative, open_count, r, arg);
+                reported++;
+            }
+            j = m->entries[j].end > j ? m->entries[j].end : j + 1;
+        } else {
+            lengths[open_count] = strlen(relative);
+            open[open_count++] = j;
+            j++;
+        }
+    }
+    return reported;
+}
+
+long index_top(enum index_order order, size_t k, index_match_fn match, void *arg) {
+    if (index_current() == -1) {
+        return -1;
+    }
+    const struct index_map *m = &current;
+    struct top t;
+    if (top_init(&t, k) == -1) {
+        return -1;
+    }
+    for (uint32_t e = 1; e < m->count; e++) {
+        const struct index_entry *entry = &m->entries[e];
+        int64_t key = order == INDEX_BY_SIZE ? entry->size : entry->mtime_ns;
+        if (!S_ISDIR(entry->mode) && top_admits(&t, key)) {
+            top_offer(&t, key, (void *)(uintptr_t)e);
+        }
+    }
+    size_t count = top_finish(&t);
+    char path[4096];
+    long passed = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t e = (uint32_t)(uintptr_t)t.items[i].value;
+        if (entry_path(m, e, path, sizeof(path)) == 0) {
+            match(path, &m->entries[e], arg);
+            passed++;
+        }
+    }
+    top_free(&t);
+    return passed;
+}
@@ -0,0 +1,144 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// On-disk snapshot of the served tree, kept so that a restarted server does
+// not have to walk the whole tree again before it can answer name lookups.
+//
+// The file is position independent: a header, a flat array of entries in
+// walk order (a directory is followed by everything below it), a table of
+// name hashes sorted for binary search, and a pool of NUL-terminated names.
+// All references are array indexes or pool offsets, so the file is used
+// straight from mmap without any fixups.
+//
+// Every directory keeps the mtime it had when it was listed. A refresh
+// reads again only the directories whose listing changed and reuses the
+// names of the others from the previous snapshot. It still stats every
+// entry, since writing to a file changes its size and mtime but not its
+// directory's, so the sizes and times in a snapshot are those of the
+// refresh that wrote it.
+//
+// For searches by part of a name, every distinct file name is interned once
+// and each trigram (three consecutive bytes) of a name has a posting list of
+// the names containing it. A search intersects the lists of the trigrams its
+// pattern cannot match without, and only checks the names left over.
+//
+// Every directory also has a rollup of everything below it: how many
+// directories and files, and the files' total size. Rollups are added up
+// again in one pass over the entries whenever the snapshot is written, so
+// they always match the entries they come with.
+//
+// A refresher process does this whenever the tree generation moves (see
+// cache.h) and publishes the generation the snapshot matches, so lookups only
+// trust an index that is current and fall back to walking the tree otherwise.
+
+#define INDEX_MAGIC 0x3158444950414e53ULL   // "SNAPIDX1"
+#define INDEX_VERSION 3
+
+struct index_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t entry_size;        // sizeof(struct index_entry) of the writer
+    uint64_t entry_count;
+    uint64_t entries_offset;
+    uint64_t names_offset;      // entry_count struct index_name, sorted by (hash, entry)
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    int64_t built_at;
+    uint64_t interned_offset;   // interned_count pool offsets, one per distinct file name
+    uint64_t interned_count;
+    uint64_t trigrams_offset;   // trigram_count struct index_trigram sorted by trigram, then an end marker
+    uint64_t trigram_count;
+    uint64_t postings_offset;   // posting_count interned name numbers, ascending within each trigram
+    uint64_t posting_count;
+    uint64_t rollups_offset;    // rollup_count struct index_rollup, one per directory in entry order
+    uint64_t rollup_count;
+};
+
+struct index_entry {
+    uint32_t parent;            // index of the containing directory; the root is its own parent
+    uint32_t name;              // pool offset; the root's name is its full path
+    uint32_t end;               // one past the last entry below this one
+    uint32_t mode;              // st_mode from lstat
+    int64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+};
+
+struct index_name {
+    uint32_t hash;
+    uint32_t entry;
+};
+
+struct index_trigram {
+    uint32_t trigram;           // the three bytes, first one highest
+    uint32_t start;             // first posting; the next trigram's start ends the list
+};
+
+// Totals for the subtree below a directory, at any depth; non-directories of
+// every kind count as files
+struct index_rollup {
+    uint32_t entry;             // the directory's entry
+    uint32_t dirs;
+    uint64_t files;
+    int64_t bytes;              // sum of the files' sizes
+};
+
+// How index_search reads its pattern
+enum index_pattern {
+    INDEX_SUBSTRING,
+    INDEX_GLOB,                 // fnmatch(3)
+    INDEX_REGEX                 // POSIX extended
+};
+
+// What index_top ranks files by
+enum index_order {
+    INDEX_BY_SIZE,
+    INDEX_BY_MTIME
+};
+
+// Called by index_search for each match with its path and snapshot entry
+typedef void (*index_match_fn)(const char *path, const struct index_entry *entry, void *arg);
+
+// Called by index_usage for each directory reported, with its path relative
+// to the directory asked about ("" for that one) and its depth below it
+typedef void (*index_usage_fn)(const char *path, int depth, const struct index_rollup *rollup, void *arg);
+
+// Start the refresher for the tree under root, skipping exclude, with the
+// snapshot kept at path. Call once in the parent before forking; lookups are
+// served from the previous snapshot as soon as it has been checked against the tree.
+int index_init(const char *path, const char *root, const char *exclude);
+
+// Map the latest snapshot in the parent, so handlers forked afterwards inherit
+// it; cheap when nothing was published since the last call
+void index_prefetch(void);
+
+// First non-directory entry called name, in walk order. Returns 1 and fills
+// path, 0 if the tree has no such file, or -1 if the index is not current,
+// in which case the caller has to walk the tree itself.
+int index_lookup_file(const char *name, char *path, size_t size);
+
+// Non-directory entries whose name matches pattern, from the latest snapshot
+// even if the tree has moved on since; the first limit of them in walk order
+// are passed to match. Returns the number of matches, -1 if there is no
+// snapshot yet, or -2 if the pattern is not valid.
+long index_search(enum index_pattern kind, const char *pattern, long limit, index_match_fn match, void *arg);
+
+// The k non-directory entries with the largest size or newest mtime, passed
+// to match largest or newest first; among equal ones, those first in walk
+// order. Memory use is k entries however large the tree is. Returns the
+// number passed, or -1 if the index is not current, in which case the
+// caller has to walk the tree itself. Every refresh stats every file, so a
+// current index ranks by the sizes and mtimes files have now.
+long index_top(enum index_order order, size_t k, index_match_fn match, void *arg);
+
+// Rollups of the directory at path (relative to the root, "" for the root)
+// and of every directory below it down to depth levels, each reported after
+// the directories below it, like du(1). Returns the number of directories
+// reported, 0 if there is no such directory, or -1 if the index is not
+// current, in which case the caller has to walk the tree itself.
+long index_usage(const char *path, int depth, index_usage_fn report, void *arg);
+
+#endif
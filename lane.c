@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "lane.h"
+#include "cache.h"
+#include "metrics.h"
+#include "trace.h"
+#include "admit.h"
+
+#define LANE_MAGIC 0x31454e414c50534eULL
+// Commands running or waiting at once, across all servers
+#define LANE_ENTRIES 256
+// How often a waiting command checks for a free slot
+#define LANE_POLL_US 5000
+// How often a waiter looks for slots left behind by processes that died
+#define LANE_PURGE_US 200000
+
+enum entry_state {
+    ENTRY_FREE,
+    ENTRY_WAITING,
+    ENTRY_RUNNING
+};
+
+struct lane_entry {
+    pid_t pid;
+    int lane;
+    int state;
+    uint64_t client;
+    uint64_t since_us;      // when the command started waiting
+};
+
+struct lane_table {
+    uint64_t magic;
+    struct lane_entry entries[LANE_ENTRIES];
+};
+
+static struct lane_table *table = NULL;
+static int table_fd = -1;
+static int limits[LANE_COUNT];
+static int queue_max = 32;
+static uint64_t client_id = 0;
+static int held = -1;       // entry of the slot this process holds
+
+// fcntl locks belong to the process, so handlers can share the inherited
+// descriptor and still exclude each other; a dead holder's lock goes away
+static void table_lock(void) {
+    struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+    while (fcntl(table_fd, F_SETLKW, &fl) == -1 && errno == EINTR) {
+    }
+}
+
+static void table_unlock(void) {
+    struct flock fl = { .l_type = F_UNLCK, .l_whence = SEEK_SET };
+    fcntl(table_fd, F_SETLK, &fl);
+}
+
+static int read_limit(const char *name, int fallback) {
+    const char *env = getenv(name);
+    return env != NULL && *env != '\0' ? atoi(env) : fallback;
+}
+
+int lane_init(const char *table_path) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        cpus = 1;
+    }
+    limits[LANE_META] = read_limit("FILESNAP_META_SLOTS", 4 * cpus);
+    limits[LANE_ARCHIVE] = read_limit("FILESNAP_ARCHIVE_SLOTS", cpus);
+    queue_max = read_limit("FILESNAP_LANE_QUEUE", queue_max);
+
+    table_fd = open(table_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (table_fd == -1) {
+        perror("open lane table");
+        return -1;
+    }
+    table_lock();
+    struct stat st;
+    if (fstat(table_fd, &st) == -1 ||
+        (st.st_size != sizeof(struct lane_table) && ftruncate(table_fd, sizeof(struct lane_table)) == -1)) {
+        perror("size lane table");
+        table_unlock();
+        close(table_fd);
+        table_fd = -1;
+        return -1;
+    }
+    void *p = mmap(NULL, sizeof(struct lane_table), PROT_READ | PROT_WRITE, MAP_SHARED, table_fd, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap lane table");
+        table_unlock();
+        close(table_fd);
+        table_fd = -1;
+        return -1;
+    }
+    table = p;
+    // Another server may be using the table already; only a foreign or stale layout is reset
+    if (table->magic != LANE_MAGIC) {
+        memset(table, 0, sizeof(struct lane_table));
+        table->magic = LANE_MAGIC;
+    }
+    table_unlock();
+    return 0;
+}
+
+void lane_attach(int client_socket) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    char host[INET6_ADDRSTRLEN] = "";
+    if (getpeername(client_socket, (struct sockaddr *)&addr, &len) == 0) {
+        if (addr.ss_family == AF_INET) {
+            inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr, host, sizeof(host));
+        } else if (addr.ss_family == AF_INET6) {
+            inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&addr)->sin6_addr, host, sizeof(host));
+        }
+    }
+    client_id = cache_hash(host);
+}
+
+static int running_for(int lane, uint64_t client) {
+    int count = 0;
+    for (int i = 0; i < LANE_ENTRIES; i++) {
+        const struct lane_entry *e = &table->entries[i];
+        if (e->state == ENTRY_RUNNING && e->lane == lane && e->client == client) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Whether the waiting entry may start now; called with the table locked
+static int may_run(int slot) {
+    const struct lane_entry *me = &table->entries[slot];
+    int limit = limits[me->lane];
+    int per_client = limit > 1 ? limit - 1 : 1;
+    int running = 0;
+    for (int i = 0; i < LANE_ENTRIES; i++) {
+        if (table->entries[i].state == ENTRY_RUNNING && table->entries[i].lane == me->lane) {
+            running++;
+        }
+    }
+    int mine = running_for(me->lane, me->client);
+    if (running >= limit || mine >= per_client) {
+        return 0;
+    }
+    // A waiter that could run goes first if its client has fewer commands
+    // running, or as many and it has waited longer
+    for (int i = 0; i < LANE_ENTRIES; i++) {
+        const struct lane_entry *w = &table->entries[i];
+        if (i == slot || w->state != ENTRY_WAITING || w->lane != me->lane) {
+            continue;
+        }
+        int theirs = w->client == me->client ? mine : running_for(w->lane, w->client);
+        if (theirs >= per_client) {
+            continue;
+        }
+        if (theirs < mine || (theirs == mine && w->since_us < me->since_us)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Free entries whose process is gone; called with the table locked
+static void purge_dead(void) {
+    for (int i = 0; i < LANE_ENTRIES; i++) {
+        struct lane_entry *e = &table->entries[i];
+        if (e->state != ENTRY_FREE && kill(e->pid, 0) == -1 && errno == ESRCH) {
+            e->state = ENTRY_FREE;
+        }
+    }
+}
+
+int lane_enter(enum lane lane) {
+    if (table == NULL || limits[lane] <= 0 || held != -1) {
+        return 0;
+    }
+    uint64_t started = metrics_now_us();
+    uint64_t max_wait = (uint64_t)admit_queue_wait_ms() * 1000;
+    table_lock();
+    int slot = -1, waiting = 0;
+    for (int i = 0; i < LANE_ENTRIES; i++) {
+        const struct lane_entry *e = &table->entries[i];
+        if (e->state == ENTRY_FREE && slot == -1) {
+            slot = i;
+        } else if (e->state == ENTRY_WAITING && e->lane == (int)lane) {
+            waiting++;
+        }
+    }
+    if (slot == -1 || waiting >= queue_max) {
+        table_unlock();
+        return -1;
+    }
+    struct lane_entry *e = &table->entries[slot];
+    e->pid = getpid();
+    e->lane = lane;
+    e->client = client_id;
+    e->since_us = started;
+    e->state = ENTRY_WAITING;
+
+    uint64_t purged = started;
+    int waited = 0;
+    while (!may_run(slot)) {
+        uint64_t now = metrics_now_us();
+        if (now - started >= max_wait) {
+            e->state = ENTRY_FREE;
+            table_unlock();
+            trace_span(TRACE_QUEUE, started);
+            return -1;
+        }
+        if (now - purged >= LANE_PURGE_US) {
+            purge_dead();
+            purged = now;
+        }
+        table_unlock();
+        usleep(LANE_POLL_US);
+        waited = 1;
+        table_lock();
+    }
+    e->state = ENTRY_RUNNING;
+    table_unlock();
+    held = slot;
+    if (waited) {
+        trace_span(TRACE_QUEUE, started);
+    }
+    return 0;
+}
+
+void lane_leave(void) {
+    if (held == -1) {
+        return;
+    }
+    table_lock();
+    struct lane_entry *e = &table->entries[held];
+    if (e->state == ENTRY_RUNNING && e->pid == getpid()) {
+        e->state = ENTRY_FREE;
+    }
+    table_unlock();
+    held = -1;
+}
+
+void lane_adopt(void) {
+    if (held == -1) {
+        return;
+    }
+    table_lock();
+    table->entries[held].pid = getpid();
+    table_unlock();
+}
@@ -0,0 +1,44 @@
+#ifndef LANE_H
+#define LANE_H
+
+// Admission control in two lanes, so cheap metadata commands never queue
+// behind archive builds. Each lane has its own limit on the commands running
+// at once, counted across the server and its mirrors through a table file
+// they all map. A client (identified by its address) may hold at most all
+// but one of a lane's slots, so another client can always get in. When slots
+// are contended, the waiting client with the fewest running commands goes
+// first, oldest request first among equals.
+//
+// The number of commands waiting in a lane and the time each may wait are
+// bounded as well; a command over either bound is turned away as busy.
+//
+// Limits are read from the environment; 0 turns a lane's limit off.
+//   FILESNAP_META_SLOTS     dirlist and w24fn (default 4 per CPU)
+//   FILESNAP_ARCHIVE_SLOTS  archive builds (default 1 per CPU)
+//   FILESNAP_LANE_QUEUE     commands waiting per lane (default 32)
+//   FILESNAP_QUEUE_WAIT_MS  longest wait for a slot (default 10000, see admit.h)
+
+enum lane {
+    LANE_META,
+    LANE_ARCHIVE,
+    LANE_COUNT
+};
+
+// Read the limits and map the table at table_path; call once in the parent before forking
+int lane_init(const char *table_path);
+
+// Identify the client of this connection, in the child handling it
+void lane_attach(int client_socket);
+
+// Wait for a slot in lane. A process holds at most one slot at a time.
+// Returns 0 once the command may run, or -1 if it should be turned away.
+int lane_enter(enum lane lane);
+
+// Give back the slot this process holds, if it still owns it
+void lane_leave(void);
+
+// Take over the slot held by the process this one was forked from,
+// so the slot is given back when this process is done instead
+void lane_adopt(void);
+
+#endif
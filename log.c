@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/prctl.h>
+
+#include "log.h"
+#include "shared.h"
+
+// Processes that can hold a ring at once; the rest write directly
+#define LOG_RINGS 128
+// Records per ring; a power of two
+#define LOG_RING_RECORDS 64
+#define LOG_RECORD_SIZE 512
+#define LOG_TEXT_MAX (LOG_RECORD_SIZE - 16)
+// Flusher pause when every ring is empty
+#define LOG_FLUSH_IDLE_US 20000
+// Rings of processes that died without detaching are freed this often
+#define LOG_REAP_EVERY 50
+
+struct log_record {
+    uint64_t ts_ns;             // CLOCK_REALTIME
+    int32_t pid;
+    uint16_t level;
+    uint16_t len;
+    char text[LOG_TEXT_MAX];
+};
+
+struct log_ring {
+    pid_t owner;
+    uint64_t head __attribute__((aligned(64)));     // written by the owner only
+    uint64_t tail __attribute__((aligned(64)));     // written by the flusher only
+    struct log_record records[LOG_RING_RECORDS] __attribute__((aligned(64)));
+};
+
+struct log_region {
+    uint64_t requests;
+    uint64_t dropped;
+    struct log_ring rings[LOG_RINGS];
+};
+
+static const char *level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+int log_threshold = LOG_LEVEL_INFO;
+int log_sampled = 1;
+
+static int sample_every = 1;
+static const char *server = "server";
+static struct log_region *region = NULL;
+static struct log_ring *my_ring = NULL;
+static pid_t my_pid = 0;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void on_sigterm(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+// Format one record as an output line; returns its length
+static size_t format_line(char *out, size_t size, uint64_t ts_ns, pid_t pid, int level,
+                          const char *text, size_t len) {
+    // Records come in bursts within the same second; convert each second once
+    static time_t stamp_secs = -1;
+    static char stamp[32];
+    time_t secs = (time_t)(ts_ns / 1000000000ULL);
+    if (secs != stamp_secs) {
+        struct tm tm;
+        localtime_r(&secs, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+        stamp_secs = secs;
+    }
+    int n = snprintf(out, size, "%s.%06llu %-5s %s[%d] %.*s\n", stamp,
+                     (unsigned long long)(ts_ns % 1000000000ULL / 1000), level_names[level],
+                     server, (int)pid, (int)len, text);
+    if (n < 0) {
+        return 0;
+    }
+    size_t line = (size_t)n < size ? (size_t)n : size - 1;
+    // One record, one line: newlines inside the message (raw commands carry them) become spaces
+    for (size_t i = 0; i + 1 < line; i++) {
+        if (out[i] == '\n') {
+            out[i] = ' ';
+        }
+    }
+    return line;
+}
+
+// Length of formatted text as stored: truncated to size, without a trailing newline
+static size_t clip(const char *text, int len, size_t size) {
+    size_t n = len < (int)size ? (size_t)len : size - 1;
+    return n > 0 && text[n - 1] == '\n' ? n - 1 : n;
+}
+
+static void write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_records(const void *a, const void *b) {
+    const struct log_record *x = *(struct log_record *const *)a;
+    const struct log_record *y = *(struct log_record *const *)b;
+    return x->ts_ns < y->ts_ns ? -1 : x->ts_ns > y->ts_ns;
+}
+
+// Write out everything in the rings, oldest first; returns the number of records
+static int drain(struct log_record **batch, char *out, size_t out_size) {
+    uint64_t heads[LOG_RINGS];
+    int count = 0;
+    for (int i = 0; i < LOG_RINGS; i++) {
+        struct log_ring *ring = &region->rings[i];
+        heads[i] = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (uint64_t t = ring->tail; t < heads[i]; t++) {
+            batch[count++] = &ring->records[t % LOG_RING_RECORDS];
+        }
+    }
+    qsort(batch, count, sizeof(batch[0]), compare_records);
+
+    size_t used = 0;
+    for (int i = 0; i < count; i++) {
+        if (out_size - used < LOG_RECORD_SIZE + 128) {
+            write_all(out, used);
+            used = 0;
+        }
+        used += format_line(out + used, out_size - used, batch[i]->ts_ns, batch[i]->pid,
+                            batch[i]->level, batch[i]->text, batch[i]->len);
+    }
+    // Only now may the owners reuse the records
+    for (int i = 0; i < LOG_RINGS; i++) {
+        __atomic_store_n(&region->rings[i].tail, heads[i], __ATOMIC_RELEASE);
+    }
+    uint64_t dropped = __atomic_exchange_n(&region->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0) {
+        char note[64];
+        int len = snprintf(note, sizeof(note), "%llu records dropped, rings full", (unsigned long long)dropped);
+        used += format_line(out + used, out_size - used, realtime_ns(), getpid(), LOG_LEVEL_WARN, note, len);
+    }
+    write_all(out, used);
+    return count;
+}
+
+// Free the rings of processes that exited without detaching, once they are drained
+static void reap_rings(void) {
+    for (int i = 0; i < LOG_RINGS; i++) {
+        struct log_ring *ring = &region->rings[i];
+        pid_t owner = __atomic_load_n(&ring->owner, __ATOMIC_ACQUIRE);
+        if (owner != 0 && kill(owner, 0) == -1 && errno == ESRCH &&
+            __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail) {
+            __atomic_compare_exchange_n(&ring->owner, &owner, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void run_flusher(void) {
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    signal(SIGTERM, on_sigterm);
+    size_t out_size = (size_t)LOG_RINGS * LOG_RING_RECORDS * (LOG_RECORD_SIZE + 128);
+    struct log_record **batch = malloc(sizeof(*batch) * LOG_RINGS * LOG_RING_RECORDS);
+    char *out = malloc(out_size);
+    if (batch == NULL || out == NULL) {
+        perror("malloc log flusher");
+        _exit(1);
+    }
+    for (unsigned long pass = 0; !stopping; pass++) {
+        if (drain(batch, out, out_size) == 0) {
+            usleep(LOG_FLUSH_IDLE_US);
+        }
+        if (pass % LOG_REAP_EVERY == 0) {
+            reap_rings();
+        }
+    }
+    drain(batch, out, out_size); // What was logged just before the server went down
+    _exit(0);
+}
+
+int log_init(const char *server_name) {
+    server = server_name;
+    const char *level = getenv("FILESNAP_LOG_LEVEL");
+    if (level != NULL) {
+        for (int i = 0; i <= LOG_LEVEL_ERROR; i++) {
+            if (strcasecmp(level, level_names[i]) == 0) {
+                log_threshold = i;
+            }
+        }
+    }
+    const char *sample = getenv("FILESNAP_LOG_SAMPLE");
+    if (sample != NULL && atoi(sample) > 1) {
+        sample_every = atoi(sample);
+    }
+
+    region = shared_alloc(sizeof(struct log_region));
+    if (region == NULL) {
+        return -1;
+    }
+    fflush(stdout); // Nothing buffered may be written twice by the flusher
+    pid_t pid = fork();
+    if (pid == 0) {
+        run_flusher();
+    }
+    if (pid < 0) {
+        perror("fork log flusher");
+        region = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void log_attach(void) {
+    my_ring = NULL;
+    if (region == NULL) {
+        return;
+    }
+    pid_t self = getpid();
+    for (int i = 0; i < LOG_RINGS; i++) {
+        struct log_ring *ring = &region->rings[i];
+        pid_t expected = 0;
+        // A ring is only taken over once the flusher has emptied it
+        if (__atomic_load_n(&ring->owner, __ATOMIC_RELAXED) == 0 &&
+            __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == __atomic_load_n(&ring->head, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&ring->owner, &expected, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            my_ring = ring;
+            my_pid = self;
+            return;
+        }
+    }
+}
+
+void log_detach(void) {
+    if (my_ring != NULL) {
+        __atomic_store_n(&my_ring->owner, 0, __ATOMIC_RELEASE);
+        my_ring = NULL;
+    }
+}
+
+void log_begin_request(void) {
+    if (sample_every > 1) {
+        uint64_t n = region != NULL ? __atomic_fetch_add(&region->requests, 1, __ATOMIC_RELAXED)
+                                    : (uint64_t)rand();
+        log_sampled = n % sample_every == 0;
+    }
+}
+
+void log_write(enum log_level level, const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    if (my_ring == NULL) {
+        // No ring of its own: format the whole line and write it at once
+        char text[LOG_TEXT_MAX], line[LOG_RECORD_SIZE + 128];
+        int len = vsnprintf(text, sizeof(text), format, ap);
+        va_end(ap);
+        if (len < 0) {
+            return;
+        }
+        size_t n = format_line(line, sizeof(line), realtime_ns(), getpid(), level, text,
+                               clip(text, len, sizeof(text)));
+        write_all(line, n);
+        return;
+    }
+    uint64_t head = my_ring->head;
+    if (head - __atomic_load_n(&my_ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_RECORDS) {
+        va_end(ap);
+        __atomic_fetch_add(&region->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    struct log_record *record = &my_ring->records[head % LOG_RING_RECORDS];
+    int len = vsnprintf(record->text, sizeof(record->text), format, ap);
+    va_end(ap);
+    if (len < 0) {
+        return;
+    }
+    record->len = (uint16_t)clip(record->text, len, sizeof(record->text));
+    record->level = (uint16_t)level;
+    record->pid = my_pid;
+    record->ts_ns = realtime_ns();
+    __atomic_store_n(&my_ring->head, head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,56 @@
+#ifndef LOG_H
+#define LOG_H
+
+// Logging that stays off the request path. Each process handling a
+// connection owns a ring of records in shared memory (see shared.h) and is
+// its only writer; logging a record is a clock read, formatting into the
+// ring and one release store, with no lock and no system call. A flusher
+// process drains every ring, orders the records by time and writes them to
+// stdout in large batches, so a slow terminal or pipe only ever holds up
+// the flusher. A full ring drops records and counts them instead of waiting.
+//
+// Records below the threshold are skipped before their arguments are even
+// evaluated. With sampling, debug and info records are kept only for one
+// request in N; warnings and errors are always kept.
+//
+//   FILESNAP_LOG_LEVEL   debug, info, warn or error (default info)
+//   FILESNAP_LOG_SAMPLE  keep debug and info records of one request in N (default 1)
+//
+// Output lines are "<time> <level> <server>[<pid>] <message>".
+
+enum log_level {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+};
+
+extern int log_threshold;   // lowest level written
+extern int log_sampled;     // debug and info records of the current request are kept
+
+#define log_at(level, ...) do { \
+        if ((level) >= log_threshold && ((level) >= LOG_LEVEL_WARN || log_sampled)) { \
+            log_write((level), __VA_ARGS__); \
+        } \
+    } while (0)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// Read the settings, set up the rings and start the flusher; call once in
+// the parent before forking
+int log_init(const char *server_name);
+
+// Claim a ring for the calling process. A process forked from one that has
+// a ring must attach (or detach) before it logs, since a ring has one writer.
+// Without a ring, records are written to stdout directly.
+void log_attach(void);
+void log_detach(void);
+
+// Start a new request: decides whether its records are sampled
+void log_begin_request(void);
+
+void log_write(enum log_level level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
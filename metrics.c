@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "metrics.h"
+#include "shared.h"
+
+// Each worker owns one slot and is its only writer, so updates are
+// uncontended relaxed atomics. Readers sum every slot when asked.
+#define METRICS_SLOTS 64
+
+// HDR-style log-linear buckets: 16 sub-buckets per power of two, which
+// keeps the error under ~6% from 1us up to about 2^40us.
+#define HIST_SUB_BITS 4
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 40
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB_COUNT)
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+struct metrics_slot {
+    pid_t owner;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t sessions;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    struct histogram commands[CMD_COUNT];
+    struct histogram phases[PHASE_COUNT];
+};
+
+struct metrics_region {
+    uint64_t started_us;
+    uint64_t accepted;
+    uint64_t shed;
+    struct metrics_slot slots[METRICS_SLOTS];
+};
+
+static const char *command_names[CMD_COUNT] = {
+    "dirlist", "w24fn", "w24fz", "w24ft", "w24fdb", "w24fda", "stats", "w24range", "w24fs", "w24fc", "w24sum", "w24du", "w24top"
+};
+
+static const char *phase_names[PHASE_COUNT] = {
+    "walk", "filter", "compress", "send"
+};
+
+static struct metrics_region *region = NULL;
+static struct metrics_slot *my_slot = NULL;
+
+uint64_t metrics_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int metrics_init(void) {
+    // Shared pages, so forked children write into the same slots
+    region = shared_alloc(sizeof(struct metrics_region));
+    if (region == NULL) {
+        return -1;
+    }
+    region->started_us = metrics_now_us();
+    return 0;
+}
+
+void metrics_attach(void) {
+    if (region == NULL) {
+        return;
+    }
+    pid_t self = getpid();
+    for (int i = 1; i < METRICS_SLOTS; i++) {
+        pid_t expected = 0;
+        if (__atomic_compare_exchange_n(&region->slots[i].owner, &expected, self, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            my_slot = &region->slots[i];
+            break;
+        }
+    }
+    // Every slot is taken: share slot 0, which is still safe because all updates are atomic
+    if (my_slot == NULL) {
+        my_slot = &region->slots[0];
+    }
+    __atomic_fetch_add(&my_slot->sessions, 1, __ATOMIC_RELAXED);
+}
+
+void metrics_detach(void) {
+    if (my_slot == NULL) {
+        return;
+    }
+    if (my_slot != &region->slots[0]) {
+        __atomic_store_n(&my_slot->owner, 0, __ATOMIC_RELEASE);
+    }
+    my_slot = NULL;
+}
+
+void metrics_connection_accepted(void) {
+    if (region != NULL) {
+        __atomic_fetch_add(&region->accepted, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void metrics_request_shed(void) {
+    if (region != NULL) {
+        __atomic_fetch_add(&region->shed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static int bucket_index(uint64_t value) {
+    if (value < HIST_SUB_COUNT) {
+        return (int)value;
+    }
+    int exp = 63 - __builtin_clzll(value);
+    if (exp > HIST_MAX_EXP) {
+        return HIST_BUCKETS - 1;
+    }
+    int sub = (int)((value >> (exp - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+    return (exp - HIST_SUB_BITS + 1) * HIST_SUB_COUNT + sub;
+}
+
+// Lowest value that lands in the given bucket
+static uint64_t bucket_floor(int index) {
+    if (index < HIST_SUB_COUNT) {
+        return (uint64_t)index;
+    }
+    int exp = index / HIST_SUB_COUNT + HIST_SUB_BITS - 1;
+    uint64_t sub = (uint64_t)(index % HIST_SUB_COUNT);
+    return (HIST_SUB_COUNT + sub) << (exp - HIST_SUB_BITS);
+}
+
+static void histogram_record(struct histogram *h, uint64_t value) {
+    __atomic_fetch_add(&h->buckets[bucket_index(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+    uint64_t seen = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (value > seen &&
+           !__atomic_compare_exchange_n(&h->max, &seen, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void metrics_record_command(int command, uint64_t usec) {
+    if (my_slot != NULL && command >= 0 && command < CMD_COUNT) {
+        histogram_record(&my_slot->commands[command], usec);
+    }
+}
+
+void metrics_record_phase(int phase, uint64_t usec) {
+    if (my_slot != NULL && phase >= 0 && phase < PHASE_COUNT) {
+        histogram_record(&my_slot->phases[phase], usec);
+    }
+}
+
+void metrics_add_bytes_in(size_t bytes) {
+    if (my_slot != NULL) {
+        __atomic_fetch_add(&my_slot->bytes_in, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+void metrics_add_bytes_out(size_t bytes) {
+    if (my_slot != NULL) {
+        __atomic_fetch_add(&my_slot->bytes_out, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+void metrics_cache_result(int hit) {
+    if (my_slot != NULL) {
+        __atomic_fetch_add(hit ? &my_slot->cache_hits : &my_slot->cache_misses, 1, __ATOMIC_RELAXED);
+    }
+}
+
+ssize_t metrics_send(int sock, const void *buf, size_t len, int flags) {
+    ssize_t sent = send(sock, buf, len, flags);
+    if (sent > 0) {
+        metrics_add_bytes_out((size_t)sent);
+    }
+    return sent;
+}
+
+// Sum one histogram from every slot into dst
+static void histogram_merge(struct histogram *dst, const struct histogram *src) {
+    dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if (max > dst->max) {
+        dst->max = max;
+    }
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+    }
+}
+
+static uint64_t histogram_percentile(const struct histogram *h, double pct) {
+    if (h->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(pct / 100.0 * (double)h->count);
+    if (rank >= h->count) {
+        rank = h->count - 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank) {
+            // Report the highest value equivalent to this bucket, like HDR histograms do
+            uint64_t value = bucket_floor(i + 1) - 1;
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+static int format_histogram(char *out, size_t size, const char *name, const struct histogram *h) {
+    return snprintf(out, size, "%-9s count=%llu mean=%lluus p50=%lluus p90=%lluus p99=%lluus p999=%lluus max=%lluus\n",
+                    name,
+                    (unsigned long long)h->count,
+                    (unsigned long long)(h->count ? h->sum / h->count : 0),
+                    (unsigned long long)histogram_percentile(h, 50.0),
+                    (unsigned long long)histogram_percentile(h, 90.0),
+                    (unsigned long long)histogram_percentile(h, 99.0),
+                    (unsigned long long)histogram_percentile(h, 99.9),
+                    (unsigned long long)h->max);
+}
+
+void metrics_report(int client_socket) {
+    if (region == NULL) {
+        const char *msg = "Metrics are not enabled on this server.\n";
+        metrics_send(client_socket, msg, strlen(msg), 0);
+        return;
+    }
+
+    // Aggregate on read; the hot path never takes part in this
+    struct histogram *commands = calloc(CMD_COUNT, sizeof(struct histogram));
+    struct histogram *phases = calloc(PHASE_COUNT, sizeof(struct histogram));
+    if (commands == NULL || phases == NULL) {
+        perror("calloc");
+        free(commands);
+        free(phases);
+        return;
+    }
+    uint64_t bytes_in = 0, bytes_out = 0, sessions = 0, cache_hits = 0, cache_misses = 0;
+    int active = 0;
+    for (int s = 0; s < METRICS_SLOTS; s++) {
+        struct metrics_slot *slot = &region->slots[s];
+        if (__atomic_load_n(&slot->owner, __ATOMIC_RELAXED) != 0) {
+            active++;
+        }
+        bytes_in += __atomic_load_n(&slot->bytes_in, __ATOMIC_RELAXED);
+        bytes_out += __atomic_load_n(&slot->bytes_out, __ATOMIC_RELAXED);
+        sessions += __atomic_load_n(&slot->sessions, __ATOMIC_RELAXED);
+        cache_hits += __atomic_load_n(&slot->cache_hits, __ATOMIC_RELAXED);
+        cache_misses += __atomic_load_n(&slot->cache_misses, __ATOMIC_RELAXED);
+        for (int c = 0; c < CMD_COUNT; c++) {
+            histogram_merge(&commands[c], &slot->commands[c]);
+        }
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            histogram_merge(&phases[p], &slot->phases[p]);
+        }
+    }
+
+    char report[4096];
+    int len = snprintf(report, sizeof(report),
+                       "uptime_s=%llu accepted=%llu shed=%llu sessions=%llu active_sessions=%d bytes_in=%llu bytes_out=%llu "
+                       "cache_hits=%llu cache_misses=%llu\n",
+                       (unsigned long long)((metrics_now_us() - region->started_us) / 1000000),
+                       (unsigned long long)__atomic_load_n(&region->accepted, __ATOMIC_RELAXED),
+                       (unsigned long long)__atomic_load_n(&region->shed, __ATOMIC_RELAXED),
+                       (unsigned long long)sessions, active,
+                       (unsigned long long)bytes_in, (unsigned long long)bytes_out,
+                       (unsigned long long)cache_hits, (unsigned long long)cache_misses);
+    len += snprintf(report + len, sizeof(report) - len, "[commands]\n");
+    for (int c = 0; c < CMD_COUNT && len < (int)sizeof(report); c++) {
+        len += format_histogram(report + len, sizeof(report) - len, command_names[c], &commands[c]);
+    }
+    if (len < (int)sizeof(report)) {
+        len += snprintf(report + len, sizeof(report) - len, "[archive phases]\n");
+    }
+    for (int p = 0; p < PHASE_COUNT && len < (int)sizeof(report); p++) {
+        len += format_histogram(report + len, sizeof(report) - len, phase_names[p], &phases[p]);
+    }
+    if (len > (int)sizeof(report) - 1) {
+        len = sizeof(report) - 1;
+    }
+    metrics_send(client_socket, report, len, 0);
+
+    free(commands);
+    free(phases);
+}
@@ -0,0 +1,65 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Commands that get their own latency histogram
+enum metrics_command {
+    CMD_DIRLIST,
+    CMD_W24FN,
+    CMD_W24FZ,
+    CMD_W24FT,
+    CMD_W24FDB,
+    CMD_W24FDA,
+    CMD_STATS,
+    CMD_W24RANGE,
+    CMD_W24FS,
+    CMD_W24FC,
+    CMD_W24SUM,
+    CMD_W24DU,
+    CMD_W24TOP,
+    CMD_COUNT
+};
+
+// Phases of building and shipping an archive
+enum metrics_phase {
+    PHASE_WALK,             // the find existence probe
+    PHASE_FILTER,           // the find that lists the files
+    PHASE_COMPRESS,
+    PHASE_SEND,
+    PHASE_COUNT
+};
+
+// Create the shared counter region; call once in the parent before forking
+int metrics_init(void);
+
+// Claim / release a per-worker slot in the child handling a connection
+void metrics_attach(void);
+void metrics_detach(void);
+
+// Count an accepted connection (parent side)
+void metrics_connection_accepted(void);
+
+// Count a connection or command turned away with a busy reply
+void metrics_request_shed(void);
+
+// Monotonic clock in microseconds
+uint64_t metrics_now_us(void);
+
+void metrics_record_command(int command, uint64_t usec);
+void metrics_record_phase(int phase, uint64_t usec);
+void metrics_add_bytes_in(size_t bytes);
+void metrics_add_bytes_out(size_t bytes);
+
+// Count an archive query answered from (hit != 0) or missing in the result cache
+void metrics_cache_result(int hit);
+
+// send() that also counts the bytes that went out
+ssize_t metrics_send(int sock, const void *buf, size_t len, int flags);
+
+// Aggregate all worker slots and send a text report to the client
+void metrics_report(int client_socket);
+
+#endif
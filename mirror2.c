@@ -12,13 +12,51 @@
 #include <sys/sendfile.h>
 #include <string.h>
 #include <sys/types.h>
+#include <netinet/tcp.h>
+#include <limits.h>
+
+#include "metrics.h"
+#include "trace.h"
+#include "archive.h"
+#include "cache.h"
+#include "flight.h"
+#include "index.h"
+#include "shared.h"
+#include "lane.h"
+#include "admit.h"
+#include "shape.h"
+#include "log.h"
+#include "arena.h"
+#include "bloom.h"
+#include "content.h"
+#include "digest.h"
+#include "top.h"
+#include "serverw24.h"
 
 
 
 #define PORT 8086
-#define MAX_CLIENTS 15
+// Connections the kernel holds until they are accepted; admission happens after accept (see admit.h)
+#define LISTEN_BACKLOG 128
 #define CHUNK_SIZE 1024
 
+// Set while handling "w24prep <command>": the archive is spooled for ranged download instead of sent
+int prepare_only = 0;
+
+// Spooled archives not collected within this many seconds are removed
+#define SPOOL_MAX_AGE 600
+
+// Scratch memory of the command being handled, released in one step when it is done (see arena.h)
+#define REQUEST_ARENA_BLOCK (64 * 1024)
+struct arena request_arena = {NULL, NULL, NULL, REQUEST_ARENA_BLOCK};
+
+// Text replies are gathered into pieces this large before they are sent
+#define REPLY_BUFFER_SIZE (64 * 1024)
+// Most w24fs matches listed; the reply still says how many there are
+#define W24FS_MAX_MATCHES 1000
+// Most files one w24top can ask for
+#define W24TOP_MAX 10000
+
 
 char* get_home_directory() {
     struct passwd *pw = getpwuid(getuid());
@@ -29,6 +67,11 @@ char* get_home_directory() {
     return pw->pw_dir;
 }
 
+//Case-sensitive variant, for extensions (find -name is case-sensitive)
+int compare_exact(const void *a, const void *b) {
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
 
 int compare_strings(const void *a, const void *b) {
     const char *str1 = *(const char **)a;
@@ -37,143 +80,240 @@ int compare_strings(const void *a, const void *b) {
 }
 
 //dirlist command starts
-// Filter function to exclude hidden directories
-int filter(const struct dirent *dir) {
-    return (dir->d_name[0] != '.');
+// One subdirectory of a directory being listed; kept in the request arena
+struct dir_item {
+    const char *name;
+    size_t length;
+    time_t ctime;
+};
+
+// A text reply gathered in the request arena and sent in large pieces
+struct reply_buffer {
+    int client_socket;
+    char *data;
+    size_t used;
+};
+
+void reply_flush(struct reply_buffer *reply) {
+    if (reply->used > 0) {
+        metrics_send(reply->client_socket, reply->data, reply->used, 0);
+        reply->used = 0;
+    }
 }
 
-// Comparison function for alphabetical case-insensitive sorting
-int case_insensitive_sort(const struct dirent **a, const struct dirent **b) {
-    return strcasecmp((*a)->d_name, (*b)->d_name);
+void reply_append(struct reply_buffer *reply, const char *s, size_t length) {
+    if (length > REPLY_BUFFER_SIZE - reply->used) {
+        reply_flush(reply);
+        if (length > REPLY_BUFFER_SIZE) {
+            metrics_send(reply->client_socket, s, length, 0);
+            return;
+        }
+    }
+    memcpy(reply->data + reply->used, s, length);
+    reply->used += length;
 }
 
-// Comparison function for sorting by creation time
-int sort_by_time(const struct dirent **a, const struct dirent **b) {
-    struct stat statA, statB;
-    char pathA[1024], pathB[1024];
-    
-    snprintf(pathA, sizeof(pathA), "%s/%s", get_home_directory(), (*a)->d_name);
-    snprintf(pathB, sizeof(pathB), "%s/%s", get_home_directory(), (*b)->d_name);
-    
-    stat(pathA, &statA);
-    stat(pathB, &statB);
-    
-    return statA.st_ctime > statB.st_ctime;
+//Function for sorting the directories in case insensitive manner
+int compare_items_by_name(const void *a, const void *b) {
+    return strcasecmp(((const struct dir_item *)a)->name, ((const struct dir_item *)b)->name);
 }
 
-// Modified list_directories function
-void list_directories(int client_socket, const char *start_path, const char *sort_option) {
-    DIR *dir = opendir(start_path);
-    if (dir == NULL) { //If the directory couldn't be opened or doesn't exist
-        perror("opendir"); //print error
+//Function for sorting the directories by created time, oldest first
+int compare_items_by_time(const void *a, const void *b) {
+    time_t timeA = ((const struct dir_item *)a)->ctime, timeB = ((const struct dir_item *)b)->ctime;
+    return (timeA > timeB) - (timeA < timeB);
+}
+
+//Function to open a subdirectory relative to the directory it is in, so the kernel
+//resolves one name instead of the whole path again
+int open_subdirectory(int dir_fd, const char *name) {
+    return openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+//Function to list the subdirectories of the open directory dir_fd (which it closes),
+//depth first. path names it for the output: length bytes in a buffer of size,
+//extended in place for each subdirectory.
+void list_level(struct reply_buffer *reply, int dir_fd, char *path, size_t length, size_t size, int by_time) {
+    DIR *dir = fdopendir(dir_fd);
+    if (dir == NULL) { //If the directory couldn't be read
+        perror("fdopendir"); //print error
+        close(dir_fd);
         return;
     }
 
-    struct dirent **namelist;
-    int n;
-    // Check the sort_option to decide how to sort directory entries (if it is "a")
-    if (strcmp(sort_option, "-a") == 0) {
-        // Assume filter and case_insensitive_sort are defined elsewhere
-        n = scandir(start_path, &namelist, filter, case_insensitive_sort);
-    // Check the sort_option to decide how to sort directory entries (if it is "t")
-    } else if (strcmp(sort_option, "-t") == 0) {
-        n = scandir(start_path, &namelist, filter, sort_by_time);
-    } else {
-        n = scandir(start_path, &namelist, filter, alphasort);
+    // Collect the visible subdirectories of this level in the arena; they are
+    // released when the level is done, so memory follows the depth of the tree
+    struct arena_mark mark = arena_mark(&request_arena);
+    struct dir_item *items = NULL;
+    size_t count = 0, capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        // Hidden entries, "." and ".." included, are not listed
+        if (entry->d_type != DT_DIR || entry->d_name[0] == '.') {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct dir_item *grown = arena_alloc(&request_arena, capacity * sizeof(struct dir_item));
+            if (count > 0) {
+                memcpy(grown, items, count * sizeof(struct dir_item));
+            }
+            items = grown;
+        }
+        struct dir_item *item = &items[count++];
+        item->length = strlen(entry->d_name);
+        item->name = arena_strndup(&request_arena, entry->d_name, item->length);
+        item->ctime = 0;
     }
 
-    //if scanning the directory fails, 
-    if (n < 0) {
-        perror("scandir"); //print error
-        closedir(dir);
-        return;
+    // Created times are looked up once per directory, not at every comparison
+    struct stat info;
+    for (size_t i = 0; by_time && i < count; i++) {
+        if (fstatat(dir_fd, items[i].name, &info, 0) == 0) {
+            items[i].ctime = info.st_ctime;
+        }
     }
+    qsort(items, count, sizeof(struct dir_item), by_time ? compare_items_by_time : compare_items_by_name);
 
-    char *full_path;
-    struct stat info;
-    for (int i = 0; i < n; i++) {
-        struct dirent *entry = namelist[i];
-        if (entry->d_type == DT_DIR) {
-            // Allocate memory for the full path of the directory
-            full_path = malloc(strlen(start_path) + strlen(entry->d_name) + 2);
-            if (full_path == NULL) {
-                perror("malloc");
-                exit(EXIT_FAILURE);
-            }
-            sprintf(full_path, "%s/%s", start_path, entry->d_name);
-            stat(full_path, &info); // Get file statistics including creation time
-
-            // Check if sorting option is "-t" (by time)
-            if (strcmp(sort_option, "-t") == 0) {
-                char timebuf[256];
-                strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", localtime(&info.st_ctime));
-                send(client_socket, full_path, strlen(full_path), 0);
-                send(client_socket, " - Created: ", 12, 0);
-                send(client_socket, timebuf, strlen(timebuf), 0);
-                send(client_socket, "\n", 1, 0);
-            } else {
-                send(client_socket, full_path, strlen(full_path), 0);
-                send(client_socket, "\n", 1, 0);
-            }
+    for (size_t i = 0; i < count; i++) {
+        size_t sub_length = length + 1 + items[i].length;
+        if (sub_length >= size) {
+            continue; // Too deep to name; nothing below it can be listed either
+        }
+        path[length] = '/';
+        memcpy(path + length + 1, items[i].name, items[i].length + 1);
+        reply_append(reply, path, sub_length);
+
+        // Check if sorting option is "-t" (by time)
+        if (by_time) {
+            char timebuf[256];
+            strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", localtime(&items[i].ctime));
+            reply_append(reply, " - Created: ", 12);
+            reply_append(reply, timebuf, strlen(timebuf));
+        }
+        reply_append(reply, "\n", 1);
 
-             // Recursively list directories with the same sorting option
-            list_directories(client_socket, full_path, sort_option); // Recurse with the same sorting option
-            free(full_path); //free the memory allocated for full path
+        // Recursively list directories with the same sorting option
+        int sub_fd = open_subdirectory(dir_fd, items[i].name);
+        if (sub_fd == -1) {
+            perror("openat");
+        } else {
+            list_level(reply, sub_fd, path, sub_length, size, by_time);
         }
-        free(namelist[i]);
+        path[length] = '\0';
     }
-    free(namelist);
     closedir(dir);
+    arena_release(&request_arena, mark);
+}
+
+// Modified list_directories function
+void list_directories(int client_socket, const char *start_path, const char *sort_option) {
+    struct arena_mark mark = arena_mark(&request_arena);
+    struct reply_buffer reply = {client_socket, arena_alloc(&request_arena, REPLY_BUFFER_SIZE), 0};
+    char *path = arena_alloc(&request_arena, PATH_MAX);
+    size_t length = strlen(start_path);
+    int dir_fd = open(start_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) { //If the directory couldn't be opened or doesn't exist
+        perror("open");
+    } else if (length >= PATH_MAX) {
+        close(dir_fd);
+    } else {
+        memcpy(path, start_path, length + 1);
+        list_level(&reply, dir_fd, path, length, PATH_MAX, strcmp(sort_option, "-t") == 0);
+    }
+    reply_flush(&reply);
+    arena_release(&request_arena, mark);
 }
 
 
-// Modify the function to return an int
-int search_file_recursive(const char *dir_path, const char *filename, int client_socket) {
-     // Open the directory specified by dir_path
-    DIR *dir = opendir(dir_path);
-    if (dir == NULL) { //if directory couldn't be opened
-        perror("opendir"); //print error
+//Function to send the details of a file found by w24fn
+void send_found_file(const char *full_path, const char *filename, int client_socket) {
+    //Get the file details
+    struct stat file_stat;
+    if (stat(full_path, &file_stat) == -1) {
+        perror("stat");
+        metrics_send(client_socket, "Error: File not found\n", strlen("Error: File not found\n"), 0);
+    } else {
+
+        //Gather information about the file
+        char info_buffer[1024];
+        sprintf(info_buffer, "Filename: %s\nSize: %ld bytes\nCreated: %sPermissions: %o\n",
+                filename,
+                file_stat.st_size,
+                ctime(&file_stat.st_ctime),
+                file_stat.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+
+        //Send the gathered information to client
+        metrics_send(client_socket, info_buffer, strlen(info_buffer), 0);
+    }
+}
+
+//Function to search the open directory dir_fd (which it closes) for filename, in
+//directory order. path names it: length bytes in a buffer of size, extended in place
+//for each subdirectory; only a match is ever looked up by its full path. Unless
+//summary is NULL, subtrees whose summary (see bloom.h) rules filename out are
+//skipped, and every name below this directory is added to summary on the way, so
+//a subtree searched in vain is summarized for the next walk as of generation.
+int search_level(int dir_fd, char *path, size_t length, size_t size, const char *filename, int client_socket,
+                 struct bloom *summary, uint64_t generation) {
+    DIR *dir = fdopendir(dir_fd);
+    if (dir == NULL) { //if directory couldn't be read
+        perror("fdopendir"); //print error
+        close(dir_fd);
         return 0;  // Return 0 indicating file not found here
     }
 
     struct dirent *entry;
     while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (summary != NULL) {
+            bloom_add(summary, entry->d_name);
+        }
         // Check if the entry is a directory
         if (entry->d_type == DT_DIR) {
-            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-                char sub_dir_path[1024];
-                snprintf(sub_dir_path, sizeof(sub_dir_path), "%s/%s", dir_path, entry->d_name);
-                // Recursively search for the file in the subdirectory
-                if (search_file_recursive(sub_dir_path, filename, client_socket)) {
-                    // If file found in the subdirectory, close the directory and return 1 to stop recursion
-                    closedir(dir);
-                    return 1;  // Stop recursion when file is found
-                }
+            size_t name_length = strlen(entry->d_name);
+            if (length + 1 + name_length >= size) {
+                continue;
             }
+            path[length] = '/';
+            memcpy(path + length + 1, entry->d_name, name_length + 1);
+            struct bloom below;
+            if (summary != NULL && bloom_lookup(path, &below) && !bloom_may_contain(&below, filename)) {
+                // Nothing by that name below; its names still count for this directory
+                bloom_merge(summary, &below);
+                path[length] = '\0';
+                continue;
+            }
+            int sub_fd = open_subdirectory(dir_fd, entry->d_name);
+            if (sub_fd == -1) {
+                perror("openat");
+                path[length] = '\0';
+                continue;
+            }
+            memset(&below, 0, sizeof(below));
+            // Recursively search for the file in the subdirectory
+            int found = search_level(sub_fd, path, length + 1 + name_length, size, filename, client_socket,
+                                     summary != NULL ? &below : NULL, generation);
+            if (found) {
+                // If file found in the subdirectory, close the directory and return 1 to stop recursion
+                path[length] = '\0';
+                closedir(dir);
+                return 1;  // Stop recursion when file is found
+            }
+            if (summary != NULL) {
+                bloom_store(path, &below, generation);
+                bloom_merge(summary, &below);
+            }
+            path[length] = '\0';
         } else {
             // Check if the entry is a file and its name matches the desired filename
-            if (strcmp(entry->d_name, filename) == 0) {
-                char full_path[1024];
-                snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, filename);
-
-                //Get the file details
-                struct stat file_stat;
-                if (stat(full_path, &file_stat) == -1) {
-                    perror("stat");
-                    send(client_socket, "Error: File not found\n", strlen("Error: File not found\n"), 0);
-                } else {
-
-                    //Gather information about the file
-                    char info_buffer[1024];
-                    sprintf(info_buffer, "Filename: %s\nSize: %ld bytes\nCreated: %sPermissions: %o\n",
-                            filename,
-                            file_stat.st_size,
-                            ctime(&file_stat.st_ctime),
-                            file_stat.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
-
-                    //Send the gathered information to client
-                    send(client_socket, info_buffer, strlen(info_buffer), 0);
-                }
+            if (strcmp(entry->d_name, filename) == 0 && length + 1 + strlen(filename) < size) {
+                path[length] = '/';
+                strcpy(path + length + 1, filename);
+                send_found_file(path, filename, client_socket);
+                path[length] = '\0';
                 closedir(dir);
                 return 1;  // File found, stop further searching
             }
@@ -183,64 +323,671 @@ int search_file_recursive(const char *dir_path, const char *filename, int client
     return 0;  // Continue searching in other directories
 }
 
+// Modify the function to return an int
+int search_file_recursive(const char *dir_path, const char *filename, int client_socket) {
+    // One path buffer for the whole walk, extended and cut back at every level
+    struct arena_mark mark = arena_mark(&request_arena);
+    char *path = arena_alloc(&request_arena, PATH_MAX);
+    size_t length = strlen(dir_path);
+    int found = 0;
+    // Summaries are only used and kept while the tree watcher vouches for them
+    uint64_t generation = 0;
+    struct bloom summary;
+    memset(&summary, 0, sizeof(summary));
+    int summaries = bloom_generation(&generation) == 0;
+    int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) { //if directory couldn't be opened
+        perror("open");
+    } else if (length >= PATH_MAX) {
+        close(dir_fd);
+    } else {
+        memcpy(path, dir_path, length + 1);
+        found = search_level(dir_fd, path, length, PATH_MAX, filename, client_socket,
+                             summaries ? &summary : NULL, generation);
+        if (!found && summaries) {
+            bloom_store(path, &summary, generation);
+        }
+    }
+    arena_release(&request_arena, mark);
+    return found;
+}
+
 void send_file_info(const char *filename, int client_socket) {
-    // Print a message indicating the file being searched for
-    printf("Searching for file: %s\n", filename);
-    if (!search_file_recursive(get_home_directory(), filename, client_socket)) {
+    // Log the file being searched for
+    log_debug("Searching for file: %s", filename);
+    // The index answers without walking the tree whenever it is current
+    char full_path[4096];
+    int indexed = index_lookup_file(filename, full_path, sizeof(full_path));
+    if (indexed == 1) {
+        send_found_file(full_path, filename, client_socket);
+    } else if (indexed == 0) {
+        metrics_send(client_socket, "File not found\n", strlen("File not found\n"), 0);
+    } else if (!search_file_recursive(get_home_directory(), filename, client_socket)) {
         //If the file is not found, print appropriate message
-        send(client_socket, "File not found\n", strlen("File not found\n"), 0);
+        metrics_send(client_socket, "File not found\n", strlen("File not found\n"), 0);
+    }
+}
+
+//Function to add one w24fs match to the reply: its path, size and modification time
+void append_match(const char *path, const struct index_entry *entry, void *arg) {
+    struct reply_buffer *reply = arg;
+    time_t mtime = (time_t)(entry->mtime_ns / 1000000000);
+    struct tm tm;
+    char stamp[32], line[PATH_MAX + 96];
+    localtime_r(&mtime, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M", &tm);
+    int length = snprintf(line, sizeof(line), "%s  %lld bytes  %s\n", path, (long long)entry->size, stamp);
+    reply_append(reply, line, length < (int)sizeof(line) ? (size_t)length : sizeof(line) - 1);
+}
+
+//Function to add one w24fs match with the size and modification time it has now; the index
+//may be a refresh behind. A file gone since is listed as the index last saw it.
+void append_fresh_match(const char *path, const struct index_entry *entry, void *arg) {
+    struct stat st;
+    struct index_entry fresh = *entry;
+    if (lstat(path, &st) == 0) {
+        fresh.size = st.st_size;
+        fresh.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    }
+    append_match(path, &fresh, arg);
+}
+
+//Function to handle the w24fs command: files whose name contains a string, or matches
+//a glob (-g) or an extended regex (-r), found in the file index without walking the tree
+void handle_w24fs(int client_socket, char *buffer) {
+    char *pattern = buffer + 6;
+    pattern[strcspn(pattern, "\n")] = '\0';
+    enum index_pattern kind = INDEX_SUBSTRING;
+    if (strncmp(pattern, "-g ", 3) == 0 || strncmp(pattern, "-r ", 3) == 0) {
+        kind = pattern[1] == 'g' ? INDEX_GLOB : INDEX_REGEX;
+        pattern += 3;
+    }
+    struct arena_mark mark = arena_mark(&request_arena);
+    struct reply_buffer reply = {client_socket, arena_alloc(&request_arena, REPLY_BUFFER_SIZE), 0};
+    long matches = *pattern == '\0' ? -2 : index_search(kind, pattern, W24FS_MAX_MATCHES, append_fresh_match, &reply);
+    char note[128];
+    if (matches == -1) {
+        snprintf(note, sizeof(note), "The file index is not ready yet, try again shortly\n");
+    } else if (matches == -2) {
+        snprintf(note, sizeof(note), "Invalid pattern\n");
+    } else if (matches == 0) {
+        snprintf(note, sizeof(note), "No matching files\n");
+    } else if (matches > W24FS_MAX_MATCHES) {
+        snprintf(note, sizeof(note), "%ld matches, the first %d shown\n", matches, W24FS_MAX_MATCHES);
+    } else {
+        snprintf(note, sizeof(note), "%ld matches\n", matches);
+    }
+    reply_append(&reply, note, strlen(note));
+    reply_flush(&reply);
+    arena_release(&request_arena, mark);
+}
+
+// A w24du reply: the reply buffer and the asked directory as it is shown, "~" for the home directory
+struct usage_reply {
+    struct reply_buffer *reply;
+    const char *base;
+};
+
+//Function to add one directory's totals to a w24du reply; path is relative to the directory asked about
+void append_usage(const char *path, int depth, const struct index_rollup *rollup, void *arg) {
+    (void)depth; // The path already shows it
+    struct usage_reply *usage = arg;
+    char line[PATH_MAX + 96];
+    int length = snprintf(line, sizeof(line), "%s%s%s  %lld bytes  %llu files  %u dirs\n", usage->base,
+                          path[0] != '\0' ? "/" : "", path, (long long)rollup->bytes,
+                          (unsigned long long)rollup->files, rollup->dirs);
+    reply_append(usage->reply, line, length < (int)sizeof(line) ? (size_t)length : sizeof(line) - 1);
+}
+
+//Function to add up everything below the open directory dir_fd (which it closes) into total,
+//for w24du when the index is not current. Every directory down to depth levels below the one
+//asked about is added to the reply after those below it. path names it as in list_level;
+//its first shown bytes are the directory asked about. skip is the directory the index leaves out.
+void usage_level(struct usage_reply *usage, int dir_fd, char *path, size_t length, size_t size, size_t shown,
+                 int level, int depth, const struct stat *skip, struct index_rollup *total) {
+    DIR *dir = fdopendir(dir_fd);
+    if (dir == NULL) {
+        perror("fdopendir");
+        close(dir_fd);
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        // Counted as the index counts them: by lstat, everything but directories as files
+        struct stat st;
+        if (fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+            (st.st_dev == skip->st_dev && st.st_ino == skip->st_ino)) {
+            continue;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+            total->files++;
+            total->bytes += st.st_size;
+            continue;
+        }
+        size_t name_length = strlen(entry->d_name);
+        if (length + 1 + name_length >= size) {
+            continue; // Too deep to name
+        }
+        int sub_fd = open_subdirectory(dir_fd, entry->d_name);
+        if (sub_fd == -1) {
+            perror("openat");
+            continue;
+        }
+        path[length] = '/';
+        memcpy(path + length + 1, entry->d_name, name_length + 1);
+        struct index_rollup below = {0};
+        usage_level(usage, sub_fd, path, length + 1 + name_length, size, shown, level + 1, depth, skip, &below);
+        path[length] = '\0';
+        total->dirs += 1 + below.dirs;
+        total->files += below.files;
+        total->bytes += below.bytes;
+    }
+    closedir(dir);
+    if (level <= depth) {
+        append_usage(length > shown ? path + shown + 1 : "", level, total, usage);
+    }
+}
+
+//Function to handle w24du <depth> [directory]: the size, file count and directory count of
+//everything below the directory (relative to home; the home directory if none) and below each
+//directory down to depth levels under it. The totals come from the file index when it is current.
+void handle_w24du(int client_socket, char *buffer) {
+    char *args = buffer + 6;
+    args[strcspn(args, "\n")] = '\0';
+    char *depth_text = strtok(args, " ");
+    char *dir = strtok(NULL, " ");
+    if (dir != NULL && (strcmp(dir, "~") == 0 || strncmp(dir, "~/", 2) == 0)) {
+        dir += dir[1] == '/' ? 2 : 1;
     }
+    // Only plain names below home; the project directory is not part of the tree
+    int valid = depth_text != NULL && strspn(depth_text, "0123456789") == strlen(depth_text) &&
+                strlen(depth_text) <= 4 && strtok(NULL, " ") == NULL && (dir == NULL || dir[0] != '/');
+    for (const char *p = dir; valid && p != NULL && *p != '\0'; ) {
+        size_t length = strcspn(p, "/");
+        valid = !(length == 1 && p[0] == '.') && !(length == 2 && strncmp(p, "..", 2) == 0);
+        p += length + (p[length] == '/');
+    }
+    if (!valid) {
+        metrics_send(client_socket, "Invalid w24du request\n", strlen("Invalid w24du request\n"), 0);
+        return;
+    }
+    char relative[1024] = "";
+    if (dir != NULL) {
+        snprintf(relative, sizeof(relative), "%s", dir);
+        while (strlen(relative) > 0 && relative[strlen(relative) - 1] == '/') {
+            relative[strlen(relative) - 1] = '\0';
+        }
+    }
+    if (strcmp(relative, "w24project") == 0 || strncmp(relative, "w24project/", 11) == 0) {
+        metrics_send(client_socket, "No such directory\n", strlen("No such directory\n"), 0);
+        return;
+    }
+    int depth = atoi(depth_text);
+
+    struct arena_mark mark = arena_mark(&request_arena);
+    struct reply_buffer reply = {client_socket, arena_alloc(&request_arena, REPLY_BUFFER_SIZE), 0};
+    char base[1100];
+    snprintf(base, sizeof(base), "~%s%s", relative[0] != '\0' ? "/" : "", relative);
+    struct usage_reply usage = {&reply, base};
+    long reported = index_usage(relative, depth, append_usage, &usage);
+    if (reported == -1) {
+        // The tree has moved on since the last refresh; add it up directly
+        char *homeDir = get_home_directory();
+        char *path = arena_alloc(&request_arena, PATH_MAX);
+        char w24projectDir[1024];
+        snprintf(w24projectDir, sizeof(w24projectDir), "%s/w24project", homeDir);
+        struct stat skip, st;
+        if (lstat(w24projectDir, &skip) == -1) {
+            memset(&skip, 0, sizeof(skip));
+        }
+        size_t length = (size_t)snprintf(path, PATH_MAX, "%s%s%s", homeDir, relative[0] != '\0' ? "/" : "", relative);
+        int dir_fd = length < PATH_MAX && lstat(path, &st) == 0 && S_ISDIR(st.st_mode)
+                         ? open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) : -1;
+        reported = 0;
+        if (dir_fd != -1) {
+            struct index_rollup total = {0};
+            usage_level(&usage, dir_fd, path, length, PATH_MAX, length, 0, depth, &skip, &total);
+            reported = 1;
+        }
+    }
+    if (reported == 0) {
+        reply_append(&reply, "No such directory\n", strlen("No such directory\n"));
+    }
+    reply_flush(&reply);
+    arena_release(&request_arena, mark);
+}
+
+// A file kept by a w24top walk: its details as the index would have them, and its path
+struct top_file {
+    struct index_entry entry;
+    char path[];
+};
+
+//Function to offer every file below the open directory dir_fd (which it closes) to the w24top
+//heap, for when the index is not current. Only files that make it are copied out, so memory
+//stays at the heap's size. path names the directory as in list_level.
+void top_level(struct top *top, int dir_fd, char *path, size_t length, size_t size, enum index_order order,
+               const struct stat *skip) {
+    DIR *dir = fdopendir(dir_fd);
+    if (dir == NULL) {
+        perror("fdopendir");
+        close(dir_fd);
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        // The same files the index holds: by lstat, everything but directories
+        struct stat st;
+        if (fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+            (st.st_dev == skip->st_dev && st.st_ino == skip->st_ino)) {
+            continue;
+        }
+        size_t name_length = strlen(entry->d_name);
+        if (length + 1 + name_length >= size) {
+            continue; // Too deep to name
+        }
+        if (S_ISDIR(st.st_mode)) {
+            int sub_fd = open_subdirectory(dir_fd, entry->d_name);
+            if (sub_fd == -1) {
+                perror("openat");
+                continue;
+            }
+            path[length] = '/';
+            memcpy(path + length + 1, entry->d_name, name_length + 1);
+            top_level(top, sub_fd, path, length + 1 + name_length, size, order, skip);
+            path[length] = '\0';
+            continue;
+        }
+        int64_t mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        int64_t key = order == INDEX_BY_SIZE ? (int64_t)st.st_size : mtime_ns;
+        if (!top_admits(top, key)) {
+            continue;
+        }
+        struct top_file *file = malloc(sizeof(struct top_file) + length + 1 + name_length + 1);
+        if (file == NULL) {
+            continue;
+        }
+        memset(&file->entry, 0, sizeof(file->entry));
+        file->entry.mode = st.st_mode;
+        file->entry.size = st.st_size;
+        file->entry.mtime_ns = mtime_ns;
+        memcpy(file->path, path, length);
+        file->path[length] = '/';
+        memcpy(file->path + length + 1, entry->d_name, name_length + 1);
+        free(top_offer(top, key, file));
+    }
+    closedir(dir);
+}
+
+//Function to handle w24top [-t] <count>: the largest files, or with -t the most recently
+//modified, as w24fs lists them. The file index answers when it is current; otherwise one walk
+//of the tree keeps only the best so far, so memory follows count and not the size of the tree.
+void handle_w24top(int client_socket, char *buffer) {
+    char *args = buffer + 7;
+    args[strcspn(args, "\n")] = '\0';
+    enum index_order order = INDEX_BY_SIZE;
+    if (strncmp(args, "-t ", 3) == 0) {
+        order = INDEX_BY_MTIME;
+        args += 3;
+    }
+    long count = strspn(args, "0123456789") == strlen(args) && strlen(args) <= 5 ? atol(args) : 0;
+    if (count <= 0 || count > W24TOP_MAX) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Invalid count, give 1 to %d\n", W24TOP_MAX);
+        metrics_send(client_socket, msg, strlen(msg), 0);
+        return;
+    }
+    struct arena_mark mark = arena_mark(&request_arena);
+    struct reply_buffer reply = {client_socket, arena_alloc(&request_arena, REPLY_BUFFER_SIZE), 0};
+    long shown = index_top(order, count, append_match, &reply);
+    if (shown == -1) {
+        char *homeDir = get_home_directory();
+        char *path = arena_alloc(&request_arena, PATH_MAX);
+        char w24projectDir[1024];
+        snprintf(w24projectDir, sizeof(w24projectDir), "%s/w24project", homeDir);
+        struct stat skip;
+        if (lstat(w24projectDir, &skip) == -1) {
+            memset(&skip, 0, sizeof(skip));
+        }
+        struct top top;
+        size_t length = strlen(homeDir);
+        int dir_fd = length < PATH_MAX ? open(homeDir, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+        shown = 0;
+        if (dir_fd != -1 && top_init(&top, count) == -1) {
+            close(dir_fd);
+            dir_fd = -1;
+        }
+        if (dir_fd != -1) {
+            memcpy(path, homeDir, length + 1);
+            top_level(&top, dir_fd, path, length, PATH_MAX, order, &skip);
+            shown = (long)top_finish(&top);
+            for (long i = 0; i < shown; i++) {
+                struct top_file *file = top.items[i].value;
+                append_match(file->path, &file->entry, &reply);
+                free(file);
+            }
+            top_free(&top);
+        }
+    }
+    if (shown == 0) {
+        reply_append(&reply, "No files found\n", strlen("No files found\n"));
+    }
+    reply_flush(&reply);
+    arena_release(&request_arena, mark);
 }
 
 //Function for creating tar.gz file
 void create_tar_gz(const char *dirname, const char *tar_name, long size1, long size2) {
     char cmd[1024];
     snprintf(cmd, sizeof(cmd), "find %s -type f -size +%ldc -size -%ldc -print0 | tar -czvf %s --null -T -", dirname, size1, size2, tar_name);
-    printf("Command: %s\n", cmd); // Print the command being executed
+    log_debug("Command: %s", cmd); // Log the command being executed
     system(cmd);
 }
 
-//Function to send the contents of tar file to client using socket
-void send_tar_file(int client_socket, const char *tar_name) {
-    // Open the tar file
-    int tar_fd = open(tar_name, O_RDONLY);
-    if (tar_fd == -1) { //If tar file couldn't be opened
-        perror("open"); //Print appropriate error message
-        return;
+//Function to answer an archive command without an archive: a zero size, then the message and the end marker
+void send_archive_message(int client_socket, const char *msg) {
+    off_t no_archive = 0;
+    if (!prepare_only) { // w24prep replies are plain text
+        metrics_send(client_socket, &no_archive, sizeof(off_t), 0);
     }
+    metrics_send(client_socket, msg, strlen(msg), 0);
+    metrics_send(client_socket, "\nEND_OF_RESPONSE\n", strlen("\nEND_OF_RESPONSE\n"), 0);
+}
 
-    // Get the file size
+//Function to send a range of the tar file open at tar_fd, which it closes
+void send_open_tar_range(int client_socket, int tar_fd, off_t offset, off_t length) {
+    // Get the file size and clamp the range to it
     struct stat stat_buf;
     fstat(tar_fd, &stat_buf);
-    off_t file_size = stat_buf.st_size;
-
-    // Send the file size to the client
-    send(client_socket, &file_size, sizeof(off_t), 0);
-
-    // Send the file contents to the client
-    off_t offset = 0;
+    if (offset < 0 || offset > stat_buf.st_size) {
+        close(tar_fd);
+        send_archive_message(client_socket, "Invalid range.\n");
+        return;
+    }
+    if (length < 0 || length > stat_buf.st_size - offset) {
+        length = stat_buf.st_size - offset;
+    }
+    off_t file_size = offset + length;
+
+    // Send the range size to the client
+    metrics_send(client_socket, &length, sizeof(off_t), 0);
+
+    // Send the file contents to the client, within the bandwidth limits. Whatever was
+    // just sent is hashed from the page cache a block at a time, for the trailer.
+    uint64_t send_started = metrics_now_us();
+    unsigned char block[DIGEST_BLOCK];
+    struct digest digest;
+    digest_init(&digest);
+    off_t hashed = offset;
+    shape_bulk_begin(client_socket);
     while (offset < file_size) {
-        ssize_t sent_bytes = sendfile(client_socket, tar_fd, &offset, CHUNK_SIZE);
+        // A range may end before the file does, so never ask for more than is left of it
+        size_t want = shape_chunk(CHUNK_SIZE);
+        if ((off_t)want > file_size - offset) {
+            want = file_size - offset;
+        }
+        ssize_t sent_bytes = sendfile(client_socket, tar_fd, &offset, want);
         if (sent_bytes == -1) {
             perror("sendfile");
+            shape_bulk_end(client_socket);
             close(tar_fd);
             return;
         }
+        metrics_add_bytes_out(sent_bytes);
+        shape_sent(sent_bytes);
+        if (offset - hashed >= DIGEST_BLOCK || offset == file_size) {
+            digest_fd(&digest, tar_fd, hashed, offset - hashed, block, sizeof(block));
+            hashed = offset;
+        }
     }
+    shape_bulk_end(client_socket);
+    uint64_t trailer = digest_final(&digest);
+    metrics_send(client_socket, &trailer, sizeof(trailer), 0);
+    metrics_record_phase(PHASE_SEND, metrics_now_us() - send_started);
+    trace_span(TRACE_SEND, send_started);
 
     close(tar_fd);
 }
 
+//Function to send length bytes of a tar file starting at offset (length -1 means to the end),
+//followed by their XXH64 digest
+void send_tar_range(int client_socket, const char *tar_name, off_t offset, off_t length) {
+    // Open the tar file
+    int tar_fd = open(tar_name, O_RDONLY);
+    if (tar_fd == -1) { //If tar file couldn't be opened
+        perror("open"); //Print appropriate error message
+        send_archive_message(client_socket, "Failed to read tar file.\n");
+        return;
+    }
+    send_open_tar_range(client_socket, tar_fd, offset, length);
+}
+
+//Function to send the contents of tar file to client using socket
+void send_tar_file(int client_socket, const char *tar_name) {
+    send_tar_range(client_socket, tar_name, 0, -1);
+}
+
+//Function to get the spool directory shared by the server and its mirrors
+void get_spool_directory(char *spoolDir, size_t size) {
+    snprintf(spoolDir, size, "%s/w24project/spool", get_home_directory());
+}
+
+//Function to hand a finished archive to the client: sent directly, or for w24prep
+//moved into the spool and announced as "ARCHIVE <id> <size>" for ranged download
+void reply_with_archive(int client_socket, const char *tar_name) {
+    if (!prepare_only) {
+        send_tar_file(client_socket, tar_name);
+        unlink(tar_name); // Every request has its own temp file
+        return;
+    }
+    char spoolDir[1024];
+    get_spool_directory(spoolDir, sizeof(spoolDir));
+    archive_spool_sweep(spoolDir, SPOOL_MAX_AGE);
+
+    char id[64];
+    off_t size;
+    if (archive_spool_store(spoolDir, tar_name, id, sizeof(id), &size) == -1) {
+        send_archive_message(client_socket, "Failed to spool tar file.\n");
+        return;
+    }
+    char reply[128];
+    snprintf(reply, sizeof(reply), "ARCHIVE %s %lld", id, (long long)size);
+    send_archive_message(client_socket, reply);
+}
+
+//Function to handle w24range <id> <offset> <length>: one segment of a spooled archive
+void handle_w24range(int client_socket, char *buffer) {
+    char id[64], spoolDir[1024], path[1200];
+    long long offset, length;
+    get_spool_directory(spoolDir, sizeof(spoolDir));
+    if (sscanf(buffer, "w24range %63s %lld %lld", id, &offset, &length) != 3 ||
+        archive_spool_path(spoolDir, id, path, sizeof(path)) == -1) {
+        send_archive_message(client_socket, "Invalid range request.\n");
+        return;
+    }
+    send_tar_range(client_socket, path, offset, length);
+}
+
+//Function to handle w24done <id>: the client has every segment, drop the spooled archive
+void handle_w24done(int client_socket, char *buffer) {
+    char id[64], spoolDir[1024], path[1200];
+    get_spool_directory(spoolDir, sizeof(spoolDir));
+    if (sscanf(buffer, "w24done %63s", id) == 1 && archive_spool_path(spoolDir, id, path, sizeof(path)) == 0) {
+        unlink(path);
+    }
+    char *msg = "OK\nEND_OF_RESPONSE\n";
+    metrics_send(client_socket, msg, strlen(msg), 0);
+}
+
+//Function to start the result cache over the home directory. FILESNAP_CACHE_MB sets
+//its size cap (default 256); 0 turns it off.
+void start_result_cache(const char *server_name) {
+    const char *env = getenv("FILESNAP_CACHE_MB");
+    long megabytes = env != NULL ? atol(env) : 256;
+    char w24projectDir[1024], cacheDir[1200];
+    snprintf(w24projectDir, sizeof(w24projectDir), "%s/w24project", get_home_directory());
+    mkdir(w24projectDir, 0777);
+    // Each server has a directory of its own under cache/
+    snprintf(cacheDir, sizeof(cacheDir), "%s/cache", w24projectDir);
+    mkdir(cacheDir, 0777);
+    snprintf(cacheDir, sizeof(cacheDir), "%s/cache/%s", w24projectDir, server_name);
+    // The watcher started by the cache keeps the subtree summaries current
+    bloom_init(get_home_directory(), w24projectDir);
+    cache_init(cacheDir, get_home_directory(), w24projectDir, (off_t)megabytes * 1024 * 1024);
+}
+
+//Function to start keeping the file index; it relies on the tree watcher started with the cache
+void start_file_index(const char *server_name) {
+    char w24projectDir[1024], indexPath[1200];
+    snprintf(w24projectDir, sizeof(w24projectDir), "%s/w24project", get_home_directory());
+    snprintf(indexPath, sizeof(indexPath), "%s/%s.index", w24projectDir, server_name);
+    index_init(indexPath, get_home_directory(), w24projectDir);
+}
+
+//Function to wait for a slot in a lane; returns 0 after telling the client the server is too busy
+int enter_lane(int client_socket, enum lane lane) {
+    if (lane_enter(lane) == 0) {
+        return 1;
+    }
+    char msg[128];
+    admit_busy_message(msg, sizeof(msg));
+    metrics_request_shed();
+    if (lane == LANE_ARCHIVE) {
+        send_archive_message(client_socket, msg);
+    } else {
+        metrics_send(client_socket, msg, strlen(msg), 0);
+    }
+    return 0;
+}
+
+//Function to set up the metadata and archive lanes, shared with the mirrors
+void start_lanes(void) {
+    char tablePath[1100];
+    snprintf(tablePath, sizeof(tablePath), "%s/w24project/lanes", get_home_directory());
+    lane_init(tablePath);
+}
+
+//Function to answer an archive query from the result cache; returns 1 if it did.
+//An empty key means the cache is off for this request.
+int reply_from_cache(int client_socket, const char *key, const char *tarFilename) {
+    char cached[1200];
+    if (key[0] == '\0') {
+        return 0;
+    }
+    // The entry can be evicted right after the lookup; then it is built again like a miss
+    int hit = cache_lookup(key, cached, sizeof(cached));
+    int tar_fd = -1;
+    if (hit && prepare_only) {
+        // The spool takes its file by rename, so hand it a link of its own
+        unlink(tarFilename);
+        hit = link(cached, tarFilename) == 0;
+    } else if (hit) {
+        // Once open, the file stays readable even if it is evicted
+        tar_fd = open(cached, O_RDONLY);
+        hit = tar_fd != -1;
+    }
+    metrics_cache_result(hit);
+    if (!hit) {
+        return 0;
+    }
+    if (prepare_only) {
+        reply_with_archive(client_socket, tarFilename);
+    } else {
+        send_open_tar_range(client_socket, tar_fd, 0, -1);
+    }
+    return 1;
+}
+
+//Function to look up the cache key of a normalized query; empty if the cache is off
+void query_cache_key(const char *query, char *key, size_t size) {
+    if (cache_key(query, key, size) == -1) {
+        key[0] = '\0';
+    }
+}
+
+//Function to collect the files found by findCmd into an archive and send it. Identical
+//queries running at the same time share one build: the first leads, the others stream
+//its output to their clients while it is being written (see flight.h).
+void produce_archive(int client_socket, const char *query, const char *key, const char *findCmd,
+                     const char *listFilename, const char *tarFilename) {
+    struct flight flight;
+    enum flight_role role = FLIGHT_NONE;
+    // w24prep needs the whole archive in the spool, so it is never coalesced
+    if (query[0] != '\0' && !prepare_only) {
+        char flightDir[1100];
+        snprintf(flightDir, sizeof(flightDir), "%s/w24project/flight", get_home_directory());
+        role = flight_join(flightDir, query, &flight);
+    }
+    if (role == FLIGHT_FOLLOWER) {
+        int sent = flight_follow(client_socket, &flight);
+        close(flight.fd);
+        if (sent != 0) {
+            return;
+        }
+        role = FLIGHT_NONE; // The leader failed before sending anything; build it here
+    }
+
+    // Walking and compressing is the heavy part; it runs in the archive lane
+    if (!enter_lane(client_socket, LANE_ARCHIVE)) {
+        if (role == FLIGHT_LEADER) {
+            flight_abandon(&flight);
+        }
+        return;
+    }
+    long found = archive_collect(findCmd, listFilename);
+    if (found <= 0) {
+        lane_leave();
+        if (role == FLIGHT_LEADER) {
+            flight_abandon(&flight);
+        }
+        unlink(listFilename);
+        send_archive_message(client_socket, found < 0 ? "Failed to create tar file.\n" : "No file found");
+        return;
+    }
+
+    if (role == FLIGHT_LEADER) {
+        if (flight_lead(client_socket, &flight, listFilename, key) == 0) {
+            send_archive_message(client_socket, "Failed to create tar file.\n");
+        }
+        lane_leave(); // Normally the builder gave the slot back already
+        unlink(listFilename);
+        return;
+    }
+
+    int status = archive_create(listFilename, tarFilename);
+    lane_leave();
+    unlink(listFilename);
+    if (status == -1) {
+        perror("Failed to create tar file");
+        send_archive_message(client_socket, "Failed to create tar file.\n");
+        unlink(tarFilename);
+        return;
+    }
+    // Keep the tar file for repeats and send it
+    if (key[0] != '\0') {
+        cache_store(key, tarFilename);
+    }
+    reply_with_archive(client_socket, tarFilename);
+}
+
 //Function to handle the w24fz command
 void handle_w24fz(int client_socket, char *buffer) {
+    uint64_t parse_started = metrics_now_us();
     int size1, size2;
     sscanf(buffer, "w24fz %d %d\n", &size1, &size2);
+    trace_span(TRACE_PARSE, parse_started);
 
     // Validate size range
     if (size1 < 0 || size2 < 0 || size1 > size2) { 
         //If size range is invalid, print appropriate message in client 
         char *msg = "Invalid size range provided.\n";
-        send(client_socket, msg, strlen(msg), 0);
+        send_archive_message(client_socket, msg);
         return;
     }
 
@@ -249,36 +996,25 @@ void handle_w24fz(int client_socket, char *buffer) {
     snprintf(w24projectDir, sizeof(w24projectDir), "%s/w24project", homeDir);
     mkdir(w24projectDir, 0777); // Ensure the w24project directory exists, if not create it
 
-    // Prepare the tar command
+    // Prepare the tar and file list names
     char tarFilename[1024];
-    snprintf(tarFilename, sizeof(tarFilename), "%s/temp.tar.gz", w24projectDir);
+    snprintf(tarFilename, sizeof(tarFilename), "%s/temp.%d.tar.gz", w24projectDir, (int)getpid());
+    char listFilename[1024];
+    snprintf(listFilename, sizeof(listFilename), "%s/temp.%d.list", w24projectDir, (int)getpid());
     char cmd[2048];
 
-    // Updated find command to exclude directories explicitly
-    snprintf(cmd, sizeof(cmd), "find %s -type d -name \".*\" -prune -o -type f -size +%ldc -size -%ldc ! -name \".*\" -print0 | tar -czvf %s --null -T -", homeDir, size1, size2, tarFilename);
-
-    // Execute the command to create the tar file
-    if (system(cmd) == -1) {
-        perror("Failed to create tar file");
-        char *error_msg = "Failed to create tar file.\n";
-        send(client_socket, error_msg, strlen(error_msg), 0);
+    // Serve a repeated query from the cache
+    char query[64], key[64];
+    snprintf(query, sizeof(query), "w24fz %d %d", size1, size2);
+    query_cache_key(query, key, sizeof(key));
+    if (reply_from_cache(client_socket, key, tarFilename)) {
         return;
     }
 
-    // Check if the tar file is effectively empty
-    struct stat statBuf;
-    if (stat(tarFilename, &statBuf) == -1 || statBuf.st_size <= 1) { // Check for minimal size to assume emptiness
-        char *msg = "No file found";
-        send(client_socket, msg, strlen(msg), 0);
-        // Cleanup: Remove the potentially empty tar file
-        unlink(tarFilename);
-    } else {
-        // If the tar file contains data, send it to the client
-        send_tar_file(client_socket, tarFilename);
-        char *msg = "Tar file received.\n";
-        send(client_socket, msg, strlen(msg), 0);
-        
-    }
+    // Updated find command to exclude directories explicitly, and the server's own files
+    snprintf(cmd, sizeof(cmd), "find %s -path '%s' -prune -o -type d -name \".*\" -prune -o -type f -size +%dc -size -%dc ! -name \".*\" -print0", homeDir, w24projectDir, size1, size2);
+
+    produce_archive(client_socket, query, key, cmd, listFilename, tarFilename);
 }
 
 //Function to handle w24ft command
@@ -289,16 +1025,23 @@ void handle_w24ft(int client_socket, char *buffer) {
     char *homeDir = get_home_directory();  // Ensure this function correctly fetches the home directory
     char w24projectDir[1024];
     char tarFilename[1024];
+    char listFilename[1024];
 
     // Ensure the directory exists and prepare the tar file path
     snprintf(w24projectDir, sizeof(w24projectDir), "%s/w24project", homeDir);
     mkdir(w24projectDir, 0777); //If "w24project" doesn't exist, create one
-    snprintf(tarFilename, sizeof(tarFilename), "%s/temp.tar.gz", w24projectDir);//file name for tar
+    snprintf(tarFilename, sizeof(tarFilename), "%s/temp.%d.tar.gz", w24projectDir, (int)getpid());//file name for tar
+    snprintf(listFilename, sizeof(listFilename), "%s/temp.%d.list", w24projectDir, (int)getpid());
 
+uint64_t parse_started = metrics_now_us();
 // Assume buffer, findCmd, and findCmdPart are adequately sized and initialized
 char *token = strtok(buffer + 6, " \n");  // Skip "w24ft " and consider newline
 int extCount = 0;
+char *extensions[64];
 while (token != NULL) {
+    if (extCount < 64) {
+        extensions[extCount] = token;
+    }
     if (extCount == 0) {
         snprintf(findCmdPart, sizeof(findCmdPart), "\\( -name '*.%s'", token);
     } else {
@@ -310,16 +1053,34 @@ while (token != NULL) {
 if (extCount > 0) {
     strncat(findCmdPart, " \\)", sizeof(findCmdPart) - strlen(findCmdPart) - 1);  // Close the grouping
 }
+trace_span(TRACE_PARSE, parse_started);
+
+    // The same extensions in any order or repeated give the same archive
+    char query[1100] = "", key[64] = "";
+    if (extCount <= 64) {
+        strcpy(query, "w24ft");
+        qsort(extensions, extCount, sizeof(char *), compare_exact);
+        for (int i = 0; i < extCount; i++) {
+            if (i == 0 || strcmp(extensions[i], extensions[i - 1]) != 0) {
+                snprintf(query + strlen(query), sizeof(query) - strlen(query), " %s", extensions[i]);
+            }
+        }
+        query_cache_key(query, key, sizeof(key));
+    }
+    if (reply_from_cache(client_socket, key, tarFilename)) {
+        return;
+    }
 
 // Construct the find command to check for files existence
 // Exclude directories starting with '.' and their contents
-snprintf(findCmd, sizeof(findCmd), "find %s -path '*/.*' -prune -o -type f %s -print", homeDir, findCmdPart);
+snprintf(findCmd, sizeof(findCmd), "find %s -path '%s' -prune -o -path '*/.*' -prune -o -type f %s -print", homeDir, w24projectDir, findCmdPart);
 
     // Use popen to execute find command and check for output
+    uint64_t walk_started = metrics_now_us();
     FILE *fp = popen(findCmd, "r");
     if (fp == NULL) {
         char *errorMsg = "Failed to execute file search.\n";
-        send(client_socket, errorMsg, strlen(errorMsg), 0);
+        send_archive_message(client_socket, errorMsg);
         return;
     }
 
@@ -327,233 +1088,626 @@ snprintf(findCmd, sizeof(findCmd), "find %s -path '*/.*' -prune -o -type f %s -p
     char tempBuf[128];
     if (fgets(tempBuf, sizeof(tempBuf), fp) == NULL) {
         pclose(fp);
+        metrics_record_phase(PHASE_WALK, metrics_now_us() - walk_started);
+        trace_span(TRACE_WALK, walk_started);
         char *msg = "No files found matching the specified extensions.";
-        send(client_socket, msg, strlen(msg), 0);
+        send_archive_message(client_socket, msg);
         return;
     }
     pclose(fp);
+    metrics_record_phase(PHASE_WALK, metrics_now_us() - walk_started);
+    trace_span(TRACE_WALK, walk_started);
 
-    // Files found, proceed with tar command
-    snprintf(tarCmd, sizeof(tarCmd), "tar -czvf %s --files-from /dev/null", tarFilename); // Initialize tar with no files
-    system(tarCmd); // Create an empty tar file first to avoid "No files found" error from tar
-    snprintf(tarCmd, sizeof(tarCmd), "find %s -type f %s -print0 | tar -czvf %s --null -T -", homeDir, findCmdPart, tarFilename);
+    // Files found, collect the full list and archive it
+    snprintf(tarCmd, sizeof(tarCmd), "find %s -path '%s' -prune -o -type f %s -print0", homeDir, w24projectDir, findCmdPart);
 
-    // Execute the tar command
-    if (system(tarCmd) != 0) {
-        char *errorMsg = "Failed to create tar file.\n";
-        send(client_socket, errorMsg, strlen(errorMsg), 0);
-        return;
-    }
-
-    // Send the tar file
-    send_tar_file(client_socket, tarFilename);
+    produce_archive(client_socket, query, key, tarCmd, listFilename, tarFilename);
 }
 
 //Function for handling w24fdb command
 void handle_w24fdb(int client_socket, char *buffer) {
+    uint64_t parse_started = metrics_now_us();
     char *date = buffer + 7; // Skip past "w24fdb " to start of date
     date[strcspn(date, "\n")] = 0; // Remove newline character at the end
+    trace_span(TRACE_PARSE, parse_started);
 
     char findCmd[2048];
     char tarFilename[1024];
+    char listFilename[1024];
     char *homeDir = get_home_directory(); // Implement this function as needed
     char w24projectDir[1024];
 
     // Ensure the directory exists and prepare the tar file path
     snprintf(w24projectDir, sizeof(w24projectDir), "%s/w24project", homeDir);
     mkdir(w24projectDir, 0777);
-    snprintf(tarFilename, sizeof(tarFilename), "%s/temp.tar.gz", w24projectDir);
+    snprintf(tarFilename, sizeof(tarFilename), "%s/temp.%d.tar.gz", w24projectDir, (int)getpid());
+    snprintf(listFilename, sizeof(listFilename), "%s/temp.%d.list", w24projectDir, (int)getpid());
+
+    // Serve a repeated query from the cache
+    char query[1100], key[64];
+    snprintf(query, sizeof(query), "w24fdb %s", date);
+    query_cache_key(query, key, sizeof(key));
+    if (reply_from_cache(client_socket, key, tarFilename)) {
+        return;
+    }
 
     // Construct the find command to list files created on or before the provided date
-    snprintf(findCmd, sizeof(findCmd), "find %s -type f ! -newermt '%s' -print0", homeDir, date);
+    snprintf(findCmd, sizeof(findCmd), "find %s -path '%s' -prune -o -type f ! -newermt '%s' -print0", homeDir, w24projectDir, date);
 
     // Use popen to execute find command and check for output
+    uint64_t walk_started = metrics_now_us();
     FILE *fp = popen(findCmd, "r");
     if (fp == NULL) {
         char *errorMsg = "Failed to search for files.\n";
-        send(client_socket, errorMsg, strlen(errorMsg), 0);
+        send_archive_message(client_socket, errorMsg);
         return;
     }
 
     char tempBuf[128];
     if (fgets(tempBuf, sizeof(tempBuf), fp) == NULL) {
         pclose(fp);
+        metrics_record_phase(PHASE_WALK, metrics_now_us() - walk_started);
+        trace_span(TRACE_WALK, walk_started);
         char *msg = "No files found created on or before the specified date.";
-        send(client_socket, msg, strlen(msg), 0);
+        send_archive_message(client_socket, msg);
         return;
     }
     pclose(fp);
+    metrics_record_phase(PHASE_WALK, metrics_now_us() - walk_started);
+    trace_span(TRACE_WALK, walk_started);
 
     // Files found, proceed with creating the tar file
-    snprintf(findCmd, sizeof(findCmd), "find %s -type f ! -newermt '%s' -print0 | tar -czvf %s --null -T -", homeDir, date, tarFilename);
-    // Execute the command to create the tar file
-    if (system(findCmd) == -1) {
-        perror("Failed to create tar file");
-        char *error_msg = "Failed to create tar file.\n";
-        send(client_socket, error_msg, strlen(error_msg), 0);
-        return;
-    }
-
-    // Check if the tar file is effectively empty
-    struct stat statBuf;
-    if (stat(tarFilename, &statBuf) == -1 || statBuf.st_size <= 1) { // Check for minimal size to assume emptiness
-        char *msg = "No file found";
-        send(client_socket, msg, strlen(msg), 0);
-        // Cleanup: Remove the potentially empty tar file
-        unlink(tarFilename);
-    } else {
-        // If the tar file contains data, send it to the client
-        send_tar_file(client_socket, tarFilename);
-        char *msg = "Tar file received.\n";
-        send(client_socket, msg, strlen(msg), 0);
-        
-    }
+    snprintf(findCmd, sizeof(findCmd), "find %s -path '%s' -prune -o -type f ! -newermt '%s' -print0", homeDir, w24projectDir, date);
+    produce_archive(client_socket, query, key, findCmd, listFilename, tarFilename);
 }
 
 //Function for w24fda command
 void handle_w24fda(int client_socket, char *buffer) {
+    uint64_t parse_started = metrics_now_us();
     char *date = buffer + 7; // Skip past "w24fda " to start of date
     date[strcspn(date, "\n")] = 0; // Remove newline character at the end
+    trace_span(TRACE_PARSE, parse_started);
 
     char findCmd[2048];
     char tarFilename[1024];
+    char listFilename[1024];
     char *homeDir = get_home_directory(); // Implement this function as needed
     char w24projectDir[1024];
 
     snprintf(w24projectDir, sizeof(w24projectDir), "%s/w24project", homeDir);
     mkdir(w24projectDir, 0777);
-    snprintf(tarFilename, sizeof(tarFilename), "%s/temp.tar.gz", w24projectDir);
+    snprintf(tarFilename, sizeof(tarFilename), "%s/temp.%d.tar.gz", w24projectDir, (int)getpid());
+    snprintf(listFilename, sizeof(listFilename), "%s/temp.%d.list", w24projectDir, (int)getpid());
+
+    // Serve a repeated query from the cache
+    char query[1100], key[64];
+    snprintf(query, sizeof(query), "w24fda %s", date);
+    query_cache_key(query, key, sizeof(key));
+    if (reply_from_cache(client_socket, key, tarFilename)) {
+        return;
+    }
 
-snprintf(findCmd, sizeof(findCmd), "find %s -path '*/.*' -prune -o -type f ! -name '.*' -newermt '%s' -print0", homeDir, date);
+snprintf(findCmd, sizeof(findCmd), "find %s -path '%s' -prune -o -path '*/.*' -prune -o -type f ! -name '.*' -newermt '%s' -print0", homeDir, w24projectDir, date);
 
+    uint64_t walk_started = metrics_now_us();
     FILE *fp = popen(findCmd, "r");
     if (fp == NULL) {
         char *errorMsg = "Failed to search for files.\n";
-        send(client_socket, errorMsg, strlen(errorMsg), 0);
+        send_archive_message(client_socket, errorMsg);
         return;
     }
 
     char tempBuf[128];
     if (fgets(tempBuf, sizeof(tempBuf), fp) == NULL) {
         pclose(fp);
+        metrics_record_phase(PHASE_WALK, metrics_now_us() - walk_started);
+        trace_span(TRACE_WALK, walk_started);
         char *msg = "No files found created on or after the specified date.";
-        send(client_socket, msg, strlen(msg), 0);
+        send_archive_message(client_socket, msg);
         return;
     }
     pclose(fp);
+    metrics_record_phase(PHASE_WALK, metrics_now_us() - walk_started);
+    trace_span(TRACE_WALK, walk_started);
 
-    snprintf(findCmd, sizeof(findCmd), "find %s -type f -newermt '%s' -print0 | tar -czvf %s --null -T -", homeDir, date, tarFilename);
-    // Execute the command to create the tar file
-    if (system(findCmd) == -1) {
-        perror("Failed to create tar file");
-        char *error_msg = "Failed to create tar file.\n";
-        send(client_socket, error_msg, strlen(error_msg), 0);
+    snprintf(findCmd, sizeof(findCmd), "find %s -path '%s' -prune -o -type f -newermt '%s' -print0", homeDir, w24projectDir, date);
+    produce_archive(client_socket, query, key, findCmd, listFilename, tarFilename);
+}
+//end of w24da
+
+//Function to build the find command for the files a w24fc search reads: every file, or
+//those the w24fz, w24ft, w24fdb or w24fda predicate in words selects. Returns -1 if the
+//predicate is not valid.
+int content_find_command(char *words, char *cmd, size_t size) {
+    char *homeDir = get_home_directory();
+    char w24projectDir[1024], part[1024] = "";
+    snprintf(w24projectDir, sizeof(w24projectDir), "%s/w24project", homeDir);
+    char *name = words != NULL ? strtok(words, " ") : NULL;
+    if (name == NULL) {
+        // Every file, as the other commands see the tree
+    } else if (strcmp(name, "w24fz") == 0) {
+        char *low = strtok(NULL, " "), *high = strtok(NULL, " ");
+        if (low == NULL || high == NULL || strspn(low, "0123456789") != strlen(low) ||
+            strspn(high, "0123456789") != strlen(high) || atol(low) > atol(high)) {
+            return -1;
+        }
+        snprintf(part, sizeof(part), "-size +%ldc -size -%ldc", atol(low), atol(high));
+    } else if (strcmp(name, "w24ft") == 0) {
+        char *ext;
+        while ((ext = strtok(NULL, " ")) != NULL) {
+            if (strchr(ext, '\'') != NULL) {
+                return -1;
+            }
+            snprintf(part + strlen(part), sizeof(part) - strlen(part), "%s -name '*.%s'",
+                     part[0] == '\0' ? "\\(" : " -o", ext);
+        }
+        if (part[0] == '\0') {
+            return -1;
+        }
+        strncat(part, " \\)", sizeof(part) - strlen(part) - 1);
+    } else if (strcmp(name, "w24fdb") == 0 || strcmp(name, "w24fda") == 0) {
+        char *date = strtok(NULL, " ");
+        if (date == NULL || strchr(date, '\'') != NULL) {
+            return -1;
+        }
+        snprintf(part, sizeof(part), "%s-newermt '%s'", name[5] == 'b' ? "! " : "", date);
+    } else {
+        return -1;
+    }
+    snprintf(cmd, size, "find %s -path '%s' -prune -o -path '*/.*' -prune -o -type f %s -print0",
+             homeDir, w24projectDir, part);
+    return 0;
+}
+
+//Function to answer w24fc with a message: text, or framed as an archive reply for -a
+void send_content_message(int client_socket, int archive, const char *msg) {
+    if (archive) {
+        send_archive_message(client_socket, msg);
         return;
     }
+    metrics_send(client_socket, msg, strlen(msg), 0);
+    metrics_send(client_socket, "\nEND_OF_RESPONSE\n", strlen("\nEND_OF_RESPONSE\n"), 0);
+}
 
-    // Check if the tar file is effectively empty
-    struct stat statBuf;
-    if (stat(tarFilename, &statBuf) == -1 || statBuf.st_size <= 1) { // Check for minimal size to assume emptiness
-        char *msg = "No file found";
-        send(client_socket, msg, strlen(msg), 0);
-        // Cleanup: Remove the potentially empty tar file
-        unlink(tarFilename);
+//Function to handle w24fc [-a] <text>[|<text>...] [predicate]: the files that contain any
+//of the texts, among all files or those a w24fz, w24ft, w24fdb or w24fda predicate selects.
+//The reply lists their paths, or with -a is an archive of just those files.
+void handle_w24fc(int client_socket, char *buffer) {
+    uint64_t parse_started = metrics_now_us();
+    char *args = buffer + 6;
+    args[strcspn(args, "\n")] = '\0';
+    int archive = strncmp(args, "-a ", 3) == 0;
+    if (archive) {
+        args += 3;
+    }
+    char query[1100];
+    snprintf(query, sizeof(query), "w24fc %s", args);
+
+    const char *patterns[CONTENT_MAX_PATTERNS];
+    int pattern_count = 0, valid = 1;
+    char *texts = strtok(args, " ");
+    char *predicate = strtok(NULL, "");
+    for (char *text = texts; text != NULL && valid; ) {
+        char *bar = strchr(text, '|');
+        if (bar != NULL) {
+            *bar = '\0';
+        }
+        valid = *text != '\0' && pattern_count < CONTENT_MAX_PATTERNS;
+        if (!valid) {
+            break; // An empty text, or one more than patterns can hold
+        }
+        patterns[pattern_count++] = text;
+        text = bar != NULL ? bar + 1 : NULL;
+    }
+    char findCmd[2048];
+    if (texts == NULL || !valid || content_find_command(predicate, findCmd, sizeof(findCmd)) == -1) {
+        send_content_message(client_socket, archive, "Invalid content search.\n");
+        return;
+    }
+    trace_span(TRACE_PARSE, parse_started);
+
+    char w24projectDir[1024], tarFilename[1024], listFilename[1024];
+    snprintf(w24projectDir, sizeof(w24projectDir), "%s/w24project", get_home_directory());
+    mkdir(w24projectDir, 0777);
+    snprintf(tarFilename, sizeof(tarFilename), "%s/temp.%d.tar.gz", w24projectDir, (int)getpid());
+    snprintf(listFilename, sizeof(listFilename), "%s/temp.%d.list", w24projectDir, (int)getpid());
+
+    // An archive of matches is cached like any other: contents changing moves the generation
+    char key[64] = "";
+    if (archive) {
+        query_cache_key(query, key, sizeof(key));
+        if (reply_from_cache(client_socket, key, tarFilename)) {
+            return;
+        }
+    }
+
+    // Reading every candidate file is as heavy as an archive, so it runs in the archive lane
+    if (archive ? !enter_lane(client_socket, LANE_ARCHIVE) : lane_enter(LANE_ARCHIVE) == -1) {
+        if (!archive) {
+            char msg[128];
+            admit_busy_message(msg, sizeof(msg));
+            metrics_request_shed();
+            send_content_message(client_socket, 0, msg);
+        }
+        return;
+    }
+    char *data = NULL, **paths = NULL;
+    unsigned char *matched = NULL;
+    long count = archive_collect(findCmd, listFilename);
+    if (count > 0) {
+        count = archive_load_list(listFilename, &data, &paths);
+    }
+    long hits = count;
+    if (count > 0) {
+        uint64_t scan_started = metrics_now_us();
+        matched = malloc(count);
+        hits = matched != NULL ? content_search(paths, count, patterns, pattern_count, matched) : -1;
+        trace_span(TRACE_FILTER, scan_started);
+    }
+
+    if (hits <= 0) {
+        lane_leave();
+        send_content_message(client_socket, archive, hits < 0 ? "Failed to search files.\n" : "No matching files.\n");
+    } else if (archive) {
+        int status = archive_save_list(listFilename, paths, count, matched);
+        if (status == 0) {
+            status = archive_create(listFilename, tarFilename);
+        }
+        lane_leave();
+        if (status == -1) {
+            send_archive_message(client_socket, "Failed to create tar file.\n");
+            unlink(tarFilename);
+        } else {
+            if (key[0] != '\0') {
+                cache_store(key, tarFilename);
+            }
+            reply_with_archive(client_socket, tarFilename);
+        }
     } else {
-        // If the tar file contains data, send it to the client
-        send_tar_file(client_socket, tarFilename);
-        char *msg = "Tar file received.\n";
-        send(client_socket, msg, strlen(msg), 0);
-        
+        lane_leave();
+        struct arena_mark mark = arena_mark(&request_arena);
+        struct reply_buffer reply = {client_socket, arena_alloc(&request_arena, REPLY_BUFFER_SIZE), 0};
+        for (long i = 0; i < count; i++) {
+            if (matched[i]) {
+                reply_append(&reply, paths[i], strlen(paths[i]));
+                reply_append(&reply, "\n", 1);
+            }
+        }
+        char note[128];
+        snprintf(note, sizeof(note), "%ld of %ld files match\n", hits, count);
+        reply_append(&reply, note, strlen(note));
+        reply_flush(&reply);
+        arena_release(&request_arena, mark);
+        metrics_send(client_socket, "\nEND_OF_RESPONSE\n", strlen("\nEND_OF_RESPONSE\n"), 0);
     }
+    unlink(listFilename);
+    free(matched);
+    free(paths);
+    free(data);
+}
+
+//Function to handle w24sum [predicate]: the XXH64 digest and size of every file, or of those
+//a w24fz, w24ft, w24fdb or w24fda predicate selects, hashed in parallel. Paths are relative
+//to the home directory and sorted, and the last line digests the whole listing, so the
+//replies of two servers holding the same files are identical.
+void handle_w24sum(int client_socket, char *buffer) {
+    uint64_t parse_started = metrics_now_us();
+    char *args = buffer + 6;
+    args[strcspn(args, "\n")] = '\0';
+    char findCmd[2048];
+    if (content_find_command(*args != '\0' ? args + strspn(args, " ") : NULL, findCmd, sizeof(findCmd)) == -1) {
+        send_content_message(client_socket, 0, "Invalid checksum request.\n");
+        return;
+    }
+    trace_span(TRACE_PARSE, parse_started);
+
+    char w24projectDir[1024], listFilename[1024];
+    snprintf(w24projectDir, sizeof(w24projectDir), "%s/w24project", get_home_directory());
+    mkdir(w24projectDir, 0777);
+    snprintf(listFilename, sizeof(listFilename), "%s/temp.%d.list", w24projectDir, (int)getpid());
+
+    // Hashing reads every file, as heavy as an archive, so it runs in the archive lane
+    if (lane_enter(LANE_ARCHIVE) == -1) {
+        char msg[128];
+        admit_busy_message(msg, sizeof(msg));
+        metrics_request_shed();
+        send_content_message(client_socket, 0, msg);
+        return;
+    }
+    uint64_t filter_started = metrics_now_us();
+    char *data = NULL, **paths = NULL;
+    uint64_t *digests = NULL;
+    off_t *sizes = NULL;
+    long count = archive_collect(findCmd, listFilename);
+    if (count > 0) {
+        count = archive_load_list(listFilename, &data, &paths);
+    }
+    unlink(listFilename);
+    trace_span(TRACE_FILTER, filter_started);
+    if (count > 0) {
+        uint64_t hash_started = metrics_now_us();
+        qsort(paths, count, sizeof(char *), compare_exact);
+        digests = malloc(count * sizeof(uint64_t));
+        sizes = malloc(count * sizeof(off_t));
+        if (digests == NULL || sizes == NULL) {
+            count = -1;
+        } else {
+            content_checksum(paths, count, digests, sizes);
+        }
+        trace_span(TRACE_HASH, hash_started);
+    }
+    lane_leave();
+
+    if (count <= 0) {
+        send_content_message(client_socket, 0, count < 0 ? "Failed to checksum files.\n" : "No files found.\n");
+    } else {
+        size_t home_length = strlen(get_home_directory()) + 1;
+        long long total = 0;
+        struct digest listing;
+        digest_init(&listing);
+        struct arena_mark mark = arena_mark(&request_arena);
+        struct reply_buffer reply = {client_socket, arena_alloc(&request_arena, REPLY_BUFFER_SIZE), 0};
+        for (long i = 0; i < count; i++) {
+            char line[PATH_MAX + 64];
+            const char *path = strlen(paths[i]) > home_length ? paths[i] + home_length : paths[i];
+            int length = sizes[i] < 0 ? snprintf(line, sizeof(line), "%-16s  -  %s\n", "unreadable", path)
+                                      : snprintf(line, sizeof(line), "%016llx  %lld  %s\n",
+                                                 (unsigned long long)digests[i], (long long)sizes[i], path);
+            if (length >= (int)sizeof(line)) {
+                length = sizeof(line) - 1;
+            }
+            digest_update(&listing, line, length);
+            reply_append(&reply, line, length);
+            total += sizes[i] > 0 ? sizes[i] : 0;
+        }
+        char note[128];
+        snprintf(note, sizeof(note), "%ld files, %lld bytes, listing %016llx\n", count, total,
+                 (unsigned long long)digest_final(&listing));
+        reply_append(&reply, note, strlen(note));
+        reply_flush(&reply);
+        arena_release(&request_arena, mark);
+        metrics_send(client_socket, "\nEND_OF_RESPONSE\n", strlen("\nEND_OF_RESPONSE\n"), 0);
+    }
+    free(sizes);
+    free(digests);
+    free(paths);
+    free(data);
+}
+
+//Function to read one newline-terminated command; clients may pipeline several
+//commands in one write, so whatever follows the newline is kept for the next call
+int read_command(int client_socket, char *buffer, int size) {
+    static char pending[4096];
+    static int pending_len = 0;
+    char *newline;
+    // Read until a whole line is buffered, or the line is too long for buffer
+    while ((newline = memchr(pending, '\n', pending_len)) == NULL && pending_len < size - 2) {
+        int n = read(client_socket, pending + pending_len, sizeof(pending) - pending_len);
+        if (n <= 0) {
+            if (pending_len == 0) {
+                return n;
+            }
+            break; // Connection closed after an unterminated command
+        }
+        metrics_add_bytes_in(n);
+        pending_len += n;
+    }
+
+    int len = newline != NULL ? (int)(newline - pending) + 1 : pending_len;
+    if (len > size - 2) {
+        len = size - 2;
+    }
+    memcpy(buffer, pending, len);
+    pending_len -= len;
+    memmove(pending, pending + len, pending_len);
+    if (buffer[len - 1] != '\n') {
+        buffer[len++] = '\n'; // Handlers expect the trailing newline
+    }
+    buffer[len] = '\0';
+    return len;
 }
-//end of w24da
 
 void crequest(int client_socket) {
     char buffer[1024] = {0};
     int valread;
     const char *END_MARKER = "\nEND_OF_RESPONSE\n";
     while(1) {
-        printf("serverw24$ Waiting for command from client...\n");
+        log_debug("Waiting for command from client...");
 memset(buffer, 0, sizeof(buffer));  
-        // Reading data from the client
-        valread = read(client_socket, buffer, 1024);
+        // Reading the next command from the client
+        valread = read_command(client_socket, buffer, sizeof(buffer));
         if (valread <= 0) {
             // Client disconnected or error occurred
-            printf("Client disconnected or error occurred. Exiting crequest()...\n");
+            log_info("Client disconnected or error occurred. Exiting crequest()...");
             break;
         }
+        uint64_t started = metrics_now_us();
+        int command = -1;
+        trace_begin_request(buffer);
+        log_begin_request();
         
         
          buffer[valread] = '\0';  // Ensure string is null-terminated
-    printf("Raw server buffer: [%s]\n", buffer);
-     buffer[valread] = '\0';  // Ensure string is null-terminated
-    printf("Raw server buffer: [%s]\n", buffer);
-    printf("serverw24$ Processed message from client: '%s'\n", buffer);
+    log_debug("Raw server buffer: [%s]", buffer);
+    log_info("Processed message from client: '%s'", buffer);
         
+        // w24prep <command>: run an archive command but spool the result for ranged download
+        prepare_only = strncmp(buffer, "w24prep ", 8) == 0;
+        if (prepare_only) {
+            memmove(buffer, buffer + 8, strlen(buffer + 8) + 1);
+        }
+
         // Check if the received message is "quitc"
-        if (strcmp(buffer, "quitc") == 0) {
-            printf("Client requested to quit. Exiting crequest()...\n");
+        if (strncmp(buffer, "quitc", 5) == 0) {
+            log_info("Client requested to quit. Exiting crequest()...");
             break;
         }
+        // If command is stats, report the aggregated counters
+        else if (strncmp(buffer, "stats", 5) == 0) {
+            command = CMD_STATS;
+            metrics_report(client_socket);
+            metrics_send(client_socket, END_MARKER, strlen(END_MARKER), 0); // Send the end marker
+        }
+
         // If command is dirlist -a
         else if (strncmp(buffer, "dirlist -a",10) == 0) {
-            printf("Executing dirlist -a command...\n");
-            list_directories(client_socket,get_home_directory(),"-a");
-	    send(client_socket, END_MARKER, strlen(END_MARKER), 0); // Send the end marker
-            printf("Directory list sent to client.\n");
+            command = CMD_DIRLIST;
+            log_debug("Executing dirlist -a command...");
+            if (enter_lane(client_socket, LANE_META)) {
+                uint64_t walk_started = metrics_now_us();
+                list_directories(client_socket,get_home_directory(),"-a");
+                trace_span(TRACE_WALK, walk_started);
+                lane_leave();
+            }
+	    metrics_send(client_socket, END_MARKER, strlen(END_MARKER), 0); // Send the end marker
+            log_debug("Directory list sent to client.");
         }
 
         // If command is dirlist -t
         else if (strncmp(buffer, "dirlist -t",10) == 0) {
-            printf("Executing dirlist -a command...\n");
-            list_directories(client_socket,get_home_directory(),"-t");
-            send(client_socket, END_MARKER, strlen(END_MARKER), 0); // Send the end marker
-            printf("Directory list sent to client.\n");
+            command = CMD_DIRLIST;
+            log_debug("Executing dirlist -a command...");
+            if (enter_lane(client_socket, LANE_META)) {
+                uint64_t walk_started = metrics_now_us();
+                list_directories(client_socket,get_home_directory(),"-t");
+                trace_span(TRACE_WALK, walk_started);
+                lane_leave();
+            }
+            metrics_send(client_socket, END_MARKER, strlen(END_MARKER), 0); // Send the end marker
+            log_debug("Directory list sent to client.");
         }
 
         // If command is w24fn
         else if (strncmp(buffer, "w24fn ", 6) == 0) {
+            command = CMD_W24FN;
             char *filename = buffer + 6; // Extract filename from command
             filename[strlen(filename) - 1] = '\0'; // Remove the newline character
-            printf("Searching for file: %s\n", filename);
-            send_file_info(filename, client_socket);
-            send(client_socket, END_MARKER, strlen(END_MARKER), 0); // Send the end marker
-            printf("File info sent to client.\n");
+            log_debug("Searching for file: %s", filename);
+            if (enter_lane(client_socket, LANE_META)) {
+                uint64_t walk_started = metrics_now_us();
+                send_file_info(filename, client_socket);
+                trace_span(TRACE_WALK, walk_started);
+                lane_leave();
+            }
+            metrics_send(client_socket, END_MARKER, strlen(END_MARKER), 0); // Send the end marker
+            log_debug("File info sent to client.");
+        }
+
+        // If command is w24fs
+        else if (strncmp(buffer, "w24fs ", 6) == 0) {
+            command = CMD_W24FS;
+            if (enter_lane(client_socket, LANE_META)) {
+                uint64_t walk_started = metrics_now_us();
+                handle_w24fs(client_socket, buffer);
+                trace_span(TRACE_WALK, walk_started);
+                lane_leave();
+            }
+            metrics_send(client_socket, END_MARKER, strlen(END_MARKER), 0); // Send the end marker
+        }
+
+        // If command is w24top
+        else if (strncmp(buffer, "w24top ", 7) == 0) {
+            command = CMD_W24TOP;
+            if (enter_lane(client_socket, LANE_META)) {
+                uint64_t walk_started = metrics_now_us();
+                handle_w24top(client_socket, buffer);
+                trace_span(TRACE_WALK, walk_started);
+                lane_leave();
+            }
+            metrics_send(client_socket, END_MARKER, strlen(END_MARKER), 0); // Send the end marker
+        }
+
+        // If command is w24du
+        else if (strncmp(buffer, "w24du ", 6) == 0) {
+            command = CMD_W24DU;
+            if (enter_lane(client_socket, LANE_META)) {
+                uint64_t walk_started = metrics_now_us();
+                handle_w24du(client_socket, buffer);
+                trace_span(TRACE_WALK, walk_started);
+                lane_leave();
+            }
+            metrics_send(client_socket, END_MARKER, strlen(END_MARKER), 0); // Send the end marker
+        }
+
+        // If command is w24fc
+        else if (strncmp(buffer, "w24fc ", 6) == 0) {
+            command = CMD_W24FC;
+            handle_w24fc(client_socket, buffer);
+        }
+
+        // If command is w24sum
+        else if (strncmp(buffer, "w24sum", 6) == 0 && (buffer[6] == '\n' || buffer[6] == ' ')) {
+            command = CMD_W24SUM;
+            handle_w24sum(client_socket, buffer);
         }
 
         // If command is w24fz
         else if (strncmp(buffer, "w24fz ", 6) == 0) {
+            command = CMD_W24FZ;
             handle_w24fz(client_socket, buffer);
         }
 
         // If command is w24ft
         else if (strncmp(buffer, "w24ft ", 6) == 0) {
-        handle_w24ft(client_socket, buffer);
-        
-    }
+            command = CMD_W24FT;
+            handle_w24ft(client_socket, buffer);
+        }
 
-    // If command is w24fdb
-    else if (strncmp(buffer, "w24fdb ", 6) == 0) {
-        handle_w24fdb(client_socket, buffer);
-       
-    }
+        // If command is w24fdb
+        else if (strncmp(buffer, "w24fdb ", 6) == 0) {
+            command = CMD_W24FDB;
+            handle_w24fdb(client_socket, buffer);
+        }
 
-    // If command is w24fda
-   else if (strncmp(buffer, "w24fda ", 7) == 0) {
-        handle_w24fda(client_socket, buffer);
-    
-    }
+        // If command is w24fda
+        else if (strncmp(buffer, "w24fda ", 7) == 0) {
+            command = CMD_W24FDA;
+            handle_w24fda(client_socket, buffer);
+        }
+
+        // If command is w24range, send one segment of a spooled archive
+        else if (strncmp(buffer, "w24range ", 9) == 0) {
+            command = CMD_W24RANGE;
+            handle_w24range(client_socket, buffer);
+        }
+
+        // If command is w24done, the spooled archive can go
+        else if (strncmp(buffer, "w24done ", 8) == 0) {
+            handle_w24done(client_socket, buffer);
+        }
+
+        // Anything else still gets a terminated reply so a pipelining client stays in step
+        else {
+            char *msg = "Unknown command\n";
+            metrics_send(client_socket, msg, strlen(msg), 0);
+            metrics_send(client_socket, END_MARKER, strlen(END_MARKER), 0);
+        }
 
+        if (command >= 0) {
+            metrics_record_command(command, metrics_now_us() - started);
+        }
+        trace_end_request();
+        arena_reset(&request_arena); // Everything the command allocated goes at once
     }
 
     // Close the client socket after exiting the loop
     close(client_socket);
 }
 
+//Function called for every accepted connection
+int on_new_connection(int new_socket) {
+    int opt = 1;
+    log_info("New client connected");
+    metrics_connection_accepted();
+
+    // Replies are several small sends; don't let Nagle hold the last one back waiting for an ACK
+    setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    return 0;
+}
+
 int main() {
     int server_fd, new_socket, valread;
     struct sockaddr_in address;
-    int addrlen = sizeof(address);
       char buffer[1024] = {0};
     int opt = 1;
    
@@ -580,35 +1734,53 @@ int main() {
     }
 
     // Listening for incoming connections
-    if (listen(server_fd, MAX_CLIENTS) < 0) {
+    if (listen(server_fd, LISTEN_BACKLOG) < 0) {
         perror("listen");
         exit(EXIT_FAILURE);
     }
 
-    printf("Server listening on port %d...\n", PORT);
+    shared_init(SHARED_REGION_SIZE); // Memory every process of the server shares
+    log_init("mirror2"); // Request logging goes through rings and a flusher process
+    log_info("Server listening on port %d...", PORT);
+    metrics_init(); // Shared counters for the stats command
+    trace_init("mirror2"); // Slow request log and optional Chrome trace output
+    start_result_cache("mirror2");
+    start_file_index("mirror2");
+    start_lanes();
+    shape_init(); // Bandwidth limits per connection and per server
+    content_init(); // Threads for content searches
+    archive_init(); // Order of the members in archives
+
+    admit_init(); // Session limits, the wait queue and reaping of ended sessions
+    log_attach(); // Only now: the helper processes forked above must not share the ring
 
     while(1) {
-        printf("Waiting for client request...\n");
-
-        // Accepting incoming connections
-        if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
-            perror("accept");
-            exit(EXIT_FAILURE);
-        }
+        log_debug("Waiting for client request...");
 
-        printf("New client connected\n");
+        // Next connection to serve, possibly one that waited in the queue
+        new_socket = admit_next(server_fd, on_new_connection);
 
             // Handle the connection directly
+            index_prefetch(); // The child inherits the latest index snapshot already mapped
             pid_t pid = fork();
             if (pid < 0) {
                 perror("fork failed");
-                exit(EXIT_FAILURE);
+                admit_started(pid, new_socket); // Turned away as busy
+                continue;
             }
             if (pid == 0) {  // Child process
+                admit_child();
                 close(server_fd);  // Close the server socket in the child process
+                metrics_attach();  // Claim a counter slot for this session
+                log_attach();  // And a log ring of its own
+                lane_attach(new_socket);  // Fair share of the lanes is per client address
+                shape_attach(new_socket);  // Interactive until an archive body is sent
                 crequest(new_socket);  // Handle the request
+                metrics_detach();
+                log_detach();
                 exit(EXIT_SUCCESS);
             } else {  // Parent process
+                admit_started(pid, new_socket);
                 close(new_socket);  // Close the client socket in the parent process
             }
         }
@@ -0,0 +1,18 @@
+#ifndef SERVERW24_H
+#define SERVERW24_H
+
+// Command handlers of the server that other programs link against; the
+// microbenchmark measures them on their own. Built with FILESNAP_BENCH, the
+// server's main is renamed so such a program can bring its own.
+
+// Send the directories below start_path, by name (sort_option "-a") or by
+// creation time ("-t"), as a text reply without the end marker
+void list_directories(int client_socket, const char *start_path, const char *sort_option);
+
+// Walk dir_path for a file called filename and send its details; returns 1 if found
+int search_file_recursive(const char *dir_path, const char *filename, int client_socket);
+
+// Send a whole tar file as an archive reply: its size, the bytes and their digest
+void send_tar_file(int client_socket, const char *tar_name);
+
+#endif
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/pkt_sched.h>
+
+#include "shape.h"
+#include "shared.h"
+
+// Smallest burst a bucket gets, so a low rate still sends reasonable pieces
+#define SHAPE_MIN_BURST 4096
+
+struct bucket {
+    uint64_t rate;          // bytes per second; 0 means unlimited
+    uint64_t burst;         // bytes
+    uint64_t *tat_ns;       // when the bucket will be full again ("theoretical arrival time")
+};
+
+static uint64_t conn_tat_ns = 0;    // each connection has a process of its own
+static struct bucket conn = {0, 0, &conn_tat_ns};
+static struct bucket server = {0, 0, NULL};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t read_kb(const char *name) {
+    const char *env = getenv(name);
+    long long kb = env != NULL && *env != '\0' ? atoll(env) : 0;
+    return kb > 0 ? (uint64_t)kb * 1024 : 0;
+}
+
+static void setup(struct bucket *b, const char *rate_name, const char *burst_name) {
+    b->rate = read_kb(rate_name);
+    b->burst = read_kb(burst_name);
+    if (b->burst == 0) {
+        b->burst = b->rate / 4;
+    }
+    if (b->burst < SHAPE_MIN_BURST) {
+        b->burst = SHAPE_MIN_BURST;
+    }
+}
+
+int shape_init(void) {
+    setup(&conn, "FILESNAP_CONN_RATE_KB", "FILESNAP_CONN_BURST_KB");
+    setup(&server, "FILESNAP_SERVER_RATE_KB", "FILESNAP_SERVER_BURST_KB");
+    if (server.rate > 0) {
+        server.tat_ns = shared_alloc(sizeof(uint64_t));
+        if (server.tat_ns == NULL) {
+            server.rate = 0;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void set_priority(int client_socket, int priority) {
+    setsockopt(client_socket, SOL_SOCKET, SO_PRIORITY, &priority, sizeof(priority));
+}
+
+void shape_attach(int client_socket) {
+    conn_tat_ns = 0;
+    set_priority(client_socket, TC_PRIO_INTERACTIVE);
+}
+
+void shape_bulk_begin(int client_socket) {
+    set_priority(client_socket, TC_PRIO_BULK);
+}
+
+void shape_bulk_end(int client_socket) {
+    set_priority(client_socket, TC_PRIO_INTERACTIVE);
+}
+
+size_t shape_chunk(size_t max) {
+    if (conn.rate > 0 && max > conn.burst) {
+        max = conn.burst;
+    }
+    if (server.rate > 0 && max > server.burst) {
+        max = server.burst;
+    }
+    return max;
+}
+
+// Charge bytes to a bucket; returns how long to wait until it is within its rate again
+static uint64_t charge(struct bucket *b, size_t bytes, uint64_t now) {
+    if (b->rate == 0) {
+        return 0;
+    }
+    uint64_t cost = (uint64_t)bytes * 1000000000ULL / b->rate;
+    uint64_t burst_ns = b->burst * 1000000000ULL / b->rate;
+    uint64_t tat = __atomic_load_n(b->tat_ns, __ATOMIC_RELAXED), next;
+    do {
+        // An idle bucket fills up to its burst and no further
+        next = (tat > now ? tat : now) + cost;
+    } while (!__atomic_compare_exchange_n(b->tat_ns, &tat, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return next > now + burst_ns ? next - now - burst_ns : 0;
+}
+
+void shape_sent(size_t bytes) {
+    uint64_t now = now_ns();
+    uint64_t wait = charge(&conn, bytes, now);
+    uint64_t server_wait = charge(&server, bytes, now);
+    if (server_wait > wait) {
+        wait = server_wait;
+    }
+    struct timespec ts = {(time_t)(wait / 1000000000ULL), (long)(wait % 1000000000ULL)};
+    while (wait > 0 && nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+    }
+}
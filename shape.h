@@ -0,0 +1,41 @@
+#ifndef SHAPE_H
+#define SHAPE_H
+
+#include <stddef.h>
+
+// Bandwidth shaping for archive bodies, so one large download cannot take
+// the whole uplink from every other session. Each connection and the server
+// as a whole have a token bucket: a rate, and a burst that may go out at once
+// after the sender has been idle. The server's bucket is shared by all its
+// connection handlers. Bulk senders charge both buckets for what they sent
+// and sleep until they are within both rates again.
+//
+// Text replies (dirlist, w24fn, stats, messages and the framing around
+// archives) are the interactive class: they are never held back, and the
+// socket is marked interactive for the queueing discipline except while an
+// archive body is being sent.
+//
+// Rates are read from the environment, in KB/s; 0 turns a bucket off.
+//   FILESNAP_CONN_RATE_KB     per connection (default 0)
+//   FILESNAP_CONN_BURST_KB    burst of a connection (default a quarter second at its rate)
+//   FILESNAP_SERVER_RATE_KB   per server, all connections together (default 0)
+//   FILESNAP_SERVER_BURST_KB  burst of the server (default a quarter second at its rate)
+
+// Read the rates and set up the server's bucket; call once in the parent before forking
+int shape_init(void);
+
+// Mark a new connection as interactive, in the child handling it
+void shape_attach(int client_socket);
+
+// Start and end an archive body on a connection
+void shape_bulk_begin(int client_socket);
+void shape_bulk_end(int client_socket);
+
+// Largest piece to send at once out of max, so the rates are kept smoothly
+size_t shape_chunk(size_t max);
+
+// Charge bytes of an archive body just sent, then wait as long as the
+// connection or the server is over its rate
+void shape_sent(size_t bytes);
+
+#endif
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "shared.h"
+
+#define SHARED_ALIGN 64
+
+struct shared_header {
+    size_t size;
+    size_t used;
+    // Each counter on its own cache line, so unrelated updates don't contend
+    struct {
+        uint64_t value;
+        char pad[SHARED_ALIGN - sizeof(uint64_t)];
+    } counters[SHARED_COUNTER_COUNT];
+};
+
+static struct shared_header *region = NULL;
+
+static void *map_shared(size_t size) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap shared");
+        return NULL;
+    }
+    return p;
+}
+
+int shared_init(size_t size) {
+    if (size < sizeof(struct shared_header)) {
+        size = sizeof(struct shared_header);
+    }
+    region = map_shared(size);
+    if (region == NULL) {
+        return -1;
+    }
+    region->size = size;
+    region->used = (sizeof(struct shared_header) + SHARED_ALIGN - 1) & ~(size_t)(SHARED_ALIGN - 1);
+    return 0;
+}
+
+void *shared_alloc(size_t size) {
+    size = (size + SHARED_ALIGN - 1) & ~(size_t)(SHARED_ALIGN - 1);
+    if (region != NULL && region->size - region->used >= size) {
+        void *p = (char *)region + region->used;
+        region->used += size;
+        return p;
+    }
+    if (region != NULL) {
+        fprintf(stderr, "shared: region full, mapping %zu bytes separately\n", size);
+    }
+    // Fresh anonymous pages are already zero
+    return map_shared(size);
+}
+
+// Without a region the counters are simply private to the process
+static uint64_t private_counters[SHARED_COUNTER_COUNT];
+
+static uint64_t *counter_of(enum shared_counter counter) {
+    return region != NULL ? &region->counters[counter].value : &private_counters[counter];
+}
+
+uint64_t shared_counter_add(enum shared_counter counter, uint64_t n) {
+    return __atomic_add_fetch(counter_of(counter), n, __ATOMIC_RELAXED);
+}
+
+uint64_t shared_counter_get(enum shared_counter counter) {
+    return __atomic_load_n(counter_of(counter), __ATOMIC_RELAXED);
+}
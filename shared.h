@@ -0,0 +1,36 @@
+#ifndef SHARED_H
+#define SHARED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// One shared mapping for the state that every process of a server has in
+// common: metrics slots, the tree generation, the result cache directory,
+// the file index state, the subtree summaries and a few lock-free counters.
+// The parent creates it before forking anything, so the watcher, the index
+// refresher and every connection handler see the same pages. Parts are
+// handed out once at startup and never freed.
+
+// Pages of the region are only backed once they are touched
+#define SHARED_REGION_SIZE (16 * 1024 * 1024)
+
+// Counters any process can bump without a lock
+enum shared_counter {
+    SHARED_CONNECTIONS,     // connections routed by the coordinator
+    SHARED_COUNTER_COUNT
+};
+
+// Create the region; call once in the parent before forking
+int shared_init(size_t size);
+
+// A zeroed, cache-line aligned part of the region. Before shared_init (or
+// once the region is full) the part gets an anonymous shared mapping of its
+// own, so modules work the same way in tools that don't set up the region.
+// Call only before forking. Returns NULL if no memory could be had.
+void *shared_alloc(size_t size);
+
+// Add n to a counter and return the new value
+uint64_t shared_counter_add(enum shared_counter counter, uint64_t n);
+uint64_t shared_counter_get(enum shared_counter counter);
+
+#endif
@@ -0,0 +1,81 @@
+#include <stdlib.h>
+
+#include "top.h"
+
+// Whether a ranks below b: smaller key, or the same key offered later
+static int below(const struct top_item *a, const struct top_item *b) {
+    return a->key < b->key || (a->key == b->key && a->order > b->order);
+}
+
+static void swap(struct top_item *a, struct top_item *b) {
+    struct top_item t = *a;
+    *a = *b;
+    *b = t;
+}
+
+// Move items[i] down until both children rank above it, within the first count items
+static void sift_down(struct top_item *items, size_t count, size_t i) {
+    while (1) {
+        size_t low = i, left = 2 * i + 1, right = left + 1;
+        if (left < count && below(&items[left], &items[low])) {
+            low = left;
+        }
+        if (right < count && below(&items[right], &items[low])) {
+            low = right;
+        }
+        if (low == i) {
+            return;
+        }
+        swap(&items[i], &items[low]);
+        i = low;
+    }
+}
+
+int top_init(struct top *t, size_t k) {
+    t->items = k > 0 ? malloc(k * sizeof(struct top_item)) : NULL;
+    t->count = 0;
+    t->k = k;
+    t->offered = 0;
+    return k == 0 || t->items != NULL ? 0 : -1;
+}
+
+void top_free(struct top *t) {
+    free(t->items);
+    t->items = NULL;
+    t->count = 0;
+}
+
+int top_admits(const struct top *t, int64_t key) {
+    // A later offer with the same key ranks below the root, so it has to be larger
+    return t->count < t->k || (t->k > 0 && key > t->items[0].key);
+}
+
+void *top_offer(struct top *t, int64_t key, void *value) {
+    struct top_item item = {key, t->offered++, value};
+    if (t->count < t->k) {
+        // Up from the bottom
+        size_t i = t->count++;
+        t->items[i] = item;
+        while (i > 0 && below(&t->items[i], &t->items[(i - 1) / 2])) {
+            swap(&t->items[i], &t->items[(i - 1) / 2]);
+            i = (i - 1) / 2;
+        }
+        return NULL;
+    }
+    if (t->k == 0 || !below(&t->items[0], &item)) {
+        return value;
+    }
+    void *evicted = t->items[0].value;
+    t->items[0] = item;
+    sift_down(t->items, t->count, 0);
+    return evicted;
+}
+
+size_t top_finish(struct top *t) {
+    // Heap sort: the lowest goes to the back each time, leaving the highest first
+    for (size_t n = t->count; n > 1; n--) {
+        swap(&t->items[0], &t->items[n - 1]);
+        sift_down(t->items, n - 1, 0);
+    }
+    return t->count;
+}
@@ -0,0 +1,41 @@
+#ifndef TOP_H
+#define TOP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The k items with the largest keys out of any number offered, for
+// "largest" and "newest" queries. A min-heap of k items keeps the smallest
+// kept key at the root, so an item that would not make it is turned away
+// with one comparison and memory stays at k items however many are offered.
+// Among equal keys, the ones offered first are kept.
+
+struct top_item {
+    int64_t key;
+    uint64_t order;         // when it was offered, to break ties
+    void *value;
+};
+
+struct top {
+    struct top_item *items;
+    size_t count;
+    size_t k;
+    uint64_t offered;
+};
+
+// Room for k items; returns 0, or -1 if there is no memory
+int top_init(struct top *t, size_t k);
+void top_free(struct top *t);
+
+// Whether an item with key would be kept, so callers can skip building its value
+int top_admits(const struct top *t, int64_t key);
+
+// Offer value under key. Returns the value that is no longer kept: value
+// itself if it did not make it, the one it replaced, or NULL.
+void *top_offer(struct top *t, int64_t key, void *value);
+
+// Sort the kept items in place, largest key first; the heap is used up.
+// Returns the number of items.
+size_t top_finish(struct top *t);
+
+#endif
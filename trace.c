@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+#include "metrics.h"
+
+#define TRACE_MAX_SPANS 32
+#define TRACE_BUF_SIZE 8192
+
+struct trace_span_rec {
+    int phase;
+    uint64_t start_us;
+    uint64_t end_us;
+};
+
+static const char *phase_names[TRACE_PHASE_COUNT] = {
+    "parse", "walk", "filter", "archive", "compress", "send", "queue", "hash", "order"
+};
+
+static char server[64] = "server";
+static char slow_log_path[1024];
+static const char *trace_path = NULL;
+static uint64_t slow_threshold_us = 1000000;
+
+// State of the request in progress; each forked worker handles one at a time
+static unsigned long request_seq = 0;
+static char request_id[96];
+static char request_command[256];
+static time_t request_wall;
+static uint64_t request_start_us;
+static long request_files = -1;
+static struct trace_span_rec spans[TRACE_MAX_SPANS];
+static int span_count = 0;
+static int active = 0;
+
+void trace_init(const char *server_name) {
+    snprintf(server, sizeof(server), "%s", server_name);
+
+    const char *ms = getenv("FILESNAP_SLOW_MS");
+    if (ms != NULL && *ms != '\0') {
+        slow_threshold_us = strtoull(ms, NULL, 10) * 1000;
+    }
+    const char *log = getenv("FILESNAP_SLOW_LOG");
+    if (log != NULL && *log != '\0') {
+        snprintf(slow_log_path, sizeof(slow_log_path), "%s", log);
+    } else {
+        snprintf(slow_log_path, sizeof(slow_log_path), "%s-slow.log", server_name);
+    }
+    trace_path = getenv("FILESNAP_TRACE");
+    if (trace_path != NULL && *trace_path == '\0') {
+        trace_path = NULL;
+    }
+}
+
+void trace_begin_request(const char *command) {
+    request_seq++;
+    snprintf(request_id, sizeof(request_id), "%s-%d-%lu", server, (int)getpid(), request_seq);
+
+    // Keep only the first line of the command for the logs
+    size_t len = strcspn(command, "\n");
+    if (len >= sizeof(request_command)) {
+        len = sizeof(request_command) - 1;
+    }
+    memcpy(request_command, command, len);
+    request_command[len] = '\0';
+
+    request_wall = time(NULL);
+    request_start_us = metrics_now_us();
+    request_files = -1;
+    span_count = 0;
+    active = 1;
+}
+
+void trace_span(int phase, uint64_t start_us) {
+    if (!active || span_count >= TRACE_MAX_SPANS || phase < 0 || phase >= TRACE_PHASE_COUNT) {
+        return;
+    }
+    spans[span_count].phase = phase;
+    spans[span_count].start_us = start_us;
+    spans[span_count].end_us = metrics_now_us();
+    span_count++;
+}
+
+void trace_note_files(long files) {
+    request_files = files;
+}
+
+const char *trace_request_id(void) {
+    return active ? request_id : "-";
+}
+
+// Append buf with a single write so lines from different workers never interleave
+static void append_file(const char *path, const char *buf, size_t len, const char *header) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1) {
+        perror("open trace log");
+        return;
+    }
+    if (header != NULL) {
+        flock(fd, LOCK_EX);
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size == 0) {
+            write(fd, header, strlen(header));
+        }
+    }
+    if (write(fd, buf, len) == -1) {
+        perror("write trace log");
+    }
+    if (header != NULL) {
+        flock(fd, LOCK_UN);
+    }
+    close(fd);
+}
+
+// Copy src into dst escaping characters that are special in JSON strings
+static void json_escape(char *dst, size_t size, const char *src) {
+    size_t j = 0;
+    for (size_t i = 0; src[i] != '\0' && j + 7 < size; i++) {
+        unsigned char c = (unsigned char)src[i];
+        if (c == '"' || c == '\\') {
+            dst[j++] = '\\';
+            dst[j++] = c;
+        } else if (c < 0x20) {
+            j += snprintf(dst + j, size - j, "\\u%04x", c);
+        } else {
+            dst[j++] = c;
+        }
+    }
+    dst[j] = '\0';
+}
+
+static void write_slow_log(uint64_t total_us) {
+    char buf[TRACE_BUF_SIZE];
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", localtime(&request_wall));
+
+    int len = snprintf(buf, sizeof(buf), "%s req=%s cmd=\"%s\" total=%.3fms",
+                       when, request_id, request_command, total_us / 1000.0);
+    if (request_files >= 0) {
+        len += snprintf(buf + len, sizeof(buf) - len, " files=%ld", request_files);
+    }
+    // Each span as name=+offset/duration relative to the start of the request
+    for (int i = 0; i < span_count && len < (int)sizeof(buf) - 64; i++) {
+        len += snprintf(buf + len, sizeof(buf) - len, " %s=+%.3fms/%.3fms",
+                        phase_names[spans[i].phase],
+                        (spans[i].start_us - request_start_us) / 1000.0,
+                        (spans[i].end_us - spans[i].start_us) / 1000.0);
+    }
+    len += snprintf(buf + len, sizeof(buf) - len, "\n");
+    append_file(slow_log_path, buf, len, NULL);
+}
+
+static void write_chrome_trace(uint64_t end_us) {
+    char buf[TRACE_BUF_SIZE];
+    char command[512];
+    json_escape(command, sizeof(command), request_command);
+
+    // Complete ("X") events; the file is a JSON array that viewers accept without the closing bracket
+    int pid = (int)getpid();
+    int len = snprintf(buf, sizeof(buf),
+                       "{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%lu,"
+                       "\"args\":{\"request\":\"%s\",\"files\":%ld}},\n",
+                       command, (unsigned long long)request_start_us,
+                       (unsigned long long)(end_us - request_start_us), pid, request_seq,
+                       request_id, request_files);
+    for (int i = 0; i < span_count && len < (int)sizeof(buf) - 256; i++) {
+        len += snprintf(buf + len, sizeof(buf) - len,
+                        "{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%lu,"
+                        "\"args\":{\"request\":\"%s\"}},\n",
+                        phase_names[spans[i].phase], (unsigned long long)spans[i].start_us,
+                        (unsigned long long)(spans[i].end_us - spans[i].start_us), pid, request_seq,
+                        request_id);
+    }
+    append_file(trace_path, buf, len, "[\n");
+}
+
+void trace_end_request(void) {
+    if (!active) {
+        return;
+    }
+    uint64_t end_us = metrics_now_us();
+    uint64_t total_us = end_us - request_start_us;
+    if (total_us >= slow_threshold_us) {
+        write_slow_log(total_us);
+    }
+    if (trace_path != NULL) {
+        write_chrome_trace(end_us);
+    }
+    active = 0;
+}
@@ -0,0 +1,41 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Phases a request can spend time in
+enum trace_phase {
+    TRACE_PARSE,
+    TRACE_WALK,
+    TRACE_FILTER,
+    TRACE_ARCHIVE,
+    TRACE_COMPRESS,
+    TRACE_SEND,
+    TRACE_QUEUE,        // waiting for a slot in a lane (see lane.h)
+    TRACE_HASH,         // reading files to checksum them
+    TRACE_ORDER,        // sorting archive members (see archive.h)
+    TRACE_PHASE_COUNT
+};
+
+// Read the tracing settings from the environment; call once at startup.
+//   FILESNAP_SLOW_MS   requests slower than this are written to the slow log (default 1000)
+//   FILESNAP_SLOW_LOG  slow log path (default <server_name>-slow.log)
+//   FILESNAP_TRACE     if set, every request is appended there as Chrome trace JSON
+void trace_init(const char *server_name);
+
+// Start a new request with a fresh request id; command is the raw client line
+void trace_begin_request(const char *command);
+
+// Record a span for phase that started at start_us (metrics_now_us clock) and ends now
+void trace_span(int phase, uint64_t start_us);
+
+// Attach a count (e.g. number of matched files) to the current request
+void trace_note_files(long files);
+
+// Finish the request: write it to the slow log and/or the trace file as configured
+void trace_end_request(void);
+
+// Id of the request in progress, "<server>-<pid>-<seq>", e.g. "serverw24-1234-7"
+const char *trace_request_id(void);
+
+#endif